@@ -4,14 +4,79 @@
 // the user. Initial data such as initial conditions (lives, money, enemies),
 // map details (start, end, path, lake) is requested. Then specific game 
 // commands to simulate attacks, defence and other map environment changes. 
-// This program is limited to a single step iterations from the user and cannot
-// run automatically like modern tower defence games.   
+// Each step is normally typed in by the user, but with `--auto` the game can
+// also run automatically like modern tower defence games.   
+
+// Standard C doesn't declare the POSIX functions used, such as `fseeko`, 
+// `clock_nanosleep` and `lstat`, unless asked for them.
+#define _POSIX_C_SOURCE 200809L
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <signal.h>
+#include <poll.h>
 
 #define MAP_ROWS 6
 #define MAP_COLUMNS 12
 #define OUT_OF_LIVES 0
+#define NOT_PATH -1
+#define WORD_BITS 64
+#define LAND_BITS 4
+#define LAND_MASK ((1 << LAND_BITS) - 1)
+#define HEADLESS_BUFFER_SIZE (1 << 16)
+#define TILE_WIDTH 3
+#define INPUT_BLOCK_SIZE (1 << 16)
+#define MAX_ARGS 4
+#define LOG_MAGIC "TDRL"
+#define LOG_VERSION 8
+#define LOG_CHECKPOINT_INTERVAL 4096
+#define SAVE_MAGIC "TDSV"
+#define SAVE_VERSION 6
+#define HISTORY_CHUNK 1024
+#define HISTORY_FANOUT 32
+#define HISTORY_BLOCK (1 << 20)
+#define NO_VERSION -1
+#define LANES 8
+#define ATTACK_BLOCK 8
+#define OPTIMIZE_CHUNK 16
+#define OPTIMIZE_RESULTS 10
+#define BENCH_ROWS 100
+#define BENCH_COLUMNS 100
+#define BENCH_SEED 1
+#define BENCH_OPS 1000
+#define BENCH_ENEMIES 100000
+#define AUTO_QUEUE_SIZE 256
+#define AUTO_FRAME_RATE 30
+#define PIPELINE_COMMANDS 256
+#define PIPELINE_FRAMES 4
+#define STAGE_SPINS 1000
+#define CACHE_LINE 64
+#define SERVER_EVENTS 256
+#define MESSAGE_SIZE 256
+#define WHEEL_BITS 8
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 8
+#define NO_EVENT -1
+#define MAX_BRANCHES 64
+#define NO_SEGMENT -1
+#define STATS_BUCKETS 40
 #define MONEY_EARNED 5
 #define ENEMIES 'e'
 #define TOWER 't'
@@ -21,6 +86,13 @@
 #define RAIN 'r'
 #define FLOOD 'f'
 #define TELEPORT 'c'
+#define OPTIMIZE 'o'
+#define STATS 's'
+#define DRAW 'p'
+#define CHECKPOINT 'k'
+#define BRANCH 'b'
+#define UNDO 'z'
+#define REDO 'y'
 #define RIGHT 'r'
 #define LEFT 'l'
 #define UP 'u'
@@ -51,6 +123,35 @@ enum entity {
 
 enum loop_condition {STOP, CONTINUE};
 
+// What a thread using a stage queue waits for: an item to take, a free slot
+// to add to, or for every item to have been taken.
+enum stage_wait {STAGE_TAKE, STAGE_ADD, STAGE_DRAIN};
+
+// What became of a command. Anything but RESULT_OK means the command was 
+// refused and left the game as it was, and `result_message` says why.
+enum result {
+    RESULT_OK,
+    RESULT_LAKE_OUT_OF_BOUNDS,
+    RESULT_TOWER_REFUSED,
+    RESULT_NO_FUNDS,
+    RESULT_UPGRADE_OUT_OF_BOUNDS,
+    RESULT_NO_TOWER,
+    RESULT_FULLY_UPGRADED,
+    RESULT_TELEPORT_BRANCHES,
+    RESULT_NOT_ON_PATH,
+    RESULT_BAD_BRANCH,
+    RESULT_TOO_MANY_BRANCHES,
+    RESULT_BRANCH_LOOP,
+    RESULT_NO_ROUTE,
+    RESULT_NOT_SERVED,
+    RESULT_NO_UNDO,
+    RESULT_NO_REDO,
+    RESULT_BAD_SETUP,
+    RESULT_NO_SPACING,
+    RESULT_NO_HORIZON,
+    RESULT_TOO_MANY_ENEMIES
+};
+
 enum tower_cost {
     COST_BASIC = 200,
     COST_POWER = 300,
@@ -75,11 +176,54 @@ struct tower_data {
     int power;
 };
 
-struct tile {
-    enum land_type land;
-    enum entity entity;
+// The map is stored as separate planes (struct-of-arrays), each holding one
+// value per tile in row-major order. Land and entity are packed into one 
+// byte of the `tile` plane, land in the low `LAND_BITS` bits and entity 
+// above them, so a tile is read with one load and even a map of millions 
+// of tiles stays in cache. Use `tile_land` and `tile_entity` to read them.
+// Enemies are not stored on the map, they belong to the path (see below).
+// `path_index` gives where a tile is stored in the path's plane, or NOT_PATH.
+// This is its position along the path plus the path's `base` (see below), so
+// use `path_position` to read it. Branch tiles have slots from the path's 
+// `capacity` up, and `tile_segment` finds where any path tile is.
+//
+// `damage` holds the total damage each path tile takes per attack from the
+// towers in range of it, stored by path slot like `path_index`, so an attack
+// sweeps it in path order next to the enemy counts. It is kept up to date 
+// whenever a tower is built, upgraded or destroyed, so an attack only has to
+// read it.
+//
+// Grass, water, basic towers and power towers are also kept as bitboards,
+// one bit per tile with each row packed into `words` 64-bit words, so rain
+// and floods work on 64 tiles at a time. They always match `land` and 
+// `entity`.
+//
+// `frontier` marks the water tiles that may still have grass next to them,
+// which are the only tiles a flood can spread from. It only has bits set in
+// rows `frontier_first` to `frontier_last`. `flooded` is scratch space for 
+// working out which tiles flood next.
+//
+// A `quiet` map prints no messages from its commands, so games can be 
+// replayed at full speed.
+struct map {
+    int rows;
+    int cols;
+    int quiet;
+
+    uint8_t *tile;
+    int *path_index;
+    int *damage;
+
+    int words;
+    uint64_t *grass;
+    uint64_t *water;
+    uint64_t *basic;
+    uint64_t *power;
 
-    int n_enemies;
+    uint64_t *frontier;
+    uint64_t *flooded;
+    int frontier_first;
+    int frontier_last;
 };
 
 struct coord_data {
@@ -87,914 +231,8337 @@ struct coord_data {
     int col;
 };
 
+// Settings from the command line. A headless game prints no prompts or maps,
+// only the outcome of each command and a summary at the end.
+// A game can also be recorded to a replay log, or replayed from one, 
+// starting `seek` commands in. It can be loaded from a save instead of being
+// set up, and saved when it ends. A `batch` directory of games can be played
+// at once on `threads` threads. A `bench` times each command on a scenario
+// generated from `seed`. An `auto_rate` game runs by itself, attacking and 
+// moving the enemies that many times a second. `waves` is a file of waves of
+// enemies to spawn as the game goes on. A server listens on the `serve` 
+// socket for games played by other programs, on `threads` threads.
+struct options {
+    int rows;
+    int cols;
+    int headless;
+    char *record;
+    char *replay;
+    long long seek;
+    char *load;
+    char *save;
+    char *batch;
+    int threads;
+    int bench;
+    long long seed;
+    int auto_rate;
+    char *waves;
+    char *serve;
+    int undo;
+};
+
+// Where the commands are read from. A regular file is mapped into memory 
+// whole, anything else (a terminal or pipe) is read in large blocks. 
+// `offset` counts the bytes that came before `buffer`, so errors can say 
+// where in the input they are. A `quiet` input doesn't report them. Once 
+// anything is written to its `stop` pipe, if it has one, a thread waiting 
+// for more input is woken and the input ends there.
+struct input {
+    int fd;
+    int mapped;
+    char *buffer;
+    size_t length;
+    size_t position;
+    size_t offset;
+    int quiet;
+    int stop[2];
+};
+
+// A command from the user, with its arguments in the order they are typed.
+struct command {
+    char type;
+    int args[MAX_ARGS];
+};
+
+// What happened when a command was carried out: its `type`, its `result`,
+// and for a move or attack the `count` of enemies that reached the end or
+// were destroyed. The game itself never prints; `print_event` turns these
+// into the messages a player sees.
+struct event {
+    char type;
+    int result;
+    long long count;
+};
+
+// A buffer that a whole map is drawn into before being written out at once.
+struct frame {
+    char *text;
+    size_t length;
+    size_t capacity;
+};
+
+// A replay log starts with a `log_header` holding the setup of the game, 
+// followed by the `route_length` path directions as they were typed. Then 
+// there is one fixed size `log_record` for each command. Every 
+// `LOG_CHECKPOINT_INTERVAL` commands, a CHECKPOINT record is followed by the
+// whole state of the game, so a replay can start part way through. An undo
+// or redo that worked is logged as a CHECKPOINT too, with UNDO or REDO as 
+// its third argument, and the replay restores the game from it. The log 
+// ends with an index of the checkpoints and a `log_footer`, which is found 
+// from the end of the file. Everything is in the machine's own byte order.
+struct log_header {
+    char magic[4];
+    int32_t version;
+    int32_t rows;
+    int32_t cols;
+    int32_t lives;
+    int32_t money;
+    int32_t start[2];
+    int32_t end[2];
+    int32_t enemies;
+    int32_t lake[4];
+    int32_t route_length;
+};
+
+struct log_record {
+    int32_t type;
+    int32_t args[MAX_ARGS];
+};
+
+// Where each checkpoint is in the log, and how many commands came before it.
+struct log_checkpoint {
+    int64_t command;
+    int64_t offset;
+};
+
+struct log_footer {
+    int64_t index_offset;
+    int64_t commands;
+    int32_t checkpoints;
+    char magic[4];
+};
+
+// A replay log being written, and the checkpoints written to it so far.
+struct recorder {
+    FILE *file;
+    long long commands;
+    struct log_checkpoint *index;
+    int n_checkpoints;
+    int capacity;
+};
+
+// A replay log being read. `command` counts the commands replayed so far, 
+// and `offset` is where the next record starts.
+struct replay {
+    FILE *file;
+    struct log_header header;
+    char *route;
+    struct log_footer footer;
+    struct log_checkpoint *index;
+    long long command;
+    off_t offset;
+};
+
+// A branch of the path, with its `length` tiles stored from `first` in the
+// branch planes. Its enemy counts are a ring buffer of `length + 1` slots 
+// there, like the main path's, where position `length` holds the enemies 
+// leaving it. Enemies enter it at its own spawn when `from` is NO_SEGMENT,
+// or else half of those leaving position `fork` of segment `from` turn into
+// it. They leave it onto position `join` of segment `into`.
+struct branch {
+    int first;
+    int length;
+    int head;
+    int from;
+    int fork;
+    int into;
+    int join;
+};
+
+// The path route, from `tiles[0]` (the start) to `tiles[length]` (the end),
+// and the number of enemies at each position along it.
+//
+// Enemy counts are kept in a ring buffer of `capacity` slots, where position
+// 0 is stored at `enemies[head]`. Moving every enemy forward one tile only 
+// steps `head` back one slot, instead of copying the whole path.
+// `total_enemies` is the sum of every count, so an empty path can be skipped.
+//
+// The tiles are stored `base` places into their plane of `capacity` tiles.
+// A teleporter cuts a section out of the path by moving whichever side of it
+// is shorter; when that is the start, `base` moves up behind it instead of
+// the rest of the path moving down.
+//
+// Branches are routes of extra path tiles that start either at a spawn of 
+// their own or by forking off a path tile, and join another path tile 
+// further on. The path is then a graph of segments: segment 0 is the main 
+// path, and segment `b + 1` is `branches[b]`. A branch's tiles and enemy 
+// counts are kept in the `branch_tiles` and `branch_enemies` planes of 
+// `branch_capacity` slots, whose slots come after the main path's in 
+// `path_index` and `damage`.
+struct path {
+    int length;
+    int capacity;
+    int base;
+    struct coord_data *tiles;
+
+    int head;
+    int *enemies;
+    long long total_enemies;
+
+    int n_branches;
+    int branch_capacity;
+    struct branch branches[MAX_BRANCHES];
+    struct coord_data *branch_tiles;
+    int *branch_enemies;
+};
+
+// The whole state of a game lives in one block of `size` bytes: this struct,
+// followed by every plane of its map and path. Copying the block with 
+// `copy_game` takes a snapshot of the game, and `bind_game` points the 
+// planes of a copy back at its own block.
+//
+// `kills` counts the enemies the towers have destroyed, and `ticks` counts
+// the tiles the enemies have moved.
+struct game {
+    size_t size;
+    int lives;
+    int money;
+    long long kills;
+    long long ticks;
+    struct map map;
+    struct path path;
+};
+
+// A saved game is this header followed by the game's block. The block is 
+// stored as it is in memory, so it is only read back by a build with the 
+// same `SAVE_VERSION` on the same kind of machine.
+struct save_header {
+    char magic[4];
+    int32_t version;
+    int32_t rows;
+    int32_t cols;
+    int64_t size;
+};
+
+// A game's history keeps every version of the game that a command left, as
+// a tree. Undo goes back to a version's `parent`, and redo forward to its 
+// `redo` child, the one most recently left or made. A command played after
+// an undo starts a new branch beside the one undone, which stays in the 
+// tree for `checkout_version` to return to.
+//
+// A version stores the `game`'s block in `HISTORY_CHUNK` byte chunks, 
+// found through a radix tree of nodes of `HISTORY_FANOUT` pointers, whose 
+// `root` slots each cover `span` bytes. A new version shares every chunk 
+// and node that didn't change with the version before it, so a command only
+// copies the chunks it touched and the nodes above them, and going from one
+// version to another only copies the chunks where their trees differ.
+//
+// To find what a command touched without comparing the whole block, 
+// whatever writes to the game's planes marks the chunks it wrote in 
+// `dirty`, one byte per chunk, with `mark_dirty`. Only those chunks and the
+// game's own struct, which changes with nearly every command, are compared.
+// Writes are only marked for the history being watched on the thread 
+// making them, so a game has to be watched before it is changed.
+//
+// Chunks and nodes are only freed along with the whole history, so they are
+// carved out of `HISTORY_BLOCK` byte blocks, kept in a list from `blocks`.
+struct version {
+    void **root;
+    int parent;
+    int redo;
+};
+
+struct history_block {
+    struct history_block *next;
+    size_t used;
+};
+
+struct history {
+    struct game *game;
+    size_t size;
+    size_t span;
+    struct version *versions;
+    int n_versions;
+    int capacity;
+    int current;
+    struct history_block *blocks;
+    uint8_t *dirty;
+};
+
+// How one game of a batch ended.
+struct batch_result {
+    int played;
+    int lives;
+    int money;
+    long long kills;
+    long long ticks;
+    long long enemies;
+};
+
+// The scenarios from `front` up to `back` that are still waiting for a 
+// worker. `lock` guards both ends, since other workers can steal from it.
+struct share {
+    pthread_mutex_t lock;
+    int front;
+    int back;
+};
+
+// A directory of scenarios being played by a pool of workers, with one 
+// share of the scenarios and one thread per worker.
+struct batch {
+    struct options *options;
+    char **names;
+    struct batch_result *results;
+    int n_jobs;
+    struct share *shares;
+    int n_workers;
+};
+
+struct worker {
+    struct batch *batch;
+    int id;
+    pthread_t thread;
+};
+
+// `LANES` games that share one map and path, played side by side in 
+// lockstep. Every value a game has of its own is stored lane by lane, so
+// moving or attacking works on all of the games with the same instructions.
+//
+// The lanes start as copies of `game`, and the optimizer gives each one a 
+// different tower. They then differ only in the damage their own towers add
+// along the path, and the enemies, money, lives and kills that follow from
+// it. `enemies` is a ring buffer like the path's, with `LANES` counts in 
+// each slot, and `damage` has `LANES` values for each path position. 
+// `damaged` lists the positions any lane takes damage at, which are the only
+// ones an attack looks at. The first `n_shared` of them are the ones the 
+// map's own towers reach, and `is_damaged` marks every position on the list.
+//
+// `changed` lists the slots whose counts have changed since the lanes were
+// last reset, and `is_changed` marks them, so a reset only puts those back.
+// A lane is `over` once it runs out of lives, and its results stop counting.
+struct lanes {
+    struct game *game;
+    int head;
+    int *enemies;
+    int *damage;
+
+    int *damaged;
+    int n_damaged;
+    int n_shared;
+    uint8_t *is_damaged;
+
+    int *changed;
+    int n_changed;
+    uint8_t *is_changed;
+
+    long long kills[LANES];
+    long long total_enemies[LANES];
+    int money[LANES];
+    int lives[LANES];
+    int over[LANES];
+};
+
+// A command the benchmark times, or DRAW for drawing the map. The game
+// goes back to the generated scenario every `restore` ops, outside the 
+// timing, so commands that use up the map (floods, rain and teleporters) 
+// keep doing the same amount of work. A `wet` case starts from the scenario
+// after a rain, so there is water to flood from.
+struct bench_case {
+    const char *name;
+    char type;
+    int restore;
+    int wet;
+};
+
+// A tower to try building, or upgrading to, and how the game went with it.
+struct placement {
+    int row;
+    int col;
+    int entity;
+    int cost;
+    long long kills;
+    int lives;
+};
+
+// The placements being tried on `game`. `next` is the first placement no 
+// thread has taken yet.
+struct optimizer {
+    struct game *game;
+    int horizon;
+    struct placement *placements;
+    int n_placements;
+    int next;
+};
+
+// A thread trying placements, `LANES` at a time on its own lanes.
+struct optimizer_worker {
+    struct optimizer *optimizer;
+    struct lanes *lanes;
+    pthread_t thread;
+};
+
+// A wave of enemies that joins the start of the path once the enemies have
+// moved `tick` tiles in all. Waves in the same slot of the wheel are chained
+// through `next`.
+struct wave_event {
+    long long tick;
+    int count;
+    int next;
+};
+
+// Waves waiting to spawn, in a hierarchical timing wheel. Level 0 has a slot
+// for each tick, and each level up has slots `WHEEL_SLOTS` times as long. A 
+// wave waits in the level of the highest byte where its tick differs from 
+// `now`, and moves down when `now` reaches its slot there, so it moves at 
+// most `WHEEL_LEVELS` times however far off it is. `occupied` has a bit for
+// each slot with waves in it, so empty slots are skipped a word at a time.
+struct waves {
+    struct wave_event *events;
+    int n_events;
+    int pending;
+    long long now;
+    int slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    uint64_t occupied[WHEEL_LEVELS][WHEEL_SLOTS / WORD_BITS];
+};
+
+// Commands typed into a game running by itself, waiting for the next tick.
+// The reader thread adds them behind the `length` queued from `head`, 
+// waiting while the queue is full, and sets `ended` when the input runs out.
+// `stopped` tells it the game is over.
+struct command_queue {
+    struct input *input;
+    pthread_mutex_t lock;
+    pthread_cond_t not_full;
+    struct command commands[AUTO_QUEUE_SIZE];
+    int head;
+    int length;
+    int ended;
+    int stopped;
+};
+
+// Draws copies of a game running by itself on its own thread, so a slow 
+// terminal never holds up a tick. `pending` is set while `game` holds a 
+// copy that hasn't been drawn yet, and `stopped` once there are no more.
+struct renderer {
+    struct game *game;
+    struct frame *frame;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    int pending;
+    int stopped;
+};
+
+// A bounded queue handing items from one thread to another without locks.
+// The items live in the threads' own arrays of `size` slots, a power of 
+// two. The adding thread fills slot `tail % size` then moves `tail` on, and 
+// the taking thread reads slot `head % size` then moves `head` on. Each end
+// is only moved by its own thread, so atomic loads and stores are enough, 
+// and they are padded out to cache lines of their own. A thread that waits
+// spins for a while, then sleeps on `changed` counted in `sleepers`, so the
+// other thread knows to wake it. Once `stopped`, nothing more is added.
+struct stage_queue {
+    size_t head;
+    char head_padding[CACHE_LINE - sizeof(size_t)];
+    size_t tail;
+    char tail_padding[CACHE_LINE - sizeof(size_t)];
+    size_t size;
+    int sleepers;
+    int stopped;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+};
+
+// A command from the parser, and what `scan_command` returned for it: 1, or
+// 0 if one of its arguments was malformed.
+struct parsed_command {
+    struct command command;
+    int scanned;
+};
+
+// A game being typed in and drawn, in three stages on threads of their own.
+// The parser reads commands into `parsed`, through the `commands` queue. The
+// game thread carries them out, and through the `frames` queue hands the 
+// drawer the `messages` each one printed, a `snapshot` of the game after it
+// and whether the game goes on. The drawer prints them, drawing each 
+// snapshot into `frame`. With `drop_stale`, it skips a snapshot when a newer
+// one is already waiting, so a slow terminal doesn't hold up the game.
+struct pipeline {
+    struct options *options;
+    struct input *input;
+    struct frame *frame;
+    int drop_stale;
+    struct stage_queue commands;
+    struct parsed_command parsed[PIPELINE_COMMANDS];
+    struct stage_queue frames;
+    struct frame *messages[PIPELINE_FRAMES];
+    struct game *snapshots[PIPELINE_FRAMES];
+    int conditions[PIPELINE_FRAMES];
+    pthread_t parser;
+    pthread_t drawer;
+};
+
+// Where the messages printed on a thread go instead of stdout, if anywhere.
+static __thread struct frame *message_sink;
+
+// The history whose game's writes are marked on a thread, if any.
+static __thread struct history *watched_history;
+
+// A client of the server, playing its own game. The `game` and its 
+// `history`, kept only with `--undo`, are only allocated once its whole 
+// setup has arrived, and `input` only holds the end of what the client has
+// sent that isn't a whole command yet, so a session that isn't sending 
+// anything costs little more than its socket.
+// `output` holds what the socket wouldn't take yet, from `output_sent` on,
+// and the session is `writing` while it waits to send the rest. It has
+// `ended` once the client has finished sending or the game is over, and is
+// closed as soon as everything has been sent.
+struct session {
+    int fd;
+    struct game *game;
+    struct history *history;
+    char *input;
+    size_t input_length;
+    char *output;
+    size_t output_length;
+    size_t output_sent;
+    int writing;
+    int ended;
+    struct session *prev;
+    struct session *next;
+};
+
+// A thread of the server, waiting on its own epoll instance for the 
+// listening socket and the sessions it has accepted. Only this thread ever 
+// touches its sessions, so nothing is locked. While it serves one, `buffer`
+// holds what the session has sent, `text` what goes back to it and `route`
+// the path of a setup. The `wake` pipe becomes readable to stop the thread.
+struct server_thread {
+    struct options *options;
+    pthread_t thread;
+    int epoll;
+    int listener;
+    int wake;
+    struct session *sessions;
+    char *buffer;
+    size_t buffer_size;
+    char *text;
+    size_t text_length;
+    size_t text_size;
+    char *route;
+};
+
+// Counters for the commands typed into a game, kept only in a build with 
+// DEFENCE_STATS defined. While a command runs, the functions it calls add 
+// the tiles they touch and the enemies they move and destroy to 
+// `stat_counts` (each thread has its own). The main loop then adds those to
+// the `command_stats` of the command's type, or DRAW for drawing the map, 
+// with how long it took. `latency` counts the commands that took from 2^i 
+// up to 2^(i+1) nanoseconds in slot i.
+#ifdef DEFENCE_STATS
+struct stat_counts {
+    long long tiles;
+    long long moved;
+    long long destroyed;
+};
+
+struct command_stats {
+    long long calls;
+    long long repeats;
+    long long tiles;
+    long long moved;
+    long long destroyed;
+    long long total_ns;
+    long long max_ns;
+    long long latency[STATS_BUCKETS];
+};
+
+static __thread struct stat_counts stat_counts;
+static struct command_stats command_stats[UCHAR_MAX + 1];
+#define STATS_ADD(counter, n) (stat_counts.counter += (n))
+#else
+#define STATS_ADD(counter, n) ((void)0)
+#endif
+
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////  YOUR FUNCTION PROTOTYPE  /////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
-int scan_int(void);
-struct coord_data scan_coords(void);
-int test_point(int row, int col);
-void add_enemies(struct tile map[MAP_ROWS][MAP_COLUMNS], 
-                 struct coord_data start);
-int test_lake (struct coord_data lake, int height, int width);
-void create_lake(struct tile map[MAP_ROWS][MAP_COLUMNS]);
+struct input *open_input(int fd);
+void close_input(struct input *input);
+int open_stop(struct input *input);
+void stop_input(struct input *input);
+int peek_input(struct input *input);
+int scan_char(struct input *input);
+int scan_number(struct input *input, int *number);
+int scan_int(struct input *input);
+struct coord_data scan_coords(struct input *input);
+int command_args(char type);
+int scan_command(struct input *input, struct command *command);
+int scan_options(int argc, char *argv[], struct options *options);
+void print_prompt(struct options *options, char *prompt);
+void print_text_list(const char *format, va_list values);
+void print_text(const char *format, ...);
+void print_message(struct map *map, const char *format, ...);
+void scan_setup(struct game *game, struct options *options, 
+                struct input *input, struct frame *frame, char *route,
+                struct log_header *header);
+uint64_t *bit_word(struct map *map, uint64_t *plane, int row, int col);
+void set_bit(struct map *map, uint64_t *plane, int row, int col, int value);
+void set_land(struct map *map, int row, int col, int land);
+int tile_land(struct map *map, int index);
+int tile_entity(struct map *map, int index);
+void set_tile_land(struct map *map, int index, int land);
+void set_tile_entity(struct map *map, int index, int entity);
+int test_free_grass(struct map *map, int index);
+int tile_index(struct map *map, int row, int col);
+int test_point(struct map *map, int row, int col);
+int *path_enemies(struct path *path, int position);
+void mark_enemies(struct path *path, int position, int count);
+int path_position(struct map *map, struct path *path, int row, int col);
+int *segment_enemies(struct path *path, int segment, int position);
+int tile_segment(struct map *map, struct path *path, int row, int col, 
+                 int *position);
+int clamp_int(long long value);
+int add_enemies(struct path *path, int spawn);
+void add_frontier(struct map *map, int row, int col);
+void add_wet_neighbours(struct map *map, int row, int col);
+int test_lake(struct map *map, struct coord_data lake, int height, int width);
+int create_lake(struct map *map, struct coord_data lake, int height, 
+                int width);
 int test_path(struct coord_data position, struct coord_data end);
-void create_path(struct tile map[MAP_ROWS][MAP_COLUMNS], int *path_length,
-                 struct coord_data path[MAP_ROWS * MAP_COLUMNS], 
-                 struct coord_data start, struct coord_data end);
-void create_tower(struct tile map[MAP_ROWS][MAP_COLUMNS], int *money);
-int move_enemies(struct tile map[MAP_ROWS][MAP_COLUMNS], int *lives,
-                 struct coord_data path[MAP_ROWS * MAP_COLUMNS], 
-                 struct coord_data start, struct coord_data end, 
-                 int path_length, int money);
-void test_upgrade_tower(struct tile map[MAP_ROWS][MAP_COLUMNS],
-                        struct coord_data tower, int *money, int cost);
-void upgrade_tower(struct tile map[MAP_ROWS][MAP_COLUMNS], int *money);
-int attack_tower_type(struct tile map[MAP_ROWS][MAP_COLUMNS],
-                      struct coord_data path[MAP_ROWS * MAP_COLUMNS], 
-                      int tower, int range, int power, int i);
-void attack_total(struct tile map[MAP_ROWS][MAP_COLUMNS], int path_length,
-                  struct coord_data path[MAP_ROWS * MAP_COLUMNS], int *money);
+void move_position(struct coord_data *position, int direction);
+void add_path_tile(struct map *map, struct path *path, 
+                   struct coord_data position);
+int step_path(struct map *map, struct path *path, 
+              struct coord_data *position, int direction, 
+              struct coord_data end);
+int create_path(struct map *map, struct path *path,
+                struct coord_data start, struct coord_data end,
+                struct input *input, char *route);
+struct tower_data tower_stats(int entity);
+void spread_damage(struct map *map, int row, int col, int entity, int sign);
+void change_tower(struct map *map, int row, int col, int entity);
+int create_tower(struct map *map, int *money, struct coord_data tower);
+long long step_branches(struct path *path, int repeat);
+long long move_enemies(struct path *path, int *lives, int repeat);
+int test_upgrade_tower(struct map *map, struct coord_data tower, int *money,
+                       int cost);
+int upgrade_tower(struct map *map, int *money, struct coord_data tower);
+long long attack_run(int *enemies, int *damage, int n_tiles, int repeat);
+long long attack_ring(int *enemies, int capacity, int head, int *damage, 
+                      int length, int repeat);
+long long attack_total(struct map *map, struct path *path, int *money, 
+                       int repeat);
 int test_rain(int ordinate, int offset, int spacing);
-void delete_tower(struct tile map[MAP_ROWS][MAP_COLUMNS],
-                  int row, int col);
-void create_rain(struct tile map[MAP_ROWS][MAP_COLUMNS]);
-void copy_2d_array(struct tile map[MAP_ROWS][MAP_COLUMNS], 
-                   struct tile map_copy[MAP_ROWS][MAP_COLUMNS]);
-void flood_tile(int row, int col, struct tile map[MAP_ROWS][MAP_COLUMNS]);
-void flood_surrouning(struct tile map[MAP_ROWS][MAP_COLUMNS], 
-                      struct tile map_copy[MAP_ROWS][MAP_COLUMNS],
-                      int row, int col);
-void create_flood(struct tile map[MAP_ROWS][MAP_COLUMNS]);
-void copy_1d_array(int *length, struct coord_data original[MAP_ROWS * MAP_COLUMNS], 
-                   struct coord_data copy[MAP_ROWS * MAP_COLUMNS]);
-void delete_path(struct tile map[MAP_ROWS][MAP_COLUMNS], int *path_length,
-                 struct coord_data path[MAP_ROWS * MAP_COLUMNS]);
-void create_tele_path(int *path_length, int start_tele, int end_tele,
-                      struct coord_data path[MAP_ROWS * MAP_COLUMNS],
-                      struct coord_data path_copy[MAP_ROWS * MAP_COLUMNS],
-                      struct tile map[MAP_ROWS][MAP_COLUMNS],
-                      struct tile map_copy[MAP_ROWS][MAP_COLUMNS], 
-                      struct coord_data end);
-void create_teleporter(struct tile map[MAP_ROWS][MAP_COLUMNS], int *path_length,
-                       struct coord_data path[MAP_ROWS * MAP_COLUMNS],
-                       struct coord_data end);
+void flood_bits(struct map *map, int row, int word, uint64_t bits);
+void create_rain(struct map *map, struct coord_data spacing, 
+                 struct coord_data offset);
+void spread_flood(struct map *map, int row);
+void create_flood(struct map *map, int repeat);
+void delete_path(struct map *map, struct path *path, int first, int last);
+void mark_moved(struct map *map, struct path *path, int position, 
+                int count);
+void create_tele_path(struct map *map, struct path *path, 
+                      int start_tele, int end_tele);
+int create_teleporter(struct map *map, struct path *path,
+                      struct coord_data tele_1, struct coord_data tele_2);
+int direction_land(struct coord_data tile, struct coord_data next);
+int tile_damage(struct map *map, int row, int col);
+int reaches_tile(struct path *path, int segment, int position, int target, 
+                 int target_position, int *entered);
+int find_route(struct map *map, struct coord_data from, int fork, 
+               struct coord_data to, struct coord_data *route, int room);
+int create_branch(struct map *map, struct path *path, 
+                  struct coord_data from, struct coord_data to);
+int apply_command(struct game *game, struct command *command, 
+                  struct event *event);
+const char *result_message(int result);
+void print_result(struct map *map, int result);
+int event_text(struct event *event, char *text, size_t size);
+void print_event(struct map *map, struct event *event);
+int show_command(struct game *game, struct command *command);
+int run_command(struct game *game, struct command *command);
+#ifdef DEFENCE_STATS
+void count_stats(struct command *command, long long elapsed);
+#endif
+void draw_game(struct game *game, struct frame *frame);
+const char *command_name(char type);
+void print_stats(void);
+int summary_text(struct game *game, char *text, size_t size);
+void print_summary(struct game *game);
 int game_over(void);
+int write_block(FILE *file, const void *data, size_t size);
+int read_block(FILE *file, void *data, size_t size);
+void *place_plane(char *base, size_t *offset, size_t size);
+size_t layout_game(struct game *game, char *base);
+void bind_game(struct game *game);
+struct game *allocate_game(int rows, int cols);
+void free_game(struct game *game);
+void copy_game(struct game *copy, struct game *game);
+void snapshot_game(struct game *copy, struct game *game);
+struct game *clone_game(struct game *game);
+int write_game(FILE *file, struct game *game);
+int segment_length(struct path *path, int segment);
+int test_branches(struct path *path);
+int test_path_tile(struct map *map, struct coord_data tile, int slot);
+int test_planes(struct game *game);
+int read_game(FILE *file, struct game *game);
+int save_game(struct game *game, const char *name);
+struct game *load_game(const char *name);
+void *history_memory(struct history *history, size_t size);
+void watch_history(struct history *history);
+void mark_dirty(const void *start, size_t length);
+int range_dirty(struct history *history, size_t start, size_t end);
+void **store_chunks(struct history *history, void **node, size_t offset, 
+                    size_t span);
+void load_chunks(struct history *history, void **from, void **to, 
+                 size_t offset, size_t span);
+struct history *allocate_history(struct game *game);
+void free_history(struct history *history);
+int commit_version(struct history *history);
+void checkout_version(struct history *history, int version);
+int rewind_version(struct history *history, char type);
+int apply_history(struct history *history, struct command *command, 
+                  struct event *event);
+struct recorder *open_recorder(const char *name, struct log_header *header,
+                               char *route);
+void record_checkpoint(struct recorder *recorder, struct game *game, 
+                       char type);
+void record_command(struct recorder *recorder, struct game *game, 
+                    struct command *command);
+int close_recorder(struct recorder *recorder);
+struct replay *open_replay(const char *name);
+void close_replay(struct replay *replay);
+int test_setup(struct log_header *header, char *route);
+int apply_setup(struct game *game, struct log_header *header, char *route);
+int start_replay(struct replay *replay, struct game *game);
+int next_record(struct replay *replay, struct game *game, 
+                struct command *command);
+int seek_replay(struct replay *replay, struct game *game, long long target);
+int run_replay(struct options *options);
+int play_input(struct game *game, struct options *options, 
+               struct input *input);
+struct game *play_replay(struct replay *replay);
+void run_scenario(const char *name, struct options *options, 
+                  struct batch_result *result);
+int take_job(struct batch *batch, int id);
+void *run_worker(void *data);
+int compare_names(const void *first, const void *second);
+char **list_scenarios(const char *directory, int *n_names);
+void free_names(char **names, int n_names);
+void print_batch_report(struct batch *batch);
+int run_batch(struct options *options);
+struct lanes *allocate_lanes(struct game *game);
+void free_lanes(struct lanes *lanes);
+void reset_lanes(struct lanes *lanes);
+int *lane_enemies(struct lanes *lanes, int position);
+void lanes_change_tower(struct lanes *lanes, int lane, int row, int col, 
+                        int entity);
+void lanes_attack(struct lanes *lanes, int repeat);
+void lanes_move(struct lanes *lanes, int repeat);
+int lanes_running(struct lanes *lanes);
+int reaches_path(struct map *map, int row, int col, int entity);
+struct placement *list_placements(struct game *game, int *n_placements);
+void try_placements(struct lanes *lanes, struct placement *placements, 
+                    int n_placements, int horizon);
+void *run_optimizer(void *data);
+int compare_placements(const void *first, const void *second);
+void optimize_towers(struct game *game, int horizon);
+uint64_t next_random(uint64_t *state);
+int random_below(uint64_t *state, int n);
+void generate_setup(struct log_header *header, char *route, int rows, 
+                    int cols, uint64_t *state);
+int generate_towers(struct game *game, uint64_t *state);
+void generate_enemies(struct game *game);
+void generate_command(struct game *game, char type, uint64_t *state,
+                      struct command *command);
+long long clock_ns(void);
+long max_rss_kb(void);
+long long time_bench_case(struct game *game, struct game *scenario,
+                          const struct bench_case *bench_case, 
+                          struct command *commands, struct frame *frame);
+int run_bench(struct options *options);
+struct waves *load_waves(const char *name, long long start);
+void free_waves(struct waves *waves);
+void schedule_wave(struct waves *waves, int event);
+int take_slot(struct waves *waves, int level, int slot);
+long long next_wave(struct waves *waves);
+void advance_waves(struct waves *waves, long long tick);
+void spawn_waves(struct game *game, struct waves *waves, 
+                 struct recorder *recorder);
+void rewind_game(struct game *game, struct command *command, 
+                 struct history *history, struct recorder *recorder);
+int play_command(struct game *game, struct command *command, 
+                 struct waves *waves, struct recorder *recorder,
+                 struct history *history);
+void *read_commands(void *data);
+int take_command(struct command_queue *queue, struct command *command, 
+                 int *ended);
+void *run_renderer(void *data);
+int hand_frame(struct renderer *renderer, struct game *game);
+void wait_until(long long deadline);
+void run_auto(struct game *game, struct options *options, 
+              struct input *input, struct frame *frame,
+              struct waves *waves, struct recorder *recorder);
+struct frame *allocate_frame(int rows, int cols);
+void free_frame(struct frame *frame);
+char *reserve_frame(struct frame *frame, size_t length);
+void init_stage_queue(struct stage_queue *queue, size_t size);
+void destroy_stage_queue(struct stage_queue *queue);
+size_t stage_length(struct stage_queue *queue);
+int stage_ready(struct stage_queue *queue, int wait);
+void wait_stage(struct stage_queue *queue, int wait);
+void wake_stage(struct stage_queue *queue);
+int reserve_stage(struct stage_queue *queue, size_t *slot);
+void publish_stage(struct stage_queue *queue);
+int peek_stage(struct stage_queue *queue, size_t *slot);
+void release_stage(struct stage_queue *queue);
+void stop_stage(struct stage_queue *queue);
+void *run_parser(void *data);
+void *run_drawer(void *data);
+void free_pipeline(struct pipeline *pipeline);
+int run_pipeline(struct game *game, struct options *options, 
+                 struct input *input, struct frame *frame,
+                 struct waves *waves, struct recorder *recorder,
+                 struct history *history);
+void run_commands(struct game *game, struct options *options, 
+                  struct input *input, struct frame *frame,
+                  struct waves *waves, struct recorder *recorder,
+                  struct history *history);
+void scan_header(struct input *input, struct log_header *header, 
+                 char *route, int rows, int cols);
+int append_text(struct server_thread *thread, const char *text, 
+                size_t length);
+int serve_input(struct server_thread *thread, struct session *session,
+                size_t length, size_t *used);
+long long send_text(struct session *session, const char *text, 
+                    size_t length);
+void close_session(struct server_thread *thread, struct session *session);
+void accept_session(struct server_thread *thread);
+void watch_session(struct server_thread *thread, struct session *session);
+void send_session(struct server_thread *thread, struct session *session);
+void read_session(struct server_thread *thread, struct session *session);
+void *run_server_thread(void *data);
+int start_server_thread(struct server_thread *thread, 
+                        struct options *options, int listener, int wake);
+void stop_server_thread(struct server_thread *thread);
+int open_listener(const char *name);
+int run_server(struct options *options);
 
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////// PROVIDED FUNCTION PROTOTYPE  ////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
-void initialise_map(struct tile map[MAP_ROWS][MAP_COLUMNS]);
-void print_map(struct tile map[MAP_ROWS][MAP_COLUMNS], int lives, int money);
-void print_tile(struct tile tile, int entity_print);
-
-int main(void) {
-    // This `map` variable is a 2D array of `struct tile`s.
-    // It is `MAP_ROWS` x `MAP_COLUMNS` in size (which is 6x12 for this
-    // assignment!)
-    struct tile map[MAP_ROWS][MAP_COLUMNS];
-
-    // This will initialise all tiles in the map to have GRASS land and EMPTY
-    // entity values.
-    initialise_map(map);
-    
-    // This scans in lives, money and start/ending points.
-    printf("Starting Lives: ");
-    int lives = scan_int();
-    printf("Starting Money($): ");
-    int money = scan_int();
-    printf("Start Point: ");
-    struct coord_data start = scan_coords();
-    printf("End Point: ");
-    struct coord_data end = scan_coords();
-
-    // This changes the land value for the start and end points on the camp.
-    map[start.row][start.col].land = PATH_START;
-    map[end.row][end.col].land = PATH_END;
-
-    print_map(map, lives, money);
-
-    // This scans in number of initial enemies after checking it is valid
-    printf("Initial Enemies: ");
-    add_enemies(map, start);
-
-    print_map(map, lives, money);
-    
-    // This creates the lake after checking it is valid
-    printf("Enter Lake: "); 
-    create_lake(map);
-    
-    print_map(map, lives, money);       
-
-    // This updates the map with the provided path
-    // And also stores the path length, and coordinates of the path route
-    int path_length = 0;
-    struct coord_data path[MAP_ROWS * MAP_COLUMNS];
-    create_path(map, &path_length, path, start, end);
+void initialise_map(struct map *map);
+void print_map(struct map *map, struct path *path, int lives, int money,
+               struct frame *frame);
+int print_tile(struct map *map, struct path *path, int row, int col, 
+               int entity_print, struct frame *frame);
 
-    print_map(map, lives, money);     
+// A DEFENCE_LIBRARY build leaves out `main`, so the game can be built into
+// another program and played through `apply_command`.
+#ifndef DEFENCE_LIBRARY
+int main(int argc, char *argv[]) {
+    // The map size defaults to `MAP_ROWS` x `MAP_COLUMNS` (6x12), but can be
+    // given on the command line as `./defence <rows> <columns>`.
+    struct options options;
+    if (!scan_options(argc, argv, &options)) {
+        fprintf(stderr, "Usage: %s [--headless] [--record log] [--save file] "
+                "[--auto rate] [--waves file] [--undo] [rows columns]\n"
+                "       %s [--headless] [--save file] [--auto rate] "
+                "[--waves file] [--undo] --load file\n"
+                "       %s --replay log [--seek command]\n"
+                "       %s --batch directory [--threads n] [--undo] "
+                "[rows columns]\n"
+                "       %s --bench [--seed n] [rows columns]\n"
+                "       %s --serve socket [--threads n] [--undo] "
+                "[rows columns]\n",
+                argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
+        return 1;
+    }
+    if (options.replay != NULL) {
+        return run_replay(&options);
+    }
+    if (options.batch != NULL) {
+        return run_batch(&options);
+    }
+    if (options.bench) {
+        return run_bench(&options);
+    }
+    if (options.serve != NULL) {
+        return run_server(&options);
+    }
 
-    // Loops through the commands provided by the user
-    printf("Enter Command: ");
-    int game_condition = CONTINUE;
-    char command;
-    while (game_condition == CONTINUE && scanf(" %c", &command) != EOF) {
-        // Adds enemies to the starting square.
-        if (command == ENEMIES) {
-            add_enemies(map, start);
+    // The `game` holds the map and the path in one block on the heap, 
+    // either new or loaded from a save. Then there is the `frame` buffer the
+    // map is drawn into and the `input` the commands come from. `route` 
+    // keeps the path directions as they were typed, for the replay log.
+    struct game *game;
+    if (options.load != NULL) {
+        game = load_game(options.load);
+        if (game == NULL) {
+            fprintf(stderr, "Error: Could not load a game from %s.\n", 
+                    options.load);
+            return 1;
         }
-        // Creates a Tower and adds it to the map. 
-        else if (command == TOWER) {
-            create_tower(map, &money);
+    } else {
+        game = allocate_game(options.rows, options.cols);
+    }
+    int rows = options.load != NULL ? game->map.rows : options.rows;
+    int cols = options.load != NULL ? game->map.cols : options.cols;
+    struct input *input = open_input(STDIN_FILENO);
+    char *route = malloc((size_t)rows * cols + 1);
+    struct frame *frame = NULL;
+    if (!options.headless) {
+        frame = allocate_frame(rows, cols);
+    }
+    if (
+        game == NULL || input == NULL || route == NULL ||
+        (!options.headless && frame == NULL)
+    ) {
+        fprintf(stderr, "Error: Not enough memory for a %dx%d map.\n", 
+                rows, cols);
+        if (game != NULL) {
+            free_game(game);
         }
-        // Moves the enemies down the path.
-        else if (command == MOVE) {
-            game_condition = move_enemies(map, &lives, path, start, end, 
-                                          path_length, money);
+        if (input != NULL) {
+            close_input(input);
         }
-        // Upgrades the tower. 
-        else if (command == UPGRADE) {
-            upgrade_tower(map, &money);
+        free(route);
+        if (frame != NULL) {
+            free_frame(frame);
         }
-        // The towers deal damage and reduces the number of enemies in range. 
-        else if (command == ATTACK) {
-            attack_total(map, path_length, path, &money);
+        return 1;
+    }
+    if (options.headless) {
+        // Without prompts, nothing needs to be shown before reading input.
+        setvbuf(stdout, NULL, _IOFBF, HEADLESS_BUFFER_SIZE);
+    }
+
+    struct map *map = &game->map;
+    struct path *path = &game->path;
+    struct recorder *recorder = NULL;
+    if (options.load != NULL) {
+        // A loaded game is already set up.
+        print_map(map, path, game->lives, game->money, frame);
+    } else {
+        struct log_header header;
+        scan_setup(game, &options, input, frame, route, &header);
+        // Everything so far is the setup of the game, which starts the log.
+        if (options.record != NULL) {
+            recorder = open_recorder(options.record, &header, route);
+            if (recorder == NULL) {
+                fprintf(stderr, "Error: Could not create the replay log "
+                        "%s.\n", options.record);
+            }
         }
-        // creates a pattern of water tiles on the map
-        else if (command == RAIN) {
-            create_rain(map);
+    }
+
+    // The waves due at the start join the game straight away.
+    struct waves *waves = NULL;
+    if (options.waves != NULL) {
+        waves = load_waves(options.waves, game->ticks);
+        if (waves == NULL) {
+            fprintf(stderr, "Error: Could not read the waves in %s.\n",
+                    options.waves);
+        } else {
+            spawn_waves(game, waves, recorder);
         }
-        // Changes tiles adjacent to water into water tiles.
-        else if (command == FLOOD) {
-            create_flood(map);
+    }
+
+    // Loops through the commands provided by the user, unless the game runs
+    // by itself. When the map is drawn, reading, playing and drawing each 
+    // get a thread of their own.
+    if (options.auto_rate > 0) {
+        run_auto(game, &options, input, frame, waves, recorder);
+    } else {
+        // A game played step by step keeps its history for undo and redo 
+        // only when asked to, since every command then has to be compared.
+        struct history *history = NULL;
+        if (options.undo) {
+            history = allocate_history(game);
+            if (history == NULL) {
+                fprintf(stderr, "Error: Not enough memory to keep the "
+                        "game's history.\n");
+            }
         }
-        else if (command == TELEPORT) {
-            create_teleporter(map, &path_length, path, end);
+        print_prompt(&options, "Enter Command: ");
+        if (
+            options.headless || 
+            !run_pipeline(game, &options, input, frame, waves, recorder, 
+                          history)
+        ) {
+            run_commands(game, &options, input, frame, waves, recorder, 
+                         history);
         }
-        if (game_condition) {
-            print_map(map, lives, money);
-            printf("Enter Command: ");
+        if (history != NULL) {
+            free_history(history);
         }
     }
 
+    if (recorder != NULL && !close_recorder(recorder)) {
+        fprintf(stderr, "Error: Could not write the replay log %s.\n",
+                options.record);
+    }
+    if (options.save != NULL && !save_game(game, options.save)) {
+        fprintf(stderr, "Error: Could not save the game to %s.\n",
+                options.save);
+    }
+    if (options.headless) {
+        print_summary(game);
+    }
+    if (waves != NULL) {
+        free_waves(waves);
+    }
+    free_game(game);
+    close_input(input);
+    free(route);
+    if (frame != NULL) {
+        free_frame(frame);
+    }
     return game_over();
 }
+#endif
+
 ////////////////////////////////////////////////////////////////////////////////
 /////////////////////////////  YOUR FUNCTIONS //////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 
 /**
- * Scans in an integer input, which will be used as a game statistic
- *
+ * Opens the input for reading. A regular file is mapped into memory, 
+ * anything else gets a buffer to read blocks into.
+ * 
  * Parameters:
- *     none
+ *     fd - the file descriptor to read from
  * Returns:
- *     input - an integer scanned in from the compiler
+ *     input - the opened input
+ *     NULL - if there is not enough memory
  */
-int scan_int(void) {
-    int input;
-    scanf(" %d", &input);
-    return input;
-}
+struct input *open_input(int fd) {
+    struct input *input = malloc(sizeof *input);
+    if (input == NULL) {
+        return NULL;
+    }
+    input->fd = fd;
+    input->mapped = 0;
+    input->length = 0;
+    input->position = 0;
+    input->offset = 0;
+    input->quiet = 0;
+    input->stop[0] = -1;
+    input->stop[1] = -1;
 
-/**
- * This struct stores the x and y coordinates of a specified position
- *
- * Parameters:
- *     none
- * Returns:
- *     data - a struct of 2 integers scanned in from the compiler
- */
-struct coord_data scan_coords(void) {
-    struct coord_data data;
-    data.row = scan_int();
-    data.col = scan_int();
-    return data;
+    struct stat info;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+        void *mapping = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, 
+                             fd, 0);
+        if (mapping != MAP_FAILED) {
+            input->mapped = 1;
+            input->buffer = mapping;
+            input->length = info.st_size;
+            return input;
+        }
+    }
+    input->buffer = malloc(INPUT_BLOCK_SIZE);
+    if (input->buffer == NULL) {
+        free(input);
+        return NULL;
+    }
+    return input;
 }
 
 /**
- * Adds enemies to the starting position, if number of enemies is valid
-
+ * Closes the input, freeing its buffer or mapping.
  * 
  * Parameters:
- *     map - The map to initialise.
- *     spawn - number to spawn in
- *    
+ *     input - the input to close
  * Returns:
- *     Nothing.
+ *     nothing
  */
-void add_enemies(struct tile map[MAP_ROWS][MAP_COLUMNS], 
-                 struct coord_data start) {
-    int spawn = scan_int();
-    // Check to ensure number of enemies is valid
-    if (spawn > 0) {
-        // Adds the enemies and sets entity to ENEMY
-        if (map[start.row][start.col].entity == ENEMY) {
-            map[start.row][start.col].n_enemies += spawn;
-        } else {
-            map[start.row][start.col].entity = ENEMY;
-            map[start.row][start.col].n_enemies = spawn;
-        }
+void close_input(struct input *input) {
+    if (input->mapped) {
+        munmap(input->buffer, input->length);
+    } else {
+        free(input->buffer);
     }
+    if (input->stop[0] >= 0) {
+        close(input->stop[0]);
+        close(input->stop[1]);
+    }
+    free(input);
 }
 
 /**
- * Tests a set of coordinates to see if they lie within the map boundaries
+ * Gives an input a `stop` pipe, so that the thread reading it can be 
+ * stopped by another while it waits for more.
  * 
  * Parameters:
- *     row - index 0 component of coordinate
- *     col - index 1 component of coordinate
+ *     input - the input
  * Returns:
- *     1 - if within the bounds
- *     0 - if out of bounds
+ *     1 - if the input can be stopped
+ *     0 - if not.
  */
-int test_point(int row, int col) {
-    return row >= 0 && 
-           col >= 0 &&
-           row < MAP_ROWS &&
-           col < MAP_COLUMNS;
+int open_stop(struct input *input) {
+    return input->stop[0] >= 0 || pipe(input->stop) == 0;
 }
 
 /**
- * Tests if the lake can exists by testing if boundary points sit in map
+ * Ends an input with a `stop` pipe for the thread reading it, waking it if
+ * it is waiting for more. The pipe stays readable, so the input stays 
+ * ended.
  * 
  * Parameters:
- *     lake - start coordinates of the lake
- *     lake_size - dimensions of the lake
+ *     input - the input
  * Returns:
- *     1 - if points within boundary.
- *     0 - if not.
+ *     nothing
  */
-int test_lake(struct coord_data lake, int height, int width) {
-    int lake_edge_row = lake.row + height - 1;
-    int lake_edge_col = lake.col + width - 1;
-    return test_point(lake.row, lake.col)  &&
-           test_point(lake_edge_row, lake_edge_col);
+void stop_input(struct input *input) {
+    if (write(input->stop[1], "", 1) != 1) {
+        fprintf(stderr, "Error: Could not stop reading the input.\n");
+    }
 }
 
 /**
- * Creates the lake and updates it on the map
+ * Looks at the next byte of input without using it up, reading another 
+ * block if the buffer has run out.
  * 
  * Parameters:
- *     map - The map to initialise.
- *     lake - start coordinates of the lake
- *     lake_size - dimensions of the lake
+ *     input - the input to read
  * Returns:
- *     Nothing.
+ *     byte - the next byte
+ *     EOF - if there is no input left
  */
-void create_lake(struct tile map[MAP_ROWS][MAP_COLUMNS]) {
-    struct coord_data lake = scan_coords();
-    int height = scan_int();
-    int width = scan_int(); 
-
-    // Tests if boundary points lie within the map
-    if (test_lake(lake, height, width)) {
-        int row = lake.row;
-        while (row < lake.row + height) {
-            int col = lake.col;
-            while (col < lake.col + width) {
-                map[row][col].land = WATER;
-                col++;
-            } 
-            row++;
+int peek_input(struct input *input) {
+    if (input->position < input->length) {
+        return (unsigned char)input->buffer[input->position];
+    }
+    if (input->mapped) {
+        return EOF;
+    }
+    // Anything printed so far, like a prompt, is shown before waiting.
+    fflush(stdout);
+    if (input->stop[0] >= 0) {
+        struct pollfd waits[2] = {
+            {input->fd, POLLIN, 0}, {input->stop[0], POLLIN, 0}
+        };
+        int ready = poll(waits, 2, -1);
+        while (ready < 0 && errno == EINTR) {
+            ready = poll(waits, 2, -1);
+        }
+        if (ready < 0 || waits[1].revents != 0) {
+            return EOF;
         }
-    } else {
-        printf("Error: Lake out of bounds, ignoring...\n");
     }
+    ssize_t n_read = read(input->fd, input->buffer, INPUT_BLOCK_SIZE);
+    if (n_read <= 0) {
+        return EOF;
+    }
+    input->offset += input->length;
+    input->length = n_read;
+    input->position = 0;
+    return (unsigned char)input->buffer[0];
 }
 
 /**
- * Checks if current position is end point, returns 0 is at end
+ * Skips any whitespace, then scans in a single character.
  * 
  * Parameters:
- *     position - current coordinates of the path
- *     end - cordinates of the end square
+ *     input - the input to read
  * Returns:
- *     1 - if current position is not end point.
- *     0 - if it is.
+ *     character - the character scanned in
+ *     EOF - if there is no input left
  */
-int test_path(struct coord_data position, struct coord_data end) { 
-    return position.row != end.row || position.col != end.col;
+int scan_char(struct input *input) {
+    int character = peek_input(input);
+    while (
+        character == ' ' || character == '\n' || character == '\t' || 
+        character == '\r' || character == '\v' || character == '\f'
+    ) {
+        input->position++;
+        character = peek_input(input);
+    }
+    if (character != EOF) {
+        input->position++;
+    }
+    return character;
 }
 
 /**
- * Reads the path and changes the tiles to the path direction
+ * Skips any whitespace, then scans in an integer. A malformed number is 
+ * reported with where it is in the input, and left unread.
  * 
  * Parameters:
- *     map - map of the tiles
- *     path_length - counts length of the path
- *     path - struct array of the coordinates of the path route
- *     start - coordinates of the start tile
- *     end - coordinates of the end tile
+ *     input - the input to read
+ *     number - where to store the integer
  * Returns:
- *     nothing
+ *     1 - if an integer was scanned in
+ *     0 - if the input is not an integer
+ *     EOF - if there is no input left
  */
-void create_path(struct tile map[MAP_ROWS][MAP_COLUMNS], int *path_length,
-                  struct coord_data path[MAP_ROWS * MAP_COLUMNS], 
-                  struct coord_data start, struct coord_data end) {
-    printf("Enter Path: ");
-    // Sets up current position as we work through the path
-    struct coord_data position;
-    position.row = start.row;
-    position.col = start.col;
-    // stores the coordinates of the path in an array
-    path[*path_length].row = start.row;
-    path[*path_length].col = start.col;
+int scan_number(struct input *input, int *number) {
+    int character = scan_char(input);
+    if (character == EOF) {
+        return EOF;
+    }
+    // scan_char used the character up, so step back to it
+    input->position--;
+    size_t start = input->offset + input->position;
 
-    int reach_end = CONTINUE;
-    char direction;
-    while (reach_end == CONTINUE) {
-        scanf(" %c", &direction);
-    
-        // Updates the land space with direction and moves to the next position.
-        if (direction == RIGHT) {
-            map[position.row][position.col].land = PATH_RIGHT;
-            map[position.row][position.col].land = PATH_RIGHT;
-            position.col++;
-        }
-        else if (direction == LEFT) {
-            map[position.row][position.col].land = PATH_LEFT;
-            position.col--;
+    int negative = 0;
+    if (character == '-' || character == '+') {
+        negative = character == '-';
+        input->position++;
+        character = peek_input(input);
+    }
+    if (character < '0' || character > '9') {
+        if (!input->quiet) {
+            fprintf(stderr, "Error: Expected a number at byte %zu.\n", 
+                    start);
         }
-        else if (direction == UP) {
-            map[position.row][position.col].land = PATH_UP;
-            position.row--;
-        } 
-        else if (direction == DOWN) {
-            map[position.row][position.col].land = PATH_DOWN;
-            position.row++;
+        return 0;
+    }
+    // Numbers too big for an int are capped.
+    long long value = 0;
+    while (character >= '0' && character <= '9') {
+        if (value <= INT_MAX) {
+            value = value * 10 + character - '0';
         }
-        
-        *path_length = *path_length + 1;
-        path[*path_length].row = position.row;
-        path[*path_length].col = position.col;
-        
-        reach_end = test_path(position, end);
+        input->position++;
+        character = peek_input(input);
+    }
+    if (negative) {
+        value = -value;
     }
+    if (value > INT_MAX) {
+        value = INT_MAX;
+    } else if (value < INT_MIN) {
+        value = INT_MIN;
+    }
+    *number = value;
+    return 1;
 }
 
 /**
- * Creates a tower at a point, after checking if its allowed. 
- * 
+ * Scans in an integer input, which will be used as a game statistic
+ *
  * Parameters:
- *     map - map of the tiles
- *     *money - total amount of money
+ *     input - the input to read
  * Returns:
- *     nothing
+ *     number - the integer scanned in, or 0 if there wasn't one
  */
-void create_tower(struct tile map[MAP_ROWS][MAP_COLUMNS], int *money) {
-    // Takes in a set of coordinates
-    struct coord_data tower = scan_coords();
-    // Checks all the conditions for creating a tower is passed
+int scan_int(struct input *input) {
+    int number = 0;
+    scan_number(input, &number);
+    return number;
+}
+
+/**
+ * This struct stores the x and y coordinates of a specified position
+ *
+ * Parameters:
+ *     input - the input to read
+ * Returns:
+ *     data - a struct of 2 integers scanned in
+ */
+struct coord_data scan_coords(struct input *input) {
+    struct coord_data data;
+    data.row = scan_int(input);
+    data.col = scan_int(input);
+    return data;
+}
+
+/**
+ * Finds how many integers follow a command.
+ * 
+ * Parameters:
+ *     type - the command character
+ * Returns:
+ *     n_args - the number of arguments the command takes
+ */
+int command_args(char type) {
     if (
-        *money >= COST_BASIC &&
-        test_point(tower.row, tower.col) &&
-        map[tower.row][tower.col].land == GRASS &&
-        map[tower.row][tower.col].entity == EMPTY
+        type == ENEMIES || type == MOVE || type == ATTACK || type == FLOOD ||
+        type == OPTIMIZE
     ) {
-        map[tower.row][tower.col].entity = BASIC_TOWER;
-        *money -= COST_BASIC;
-        printf("Tower successfully created!\n");
-    } else { 
-        printf("Error: Tower creation unsuccessful. "
-                "Make sure you have at least $200 and that the tower "
-                "is placed on a grass block with no entity.\n");
+        return 1;
+    } else if (type == TOWER || type == UPGRADE) {
+        return 2;
+    } else if (type == RAIN || type == TELEPORT || type == BRANCH) {
+        return 4;
     }
+    return 0;
 }
 
 /**
- * Moves the enemies depending on the input from the user
- * Then removes lives, depending on how many enemies made it to the end tile
+ * Scans in a command and all of its arguments. Any arguments the command 
+ * doesn't take are set to 0.
  * 
  * Parameters:
- *     map - map of the tiles
- *     *lives - number of lives
- *     path - array of structs of the path
- *     start - start row and column
-  *    end - end row and column
- *     money - total amount of money
- * Returns:
- *     CONTINUE - if lives are more than 0
- *     STOP - if lives are less than or equal to 0
- */
-int move_enemies(struct tile map[MAP_ROWS][MAP_COLUMNS], int *lives,
-                 struct coord_data path[MAP_ROWS * MAP_COLUMNS], 
-                 struct coord_data start, struct coord_data end, 
-                 int path_length, int money) {
-    int lives_lost = 0;
-    // Scans in the number of advances to make
-    int repeat = scan_int();
-    int iteration = 0;
-    // Repeat for the number of advances required by the input. 
-    while (iteration < repeat) {
-
-        // Start from the end of the path, set the current tile's number of 
-        // enemies to the prior path tile's number of enemies
-        int i = path_length;
-        while (i > 0) {
-            struct coord_data current = path[i];
-            struct coord_data previous = path[i - 1];
-            map[current.row][current.col].entity = 
-                map[previous.row][previous.col].entity;
-            map[current.row][current.col].n_enemies = 
-                map[previous.row][previous.col].n_enemies;
-            i--;
+ *     input - the input to read
+ *     command - where to store the command
+ * Returns:
+ *     1 - if the whole command was scanned in
+ *     0 - if one of its arguments was malformed
+ *     EOF - if the input ran out
+ */
+int scan_command(struct input *input, struct command *command) {
+    int type = scan_char(input);
+    if (type == EOF) {
+        return EOF;
+    }
+    command->type = type;
+    int n_args = command_args(type);
+    int i = 0;
+    while (i < MAX_ARGS) {
+        command->args[i] = 0;
+        i++;
+    }
+    i = 0;
+    while (i < n_args) {
+        int scanned = scan_number(input, &command->args[i]);
+        if (scanned != 1) {
+            return scanned;
         }
+        i++;
+    }
+    return 1;
+}
 
-        // Start cell after moving enemies will be empty and 0
-        map[start.row][start.col].entity = EMPTY;
-        map[start.row][start.col].n_enemies = 0;
-        
-        // Checks if enemies made it to the end tile and decreases total lives. 
-        if (map[end.row][end.col].entity == ENEMY) {
-            *lives -= map[end.row][end.col].n_enemies;
-            lives_lost += map[end.row][end.col].n_enemies;
-            map[end.row][end.col].entity = EMPTY;
-            map[end.row][end.col].n_enemies = 0;
+/**
+ * Reads the options and optional map dimensions from the command line 
+ * arguments.
+ * 
+ * Parameters:
+ *     argc - number of command line arguments
+ *     argv - the command line arguments
+ *     options - the options to fill in
+ * Returns:
+ *     1 - if the arguments are valid
+ *     0 - if not.
+ */
+int scan_options(int argc, char *argv[], struct options *options) {
+    options->rows = MAP_ROWS;
+    options->cols = MAP_COLUMNS;
+    options->headless = 0;
+    options->record = NULL;
+    options->replay = NULL;
+    options->seek = 0;
+    options->load = NULL;
+    options->save = NULL;
+    options->batch = NULL;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    options->threads = threads > 0 ? threads : 1;
+    options->bench = 0;
+    options->seed = BENCH_SEED;
+    options->auto_rate = 0;
+    options->waves = NULL;
+    options->serve = NULL;
+    options->undo = 0;
+    int seeded = 0;
+    int arg = 1;
+    while (arg < argc && argv[arg][0] == '-') {
+        if (
+            strcmp(argv[arg], "--headless") == 0 || 
+            strcmp(argv[arg], "-q") == 0
+        ) {
+            options->headless = 1;
+            arg++;
+        } else if (strcmp(argv[arg], "--record") == 0 && arg + 1 < argc) {
+            options->record = argv[arg + 1];
+            arg += 2;
+        } else if (strcmp(argv[arg], "--replay") == 0 && arg + 1 < argc) {
+            options->replay = argv[arg + 1];
+            arg += 2;
+        } else if (strcmp(argv[arg], "--load") == 0 && arg + 1 < argc) {
+            options->load = argv[arg + 1];
+            arg += 2;
+        } else if (strcmp(argv[arg], "--save") == 0 && arg + 1 < argc) {
+            options->save = argv[arg + 1];
+            arg += 2;
+        } else if (strcmp(argv[arg], "--batch") == 0 && arg + 1 < argc) {
+            options->batch = argv[arg + 1];
+            arg += 2;
+        } else if (strcmp(argv[arg], "--threads") == 0 && arg + 1 < argc) {
+            char *threads_end;
+            threads = strtol(argv[arg + 1], &threads_end, 10);
+            if (*threads_end != '\0' || threads <= 0 || threads > INT_MAX) {
+                return 0;
+            }
+            options->threads = threads;
+            arg += 2;
+        } else if (strcmp(argv[arg], "--bench") == 0) {
+            options->bench = 1;
+            arg++;
+        } else if (strcmp(argv[arg], "--seed") == 0 && arg + 1 < argc) {
+            char *seed_end;
+            options->seed = strtoll(argv[arg + 1], &seed_end, 10);
+            if (*seed_end != '\0' || options->seed < 0) {
+                return 0;
+            }
+            seeded = 1;
+            arg += 2;
+        } else if (strcmp(argv[arg], "--auto") == 0 && arg + 1 < argc) {
+            char *rate_end;
+            long rate = strtol(argv[arg + 1], &rate_end, 10);
+            if (*rate_end != '\0' || rate <= 0 || rate > 1000000000) {
+                return 0;
+            }
+            options->auto_rate = rate;
+            arg += 2;
+        } else if (strcmp(argv[arg], "--serve") == 0 && arg + 1 < argc) {
+            options->serve = argv[arg + 1];
+            arg += 2;
+        } else if (strcmp(argv[arg], "--undo") == 0) {
+            options->undo = 1;
+            arg++;
+        } else if (strcmp(argv[arg], "--waves") == 0 && arg + 1 < argc) {
+            options->waves = argv[arg + 1];
+            arg += 2;
+        } else if (strcmp(argv[arg], "--seek") == 0 && arg + 1 < argc) {
+            char *seek_end;
+            options->seek = strtoll(argv[arg + 1], &seek_end, 10);
+            if (*seek_end != '\0' || options->seek < 0) {
+                return 0;
+            }
+            arg += 2;
+        } else {
+            return 0;
         }
-        iteration++;
     }
+    // A loaded game has no setup to start a replay log with, and a batch 
+    // only reports how its games ended. A benchmark plays no game of its own,
+    // and only a game being typed in can run by itself or have waves. A 
+    // server's games are typed in by its clients, each set up on its own.
+    // Only games played command by command keep a history to undo.
+    if (
+        (options->seek > 0 && options->replay == NULL) ||
+        (seeded && !options->bench) ||
+        ((options->auto_rate > 0 || options->waves != NULL) && 
+         (options->replay != NULL || options->batch != NULL || 
+          options->bench)) ||
+        (options->bench && 
+         (options->record != NULL || options->replay != NULL || 
+          options->load != NULL || options->save != NULL || 
+          options->batch != NULL)) ||
+        (options->load != NULL && 
+         (options->record != NULL || options->replay != NULL)) ||
+        (options->batch != NULL && 
+         (options->record != NULL || options->replay != NULL || 
+          options->load != NULL || options->save != NULL)) ||
+        (options->serve != NULL && 
+         (options->record != NULL || options->replay != NULL || 
+          options->load != NULL || options->save != NULL || 
+          options->batch != NULL || options->bench || 
+          options->auto_rate > 0 || options->waves != NULL)) ||
+        (options->undo && 
+         (options->replay != NULL || options->bench || 
+          options->auto_rate > 0 || options->waves != NULL))
+    ) {
+        return 0;
+    }
+    if (options->bench) {
+        options->rows = BENCH_ROWS;
+        options->cols = BENCH_COLUMNS;
+    }
+    if (arg == argc) {
+        return 1;
+    }
+    if (arg + 2 != argc) {
+        return 0;
+    }
+    char *rows_end;
+    char *cols_end;
+    long new_rows = strtol(argv[arg], &rows_end, 10);
+    long new_cols = strtol(argv[arg + 1], &cols_end, 10);
+    // The path stores one coordinate per tile plus the end tile, so the tile 
+    // count has to leave room for that in an int.
+    if (
+        *rows_end != '\0' || *cols_end != '\0' ||
+        new_rows <= 0 || new_cols <= 0 ||
+        new_rows > (INT_MAX - 1) / new_cols
+    ) {
+        return 0;
+    }
+    options->rows = new_rows;
+    options->cols = new_cols;
+    return 1;
+}
+
+/**
+ * Prints a prompt for the next input, unless the game is headless.
+ * 
+ * Parameters:
+ *     options - the command line options
+ *     prompt - the prompt to print
+ * Returns:
+ *     nothing
+ */
+void print_prompt(struct options *options, char *prompt) {
+    if (!options->headless) {
+        fputs(prompt, stdout);
+    }
+}
+
+/**
+ * Prints text, or adds it to the `message_sink` if this thread has one.
+ * 
+ * Parameters:
+ *     format - printf format of the text
+ *     values - values for the format
+ * Returns:
+ *     nothing
+ */
+void print_text_list(const char *format, va_list values) {
+    if (message_sink == NULL) {
+        vprintf(format, values);
+        return;
+    }
+    va_list counted;
+    va_copy(counted, values);
+    int length = vsnprintf(NULL, 0, format, counted);
+    va_end(counted);
+    // Without the memory to keep it, the text is lost rather than printed
+    // out of order.
+    char *text = length > 0 ? reserve_frame(message_sink, length + 1) : NULL;
+    if (text != NULL) {
+        vsnprintf(text, length + 1, format, values);
+        message_sink->length += length;
+    }
+}
+
+/**
+ * Prints text, or adds it to the `message_sink` if this thread has one.
+ * 
+ * Parameters:
+ *     format - printf format of the text
+ *     ... - values for the format
+ * Returns:
+ *     nothing
+ */
+void print_text(const char *format, ...) {
+    va_list values;
+    va_start(values, format);
+    print_text_list(format, values);
+    va_end(values);
+}
+
+/**
+ * Prints the result of a command, unless the map is quiet.
+ * 
+ * Parameters:
+ *     map - map of the tiles
+ *     format - printf format of the message
+ *     ... - values for the format
+ * Returns:
+ *     nothing
+ */
+void print_message(struct map *map, const char *format, ...) {
+    if (map->quiet) {
+        return;
+    }
+    va_list values;
+    va_start(values, format);
+    print_text_list(format, values);
+    va_end(values);
+}
+
+/**
+ * Scans in the setup of a new game: the lives, money, start and end points,
+ * initial enemies, lake and path. The map is shown after each step.
+ * 
+ * Parameters:
+ *     game - the new game to set up
+ *     options - the command line options
+ *     input - the input to read
+ *     frame - the frame to draw the map into, or NULL if headless
+ *     route - where to store the path directions
+ *     header - where to store the setup, for the replay log
+ * Returns:
+ *     nothing
+ */
+void scan_setup(struct game *game, struct options *options, 
+                struct input *input, struct frame *frame, char *route,
+                struct log_header *header) {
+    struct map *map = &game->map;
+    struct path *path = &game->path;
+
+    // This will initialise all tiles in the map to have GRASS land and EMPTY
+    // entity values.
+    initialise_map(map);
+    
+    // This scans in lives, money and start/ending points.
+    print_prompt(options, "Starting Lives: ");
+    game->lives = scan_int(input);
+    print_prompt(options, "Starting Money($): ");
+    game->money = scan_int(input);
+    print_prompt(options, "Start Point: ");
+    struct coord_data start = scan_coords(input);
+    print_prompt(options, "End Point: ");
+    struct coord_data end = scan_coords(input);
+
+    // This changes the land value for the start and end points on the camp.
+    set_land(map, start.row, start.col, PATH_START);
+    set_land(map, end.row, end.col, PATH_END);
+    // The start point is the first tile of the path, where enemies spawn.
+    add_path_tile(map, path, start);
+
+    print_map(map, path, game->lives, game->money, frame);
+
+    // This scans in number of initial enemies after checking it is valid
+    print_prompt(options, "Initial Enemies: ");
+    int spawn = scan_int(input);
+    add_enemies(path, spawn);
+
+    print_map(map, path, game->lives, game->money, frame);
     
-    printf("%d enemies reached the end!\n", lives_lost);
+    // This creates the lake after checking it is valid
+    print_prompt(options, "Enter Lake: "); 
+    struct coord_data lake = scan_coords(input);
+    int height = scan_int(input);
+    int width = scan_int(input);
+    print_result(map, create_lake(map, lake, height, width));
     
-    // This checks if the game is out of lives. 
-    if (*lives <= OUT_OF_LIVES) {
-        print_map(map, *lives, money);
-        printf("Oh no, you ran out of lives!"); 
-        return STOP;
+    print_map(map, path, game->lives, game->money, frame);       
+
+    // This updates the map with the provided path
+    // And also stores the path length, and coordinates of the path route
+    print_prompt(options, "Enter Path: ");
+    int route_length = create_path(map, path, start, end, input, route);
+
+    print_map(map, path, game->lives, game->money, frame);     
+
+    *header = (struct log_header){
+        .magic = LOG_MAGIC,
+        .version = LOG_VERSION,
+        .rows = map->rows,
+        .cols = map->cols,
+        .lives = game->lives,
+        .money = game->money,
+        .start = {start.row, start.col},
+        .end = {end.row, end.col},
+        .enemies = spawn,
+        .lake = {lake.row, lake.col, height, width},
+        .route_length = route_length
+    };
+}
+
+/**
+ * Finds the bitboard word that holds a tile's bit.
+ * 
+ * Parameters:
+ *     map - map of the tiles
+ *     plane - the bitboard
+ *     row - tile row
+ *     col - tile col
+ * Returns:
+ *     word - pointer to the word holding the tile
+ */
+uint64_t *bit_word(struct map *map, uint64_t *plane, int row, int col) {
+    return &plane[(size_t)row * map->words + col / WORD_BITS];
+}
+
+/**
+ * Sets or clears a tile's bit in a bitboard.
+ * 
+ * Parameters:
+ *     map - map of the tiles
+ *     plane - the bitboard
+ *     row - tile row
+ *     col - tile col
+ *     value - 1 to set the bit, 0 to clear it
+ * Returns:
+ *     nothing
+ */
+void set_bit(struct map *map, uint64_t *plane, int row, int col, int value) {
+    uint64_t bit = (uint64_t)1 << (col % WORD_BITS);
+    uint64_t *word = bit_word(map, plane, row, col);
+    if (value) {
+        *word |= bit;
     } else {
-        return CONTINUE;
+        *word &= ~bit;
+    }
+    mark_dirty(word, sizeof *word);
+}
+
+/**
+ * Changes the land of a tile, keeping the grass and water bitboards in step.
+ * New water goes on the flood frontier, and anything else comes off it.
+ * 
+ * Parameters:
+ *     map - map of the tiles
+ *     row - tile row
+ *     col - tile col
+ *     land - the new land type
+ * Returns:
+ *     nothing
+ */
+void set_land(struct map *map, int row, int col, int land) {
+    set_tile_land(map, tile_index(map, row, col), land);
+    set_bit(map, map->grass, row, col, land == GRASS);
+    set_bit(map, map->water, row, col, land == WATER);
+    if (land == WATER) {
+        add_frontier(map, row, col);
+    } else {
+        set_bit(map, map->frontier, row, col, 0);
+    }
+}
+
+/**
+ * Finds the land of a tile.
+ * 
+ * Parameters:
+ *     map - map of the tiles
+ *     index - index of the tile
+ * Returns:
+ *     land - the tile's land type
+ */
+int tile_land(struct map *map, int index) {
+    return map->tile[index] & LAND_MASK;
+}
+
+/**
+ * Finds the entity on a tile.
+ * 
+ * Parameters:
+ *     map - map of the tiles
+ *     index - index of the tile
+ * Returns:
+ *     entity - the tile's entity
+ */
+int tile_entity(struct map *map, int index) {
+    return map->tile[index] >> LAND_BITS;
+}
+
+/**
+ * Changes the land of a tile, keeping its entity. Use `set_land` to keep 
+ * the bitboards up to date as well.
+ * 
+ * Parameters:
+ *     map - map of the tiles
+ *     index - index of the tile
+ *     land - the new land type
+ * Returns:
+ *     nothing
+ */
+void set_tile_land(struct map *map, int index, int land) {
+    map->tile[index] = (map->tile[index] & ~LAND_MASK) | land;
+    mark_dirty(&map->tile[index], sizeof map->tile[index]);
+}
+
+/**
+ * Changes the entity on a tile, keeping its land.
+ * 
+ * Parameters:
+ *     map - map of the tiles
+ *     index - index of the tile
+ *     entity - the new entity
+ * Returns:
+ *     nothing
+ */
+void set_tile_entity(struct map *map, int index, int entity) {
+    map->tile[index] = (map->tile[index] & LAND_MASK) | entity << LAND_BITS;
+    mark_dirty(&map->tile[index], sizeof map->tile[index]);
+}
+
+/**
+ * Checks if a tile is grass with nothing on it, which is where towers and
+ * branches can go. Both halves of the tile are compared at once.
+ * 
+ * Parameters:
+ *     map - map of the tiles
+ *     index - index of the tile
+ * Returns:
+ *     1 - if the tile is free grass
+ *     0 - if not.
+ */
+int test_free_grass(struct map *map, int index) {
+    return map->tile[index] == (GRASS | EMPTY << LAND_BITS);
+}
+
+/**
+ * Converts a set of coordinates into the index of the tile in each plane.
+ * 
+ * Parameters:
+ *     map - map of the tiles
+ *     row - index 0 component of coordinate
+ *     col - index 1 component of coordinate
+ * Returns:
+ *     index - row-major position of the tile
+ */
+int tile_index(struct map *map, int row, int col) {
+    return row * map->cols + col;
+}
+
+/**
+ * Finds the number of enemies at a position along the path.
+ * 
+ * Parameters:
+ *     path - the path
+ *     position - position along the path, from 0 (start) to length (end)
+ * Returns:
+ *     enemies - pointer to the count of enemies at that position
+ */
+int *path_enemies(struct path *path, int position) {
+    int slot = path->head + position;
+    if (slot >= path->capacity) {
+        slot -= path->capacity;
+    }
+    return &path->enemies[slot];
+}
+
+/**
+ * Marks the enemy counts of a run of positions along the path as changed 
+ * for the game's history. The run may wrap around the end of the ring 
+ * buffer, so it is marked in up to two parts.
+ * 
+ * Parameters:
+ *     path - the path
+ *     position - the first position in the run
+ *     count - number of positions in the run
+ * Returns:
+ *     nothing
+ */
+void mark_enemies(struct path *path, int position, int count) {
+    if (watched_history == NULL) {
+        return;
+    }
+    int *first = path_enemies(path, position);
+    int before_end = path->capacity - (int)(first - path->enemies);
+    if (count <= before_end) {
+        mark_dirty(first, count * sizeof *first);
+    } else {
+        mark_dirty(first, before_end * sizeof *first);
+        mark_dirty(path->enemies, (count - before_end) * sizeof *first);
+    }
+}
+
+/**
+ * Finds the position of a tile along the path.
+ * 
+ * Parameters:
+ *     map - map of the tiles
+ *     path - the path
+ *     row - tile row
+ *     col - tile col
+ * Returns:
+ *     position - position along the path, from 0 (start) to length (end)
+ *     NOT_PATH - if the tile is off the map or not on the path.
+ */
+int path_position(struct map *map, struct path *path, int row, int col) {
+    if (!test_point(map, row, col)) {
+        return NOT_PATH;
+    }
+    int index = map->path_index[tile_index(map, row, col)];
+    if (index == NOT_PATH || index >= path->capacity) {
+        return NOT_PATH;
+    }
+    return index - path->base;
+}
+
+/**
+ * Finds the number of enemies at a position along a segment of the path.
+ * 
+ * Parameters:
+ *     path - the path
+ *     segment - 0 for the main path, or `b + 1` for branch `b`
+ *     position - position along the segment, from 0 up to its length
+ * Returns:
+ *     enemies - pointer to the count of enemies at that position
+ */
+int *segment_enemies(struct path *path, int segment, int position) {
+    if (segment == 0) {
+        return path_enemies(path, position);
+    }
+    struct branch *branch = &path->branches[segment - 1];
+    int slot = branch->head + position;
+    if (slot > branch->length) {
+        slot -= branch->length + 1;
+    }
+    return &path->branch_enemies[branch->first + slot];
+}
+
+/**
+ * Finds which segment of the path a tile is on, and where along it. 
+ * Branches are stored in the order they were made, so the one holding a 
+ * slot is found by a binary search.
+ * 
+ * Parameters:
+ *     map - map of the tiles
+ *     path - the path
+ *     row - tile row
+ *     col - tile col
+ *     *position - where to store the position along the segment
+ * Returns:
+ *     segment - 0 for the main path, or `b + 1` for branch `b`
+ *     NO_SEGMENT - if the tile is off the map or not on the path.
+ */
+int tile_segment(struct map *map, struct path *path, int row, int col, 
+                 int *position) {
+    if (!test_point(map, row, col)) {
+        return NO_SEGMENT;
+    }
+    int index = map->path_index[tile_index(map, row, col)];
+    if (index == NOT_PATH) {
+        return NO_SEGMENT;
+    } else if (index < path->capacity) {
+        *position = index - path->base;
+        return 0;
+    }
+    int slot = index - path->capacity;
+    int low = 0;
+    int high = path->n_branches - 1;
+    while (low < high) {
+        int middle = (low + high + 1) / 2;
+        if (path->branches[middle].first <= slot) {
+            low = middle;
+        } else {
+            high = middle - 1;
+        }
+    }
+    *position = slot - path->branches[low].first;
+    return low + 1;
+}
+
+/**
+ * Limits a total to what an int can hold.
+ * 
+ * Parameters:
+ *     value - the total
+ * Returns:
+ *     value - the total, or INT_MIN or INT_MAX if it is past them
+ */
+int clamp_int(long long value) {
+    if (value < INT_MIN) {
+        return INT_MIN;
+    } else if (value > INT_MAX) {
+        return INT_MAX;
+    }
+    return (int)value;
+}
+
+/**
+ * Adds enemies to the starting position, if number of enemies is valid,
+ * and as many again to the start of every branch with a spawn of its own.
+ * 
+ * Parameters:
+ *     path - The path to add enemies to the start of.
+ *     spawn - number to spawn in
+ *    
+ * Returns:
+ *     RESULT_OK - if the enemies were added, or there were none to add
+ *     RESULT_TOO_MANY_ENEMIES - if a start tile couldn't count them all
+ */
+int add_enemies(struct path *path, int spawn) {
+    // Check to ensure number of enemies is valid
+    if (spawn > 0) {
+        if (*path_enemies(path, 0) > INT_MAX - spawn) {
+            return RESULT_TOO_MANY_ENEMIES;
+        }
+        int b = 0;
+        while (b < path->n_branches) {
+            if (
+                path->branches[b].from == NO_SEGMENT &&
+                *segment_enemies(path, b + 1, 0) > INT_MAX - spawn
+            ) {
+                return RESULT_TOO_MANY_ENEMIES;
+            }
+            b++;
+        }
+        int *start = path_enemies(path, 0);
+        *start += spawn;
+        mark_dirty(start, sizeof *start);
+        path->total_enemies += spawn;
+        b = 0;
+        while (b < path->n_branches) {
+            if (path->branches[b].from == NO_SEGMENT) {
+                start = segment_enemies(path, b + 1, 0);
+                *start += spawn;
+                mark_dirty(start, sizeof *start);
+                path->total_enemies += spawn;
+            }
+            b++;
+        }
+    }
+    return RESULT_OK;
+}
+
+/**
+ * Tests a set of coordinates to see if they lie within the map boundaries
+ * 
+ * Parameters:
+ *     map - map of the tiles
+ *     row - index 0 component of coordinate
+ *     col - index 1 component of coordinate
+ * Returns:
+ *     1 - if within the bounds
+ *     0 - if out of bounds
+ */
+int test_point(struct map *map, int row, int col) {
+    return row >= 0 && 
+           col >= 0 &&
+           row < map->rows &&
+           col < map->cols;
+}
+
+/**
+ * Adds a tile that has just turned into water to the flood frontier.
+ * 
+ * Parameters:
+ *     map - map of the tiles
+ *     row - row of the water tile
+ *     col - col of the water tile
+ * Returns:
+ *     nothing
+ */
+void add_frontier(struct map *map, int row, int col) {
+    set_bit(map, map->frontier, row, col, 1);
+    if (row < map->frontier_first) {
+        map->frontier_first = row;
+    }
+    if (row > map->frontier_last) {
+        map->frontier_last = row;
+    }
+}
+
+/**
+ * Adds the water tiles next to a tile that has just turned into grass back 
+ * onto the flood frontier, since they can now flood it. 
+ * 
+ * Parameters:
+ *     map - map of the tiles
+ *     row - row of the new grass tile
+ *     col - col of the new grass tile
+ * Returns:
+ *     nothing
+ */
+void add_wet_neighbours(struct map *map, int row, int col) {
+    if (row > 0 && tile_land(map, tile_index(map, row - 1, col)) == WATER) {
+        add_frontier(map, row - 1, col);
+    }
+    if (
+        row < map->rows - 1 && 
+        tile_land(map, tile_index(map, row + 1, col)) == WATER
+    ) {
+        add_frontier(map, row + 1, col);
+    }
+    if (col > 0 && tile_land(map, tile_index(map, row, col - 1)) == WATER) {
+        add_frontier(map, row, col - 1);
+    }
+    if (
+        col < map->cols - 1 && 
+        tile_land(map, tile_index(map, row, col + 1)) == WATER
+    ) {
+        add_frontier(map, row, col + 1);
+    }
+}
+
+/**
+ * Tests if the lake can exists by testing if boundary points sit in map
+ * 
+ * Parameters:
+ *     map - map of the tiles
+ *     lake - start coordinates of the lake
+ *     lake_size - dimensions of the lake
+ * Returns:
+ *     1 - if points within boundary.
+ *     0 - if not.
+ */
+int test_lake(struct map *map, struct coord_data lake, int height, int width) {
+    // The far edge is worked out wider than an int, so a huge lake can't 
+    // wrap around onto the map.
+    long long lake_edge_row = (long long)lake.row + height - 1;
+    long long lake_edge_col = (long long)lake.col + width - 1;
+    return test_point(map, lake.row, lake.col) &&
+           lake_edge_row >= 0 && lake_edge_row < map->rows &&
+           lake_edge_col >= 0 && lake_edge_col < map->cols;
+}
+
+/**
+ * Creates the lake and updates it on the map
+ * 
+ * Parameters:
+ *     map - The map to initialise.
+ *     lake - start coordinates of the lake
+ *     height - number of rows in the lake
+ *     width - number of columns in the lake
+ * Returns:
+ *     RESULT_OK - if the lake was created
+ *     RESULT_LAKE_OUT_OF_BOUNDS - if it doesn't fit on the map
+ */
+int create_lake(struct map *map, struct coord_data lake, int height, 
+                int width) {
+    // Tests if boundary points lie within the map
+    if (test_lake(map, lake, height, width)) {
+        int row = lake.row;
+        while (row < lake.row + height) {
+            int col = lake.col;
+            while (col < lake.col + width) {
+                if (tile_land(map, tile_index(map, row, col)) != WATER) {
+                    set_land(map, row, col, WATER);
+                }
+                col++;
+            } 
+            row++;
+        }
+        return RESULT_OK;
+    }
+    return RESULT_LAKE_OUT_OF_BOUNDS;
+}
+
+/**
+ * Checks if current position is end point, returns 0 is at end
+ * 
+ * Parameters:
+ *     position - current coordinates of the path
+ *     end - cordinates of the end square
+ * Returns:
+ *     1 - if current position is not end point.
+ *     0 - if it is.
+ */
+int test_path(struct coord_data position, struct coord_data end) { 
+    return position.row != end.row || position.col != end.col;
+}
+
+/**
+ * Moves a position one tile in a path direction. Anything that isn't a 
+ * direction leaves it where it is.
+ * 
+ * Parameters:
+ *     position - the position to move
+ *     direction - the direction to move in
+ * Returns:
+ *     nothing
+ */
+void move_position(struct coord_data *position, int direction) {
+    if (direction == RIGHT) {
+        position->col++;
+    } else if (direction == LEFT) {
+        position->col--;
+    } else if (direction == UP) {
+        position->row--;
+    } else if (direction == DOWN) {
+        position->row++;
+    }
+}
+
+/**
+ * Adds the next tile to the end of the path. 
+ * 
+ * Parameters:
+ *     map - map of the tiles
+ *     path - the path to extend
+ *     position - coordinates of the new tile
+ * Returns:
+ *     nothing
+ */
+void add_path_tile(struct map *map, struct path *path, 
+                   struct coord_data position) {
+    int index = tile_index(map, position.row, position.col);
+    path->tiles[path->length] = position;
+    map->path_index[index] = path->base + path->length;
+    mark_dirty(&path->tiles[path->length], sizeof *path->tiles);
+    mark_dirty(&map->path_index[index], sizeof *map->path_index);
+}
+
+/**
+ * Lays one tile of the path in the given direction, and moves on to the next
+ * position.
+ * 
+ * Parameters:
+ *     map - map of the tiles
+ *     path - the path being laid
+ *     position - the current position, which is moved along
+ *     direction - the direction to move in
+ *     end - coordinates of the end tile
+ * Returns:
+ *     CONTINUE - if the path hasn't reached the end yet
+ *     STOP - if it has, or the path is full
+ */
+int step_path(struct map *map, struct path *path, 
+              struct coord_data *position, int direction, 
+              struct coord_data end) {
+    // Updates the land space with direction and moves to the next position.
+    if (direction == RIGHT) {
+        set_land(map, position->row, position->col, PATH_RIGHT);
+        position->col++;
+    }
+    else if (direction == LEFT) {
+        set_land(map, position->row, position->col, PATH_LEFT);
+        position->col--;
+    }
+    else if (direction == UP) {
+        set_land(map, position->row, position->col, PATH_UP);
+        position->row--;
+    } 
+    else if (direction == DOWN) {
+        set_land(map, position->row, position->col, PATH_DOWN);
+        position->row++;
+    }
+    
+    path->length++;
+    add_path_tile(map, path, *position);
+    
+    if (path->length + 1 >= path->capacity) {
+        return STOP;
+    }
+    return test_path(*position, end);
+}
+
+/**
+ * Reads the path and changes the tiles to the path direction
+ * 
+ * Parameters:
+ *     map - map of the tiles
+ *     path - the path to store the route in, holding just the start tile
+ *     start - coordinates of the start tile
+ *     end - coordinates of the end tile
+ *     input - the input to read the directions from
+ *     route - where to store the directions read, one per path tile
+ * Returns:
+ *     length - the number of directions read
+ */
+int create_path(struct map *map, struct path *path,
+                struct coord_data start, struct coord_data end,
+                struct input *input, char *route) {
+    // Sets up current position as we work through the path
+    struct coord_data position;
+    position.row = start.row;
+    position.col = start.col;
+
+    int length = 0;
+    int reach_end = CONTINUE;
+    while (reach_end == CONTINUE) {
+        int direction = scan_char(input);
+        if (direction == EOF) {
+            return length;
+        }
+        route[length] = direction;
+        length++;
+        reach_end = step_path(map, path, &position, direction, end);
+    }
+    return length;
+}
+
+/**
+ * Looks up the cost, range and power of a tower type.
+ * 
+ * Parameters:
+ *     entity - the tower type
+ * Returns:
+ *     stats - the tower's data, or all zeros if the entity is not a tower
+ */
+struct tower_data tower_stats(int entity) {
+    struct tower_data stats = {0, 0, 0};
+    if (entity == BASIC_TOWER) {
+        stats.cost = COST_BASIC;
+        stats.range = RANGE_BASIC;
+        stats.power = POWER_BASIC;
+    } else if (entity == POWER_TOWER) {
+        stats.cost = COST_POWER;
+        stats.range = RANGE_POWER;
+        stats.power = POWER_POWER;
+    } else if (entity == FORTIFIED_TOWER) {
+        stats.cost = COST_FORTIFIED;
+        stats.range = RANGE_FORTIFIED;
+        stats.power = POWER_FORTIFIED;
+    }
+    return stats;
+}
+
+/**
+ * Adds (or removes) a tower's damage to every path tile within its range. 
+ * 
+ * Parameters:
+ *     map - map of the tiles
+ *     row - tower row
+ *     col - tower col
+ *     entity - the tower type
+ *     sign - 1 to add the tower's damage, -1 to remove it
+ * Returns:
+ *     nothing
+ */
+void spread_damage(struct map *map, int row, int col, int entity, int sign) {
+    struct tower_data stats = tower_stats(entity);
+    if (stats.power == 0) {
+        return;
+    }
+    // Clips the tower's range to the map boundaries
+    int first_row = row - stats.range < 0 ? 0 : row - stats.range;
+    int last_row = row + stats.range >= map->rows ? 
+                   map->rows - 1 : row + stats.range;
+    int first_col = col - stats.range < 0 ? 0 : col - stats.range;
+    int last_col = col + stats.range >= map->cols ? 
+                   map->cols - 1 : col + stats.range;
+    int damage_row = first_row;
+    while (damage_row <= last_row) {
+        int *path_index = &map->path_index[tile_index(map, damage_row, 0)];
+        int damage_col = first_col;
+        while (damage_col <= last_col) {
+            if (path_index[damage_col] != NOT_PATH) {
+                int *damage = &map->damage[path_index[damage_col]];
+                *damage += sign * stats.power;
+                mark_dirty(damage, sizeof *damage);
+            }
+            damage_col++;
+        }
+        damage_row++;
+    }
+}
+
+/**
+ * Replaces the entity on a tile, updating the damage of the tiles around it 
+ * and the tower bitboards if a tower is removed or added.
+ * 
+ * Parameters:
+ *     map - map of the tiles
+ *     row - tile row
+ *     col - tile col
+ *     entity - the new entity for the tile
+ * Returns:
+ *     nothing
+ */
+void change_tower(struct map *map, int row, int col, int entity) {
+    int index = tile_index(map, row, col);
+    spread_damage(map, row, col, tile_entity(map, index), -1);
+    set_tile_entity(map, index, entity);
+    spread_damage(map, row, col, entity, 1);
+    set_bit(map, map->basic, row, col, entity == BASIC_TOWER);
+    set_bit(map, map->power, row, col, entity == POWER_TOWER);
+}
+
+/**
+ * Creates a tower at a point, after checking if its allowed. 
+ * 
+ * Parameters:
+ *     map - map of the tiles
+ *     *money - total amount of money
+ *     tower - coordinates of the new tower
+ * Returns:
+ *     RESULT_OK - if the tower was created
+ *     RESULT_TOWER_REFUSED - if not.
+ */
+int create_tower(struct map *map, int *money, struct coord_data tower) {
+    // Checks all the conditions for creating a tower is passed
+    if (
+        *money >= COST_BASIC &&
+        test_point(map, tower.row, tower.col) &&
+        test_free_grass(map, tile_index(map, tower.row, tower.col))
+    ) {
+        change_tower(map, tower.row, tower.col, BASIC_TOWER);
+        *money -= COST_BASIC;
+        return RESULT_OK;
+    }
+    return RESULT_TOWER_REFUSED;
+}
+
+/**
+ * Moves the enemies of a path with branches one tile at a time, `repeat` 
+ * times or until none are left. Each step moves every segment forward by 
+ * stepping its ring buffer back, then splits the enemies at each fork, then
+ * adds the enemies leaving each branch to the segment it joins. So a step 
+ * costs the same however many routes there are through the branches.
+ * 
+ * Parameters:
+ *     path - the path the enemies move along
+ *     repeat - number of tiles to move
+ * Returns:
+ *     lives_lost - number of enemies that reached the end tile
+ */
+long long step_branches(struct path *path, int repeat) {
+    // Every enemy has left after a step for each tile there is.
+    long long steps = path->length;
+    int b = 0;
+    while (b < path->n_branches) {
+        steps += path->branches[b].length;
+        b++;
+    }
+    if (steps > repeat) {
+        steps = repeat;
+    }
+    long long lives_lost = 0;
+    int step = 0;
+    while (step < steps && path->total_enemies != 0) {
+        path->head = path->head == 0 ? path->capacity - 1 : path->head - 1;
+        *path_enemies(path, 0) = 0;
+        mark_enemies(path, 0, 1);
+        b = 0;
+        while (b < path->n_branches) {
+            struct branch *branch = &path->branches[b];
+            branch->head = branch->head == 0 ? 
+                           branch->length : branch->head - 1;
+            int *start = segment_enemies(path, b + 1, 0);
+            *start = 0;
+            mark_dirty(start, sizeof *start);
+            b++;
+        }
+
+        // Enemies leaving a fork tile have just moved one tile on from it.
+        b = 0;
+        while (b < path->n_branches) {
+            struct branch *branch = &path->branches[b];
+            if (branch->from != NO_SEGMENT) {
+                int *enemies = segment_enemies(path, branch->from, 
+                                               branch->fork + 1);
+                int *start = segment_enemies(path, b + 1, 0);
+                int turned = *enemies / 2;
+                *enemies -= turned;
+                *start += turned;
+                mark_dirty(enemies, sizeof *enemies);
+                mark_dirty(start, sizeof *start);
+            }
+            b++;
+        }
+        b = 0;
+        while (b < path->n_branches) {
+            struct branch *branch = &path->branches[b];
+            int *leaving = segment_enemies(path, b + 1, branch->length);
+            int *joined = segment_enemies(path, branch->into, branch->join);
+            *joined += *leaving;
+            *leaving = 0;
+            mark_dirty(leaving, sizeof *leaving);
+            mark_dirty(joined, sizeof *joined);
+            b++;
+        }
+
+        int *arrived = path_enemies(path, path->length);
+        lives_lost += *arrived;
+        path->total_enemies -= *arrived;
+        *arrived = 0;
+        mark_dirty(arrived, sizeof *arrived);
+        step++;
+    }
+    STATS_ADD(tiles, (long long)step * (path->n_branches + 1));
+    return lives_lost;
+}
+
+/**
+ * Moves the enemies depending on the input from the user
+ * Then removes lives, depending on how many enemies made it to the end tile
+ * 
+ * Enemies that are within `repeat` tiles of the end all reach it, so only 
+ * those positions are counted. The rest move by stepping the start of the 
+ * ring buffer back, which costs at most one slot per tile moved. A path 
+ * with branches is moved a tile at a time by `step_branches` instead.
+ * 
+ * Parameters:
+ *     path - the path the enemies move along
+ *     *lives - number of lives
+ *     repeat - number of tiles to move
+ * Returns:
+ *     lives_lost - number of enemies that reached the end
+ */
+long long move_enemies(struct path *path, int *lives, int repeat) {
+    long long lives_lost = 0;
+    STATS_ADD(moved, path->total_enemies);
+    if (repeat > 0 && path->n_branches > 0) {
+        lives_lost = step_branches(path, repeat);
+    } else if (repeat > 0) {
+        // Enemies this close to the end tile will reach it.
+        int i = path->length - repeat < 0 ? 0 : path->length - repeat;
+        while (i < path->length) {
+            lives_lost += *path_enemies(path, i);
+            i++;
+        }
+
+        // Moves every enemy forward, then empties the positions they left
+        // behind and the end tile.
+        path->head = (int)((path->head - (long long)repeat % path->capacity + 
+                            path->capacity) % path->capacity);
+        int cleared = repeat < path->length + 1 ? repeat : path->length + 1;
+        i = 0;
+        while (i < cleared) {
+            *path_enemies(path, i) = 0;
+            i++;
+        }
+        *path_enemies(path, path->length) = 0;
+        mark_enemies(path, 0, cleared);
+        mark_enemies(path, path->length, 1);
+        STATS_ADD(tiles, (repeat < path->length ? repeat : path->length) + 
+                  cleared + 1);
+        path->total_enemies -= lives_lost;
+    }
+    *lives = clamp_int(*lives - lives_lost);
+    return lives_lost;
+}
+
+/**
+ * Checks if there is enough money for the upgrade, and completes the upgrade
+ * 
+ * Parameters:
+ *     map - map of the tiles
+ *     tower - cordinates of the end square
+ *     *money - remaining money
+ *     cost - cost of the upgrade
+ * Returns:
+ *     RESULT_OK - if the tower was upgraded
+ *     RESULT_NO_FUNDS - if there isn't enough money
+ */
+int test_upgrade_tower(struct map *map, struct coord_data tower, int *money,
+                       int cost) {
+    // Ensures there is enough money for upgrade cost
+    if (*money >= cost) {
+        // Subtracks money from running total and updates the tower on the map. 
+        *money -= cost;
+        int entity = tile_entity(map, tile_index(map, tower.row, tower.col));
+        change_tower(map, tower.row, tower.col, entity + 1);
+        return RESULT_OK;
+    }
+    return RESULT_NO_FUNDS;
+}
+
+/**
+ * Creates a tower, after checking if its allowed. 
+ * 
+ * Parameters:
+ *     map - map of the tiles
+ *     *money - total amount of money
+ *     tower - coordinates of the tower to upgrade
+ * Returns:
+ *     RESULT_OK - if the tower was upgraded
+ *     RESULT_UPGRADE_OUT_OF_BOUNDS, RESULT_NO_TOWER, RESULT_FULLY_UPGRADED 
+ *     or RESULT_NO_FUNDS - if not.
+ */
+int upgrade_tower(struct map *map, int *money, struct coord_data tower) {
+    // Checks to ensure all conditions pass. 
+    if (!test_point(map, tower.row, tower.col)) {
+        return RESULT_UPGRADE_OUT_OF_BOUNDS;
+    }
+    int entity = tile_entity(map, tile_index(map, tower.row, tower.col));
+    if (entity == FORTIFIED_TOWER) {
+        return RESULT_FULLY_UPGRADED;
+    }
+    else if (entity == BASIC_TOWER) {
+        return test_upgrade_tower(map, tower, money, COST_POWER);
+    }
+    else if (entity == POWER_TOWER) {
+        return test_upgrade_tower(map, tower, money, COST_FORTIFIED);
+    }
+    return RESULT_NO_TOWER;
+}
+
+/**
+ * Attacks a run of path tiles whose enemy counts and damage are both stored
+ * one after the other, `repeat` times. The tiles are attacked `ATTACK_BLOCK`
+ * at a time, like the lanes in `lanes_attack`, so the compiler can attack a
+ * whole block with the same vector instructions.
+ * 
+ * Parameters:
+ *     enemies - enemy counts of the tiles
+ *     damage - damage each tile takes per attack
+ *     n_tiles - number of tiles in the run
+ *     repeat - number of attacks, at least 1
+ * Returns:
+ *     destroyed - number of enemies destroyed
+ */
+long long attack_run(int *enemies, int *damage, int n_tiles, int repeat) {
+    long long destroyed[ATTACK_BLOCK] = {0};
+    // Damage that would overflow an int is more than any count of enemies.
+    int limit = INT_MAX / repeat;
+    int i = 0;
+    while (i + ATTACK_BLOCK <= n_tiles) {
+        // Works out the whole block's losses before changing any of them.
+        int taken[ATTACK_BLOCK];
+        int any_taken = 0;
+        int j = 0;
+        while (j < ATTACK_BLOCK) {
+            int total_damage = damage[i + j] > limit ? 
+                               INT_MAX : repeat * damage[i + j];
+            int n_enemies = enemies[i + j] > 0 ? enemies[i + j] : 0;
+            taken[j] = total_damage < n_enemies ? total_damage : n_enemies;
+            any_taken |= taken[j];
+            j++;
+        }
+        // A block that loses nothing isn't written to, so it isn't copied 
+        // by a game's history either.
+        j = 0;
+        if (any_taken != 0) {
+            while (j < ATTACK_BLOCK) {
+                enemies[i + j] -= taken[j];
+                destroyed[j] += taken[j];
+                j++;
+            }
+            mark_dirty(&enemies[i], sizeof taken);
+        }
+        i += ATTACK_BLOCK;
+    }
+
+    // The tiles left over are attacked one at a time.
+    long long total_destroyed = 0;
+    while (i < n_tiles) {
+        int total_damage = damage[i] > limit ? INT_MAX : repeat * damage[i];
+        int n_enemies = enemies[i] > 0 ? enemies[i] : 0;
+        int taken = total_damage < n_enemies ? total_damage : n_enemies;
+        if (taken > 0) {
+            enemies[i] -= taken;
+            mark_dirty(&enemies[i], sizeof *enemies);
+            total_destroyed += taken;
+        }
+        i++;
+    }
+    int j = 0;
+    while (j < ATTACK_BLOCK) {
+        total_destroyed += destroyed[j];
+        j++;
+    }
+    return total_destroyed;
+}
+
+/**
+ * Attacks the first `length` positions of a ring buffer of enemy counts, 
+ * whose damage is stored in position order. They are attacked in at most 
+ * two runs, split where the ring buffer wraps.
+ * 
+ * Parameters:
+ *     enemies - the ring buffer's slots
+ *     capacity - number of slots
+ *     head - the slot holding position 0
+ *     damage - damage each position takes per attack
+ *     length - number of positions to attack
+ *     repeat - number of attacks, at least 1
+ * Returns:
+ *     destroyed - number of enemies destroyed
+ */
+long long attack_ring(int *enemies, int capacity, int head, int *damage, 
+                      int length, int repeat) {
+    int n_tiles = capacity - head < length ? capacity - head : length;
+    return attack_run(&enemies[head], damage, n_tiles, repeat) +
+           attack_run(enemies, &damage[n_tiles], length - n_tiles, repeat);
+}
+
+/**
+ * Checks every path tile for surrounding towers that can deal damage and 
+ * repeats the attacks, the number of times from the input.
+ * 
+ * The towers don't change between attacks, so each tile takes the same 
+ * damage every time and all the attacks on it can be done at once. The 
+ * enemy counts and the damage are both stored in path order, so each 
+ * segment of the path is attacked in at most two runs.
+ * 
+ * Parameters:
+ *     map - map of the tiles
+ *     path - the path the enemies are on
+ *     *money - amount of money remaining
+ *     repeat - number of attacks
+ * Returns:
+ *     destroyed - number of enemies destroyed
+ */
+long long attack_total(struct map *map, struct path *path, int *money, 
+                       int repeat) {
+    long long total_destroyed = 0;
+    int n_tiles = 0;
+    int segment = 0;
+    // We loop through the segments of the path, main path first
+    while (
+        repeat > 0 && segment <= path->n_branches && path->total_enemies > 0
+    ) {
+        long long destroyed = 0;
+        if (segment == 0) {
+            destroyed = attack_ring(path->enemies, path->capacity, 
+                                    path->head, &map->damage[path->base], 
+                                    path->length, repeat);
+            n_tiles += path->length;
+        } else {
+            struct branch *branch = &path->branches[segment - 1];
+            int first = branch->first;
+            destroyed = attack_ring(&path->branch_enemies[first], 
+                                    branch->length + 1, branch->head, 
+                                    &map->damage[path->capacity + first],
+                                    branch->length, repeat);
+            n_tiles += branch->length;
+        }
+        path->total_enemies -= destroyed;
+        total_destroyed += destroyed;
+        segment++;
+    }
+    *money = clamp_int(*money + total_destroyed * MONEY_EARNED);
+    STATS_ADD(tiles, n_tiles);
+    STATS_ADD(destroyed, total_destroyed);
+    return total_destroyed;
+}
+
+/**
+ * Checks if an ordinate fits in the offset and spacing rules
+ * 
+ * Parameters:
+ *     ordinate - ordinate to test
+ *     offset - offset of the rain
+ *     spacing - spacing of the rain, which must not be 0
+ * Returns:
+ *     1 - if current position is not end point.
+ *     0 - if it is.
+ */
+int test_rain(int ordinate, int offset, int spacing) {
+    // Worked out in long long, so that no ordinate and offset can overflow.
+    return ((long long)ordinate - offset) % spacing == 0;
+}
+ 
+/**
+ * Floods a set of grass tiles in one bitboard word, and breaks the 
+ * un-fortified towers on them.
+ * 
+ * Parameters:
+ *     map - map of the tiles
+ *     row - row of the tiles
+ *     word - which word of the row the tiles are in
+ *     bits - the tiles to flood, which must all be grass
+ * Returns:
+ *     nothing
+ */
+void flood_bits(struct map *map, int row, int word, uint64_t bits) {
+    if (bits == 0) {
+        return;
+    }
+    size_t index = (size_t)row * map->words + word;
+    uint64_t towers = bits & (map->basic[index] | map->power[index]);
+    map->grass[index] &= ~bits;
+    map->water[index] |= bits;
+    map->basic[index] &= ~bits;
+    map->power[index] &= ~bits;
+    map->frontier[index] |= bits;
+    mark_dirty(&map->grass[index], sizeof *map->grass);
+    mark_dirty(&map->water[index], sizeof *map->water);
+    mark_dirty(&map->basic[index], sizeof *map->basic);
+    mark_dirty(&map->power[index], sizeof *map->power);
+    mark_dirty(&map->frontier[index], sizeof *map->frontier);
+    STATS_ADD(tiles, __builtin_popcountll(bits));
+    if (row < map->frontier_first) {
+        map->frontier_first = row;
+    }
+    if (row > map->frontier_last) {
+        map->frontier_last = row;
+    }
+
+    // Copies the changes across to the tile planes
+    while (bits != 0) {
+        int col = word * WORD_BITS + __builtin_ctzll(bits);
+        set_tile_land(map, tile_index(map, row, col), WATER);
+        bits &= bits - 1;
+    }
+    while (towers != 0) {
+        int col = word * WORD_BITS + __builtin_ctzll(towers);
+        int tile = tile_index(map, row, col);
+        spread_damage(map, row, col, tile_entity(map, tile), -1);
+        set_tile_entity(map, tile, EMPTY);
+        towers &= towers - 1;
+    }
+}
+
+/**
+ * Creates water tiles from grass tiles in a pattern
+ * 
+ * The columns that fit the spacing are the same for every row, so they are
+ * worked out once as a mask and laid over the grass of each row that fits.
+ * 
+ * Parameters:
+ *     map - map of the tiles
+ *     spacing - rows and columns between each rain tile, neither of them 0
+ *     offset - row and column that the rain lines up with
+ * Returns:
+ *     nothing
+ */
+void create_rain(struct map *map, struct coord_data spacing, 
+                 struct coord_data offset) {
+    // The flood scratch space holds the column mask
+    uint64_t *mask = map->flooded;
+    int mask_made = 0;
+    int row = 0;
+    while (row < map->rows) {
+        if (test_rain(row, offset.row, spacing.row)) {
+            if (!mask_made) {
+                memset(mask, 0, map->words * sizeof *mask);
+                mark_dirty(mask, map->words * sizeof *mask);
+                int col = 0;
+                while (col < map->cols) {
+                    // Checks if column fits in the offset and spacing
+                    if (test_rain(col, offset.col, spacing.col)) {
+                        set_bit(map, mask, 0, col, 1);
+                    }
+                    col++;
+                }
+                mask_made = 1;
+            }
+            uint64_t *grass = bit_word(map, map->grass, row, 0);
+            int word = 0;
+            while (word < map->words) {
+                flood_bits(map, row, word, grass[word] & mask[word]);
+                word++;
+            }
+        }
+        row++;
+    }
+}
+
+/**
+ * Works out which grass tiles in a row are next to the flood frontier, and 
+ * stores them in the row of `flooded`.
+ * 
+ * Parameters:
+ *     map - map of the tiles
+ *     row - the row to check
+ * Returns:
+ *     nothing
+ */
+void spread_flood(struct map *map, int row) {
+    uint64_t *frontier = bit_word(map, map->frontier, row, 0);
+    uint64_t *above = row > 0 ? frontier - map->words : NULL;
+    uint64_t *below = row < map->rows - 1 ? frontier + map->words : NULL;
+    uint64_t *grass = bit_word(map, map->grass, row, 0);
+    uint64_t *flooded = bit_word(map, map->flooded, row, 0);
+    int word = 0;
+    while (word < map->words) {
+        // Shifting by one column carries a bit across into the next word
+        uint64_t near = frontier[word] << 1 | frontier[word] >> 1;
+        if (word > 0) {
+            near |= frontier[word - 1] >> (WORD_BITS - 1);
+        }
+        if (word < map->words - 1) {
+            near |= frontier[word + 1] << (WORD_BITS - 1);
+        }
+        if (above != NULL) {
+            near |= above[word];
+        }
+        if (below != NULL) {
+            near |= below[word];
+        }
+        flooded[word] = grass[word] & near;
+        word++;
+    }
+    mark_dirty(flooded, map->words * sizeof *flooded);
+}
+
+/**
+ * Creates a flood from the given input.
+ * 
+ * Each iteration floods the grass next to the frontier, and those tiles 
+ * become the new frontier. So after `repeat` iterations, every grass tile 
+ * that can be reached from the water within `repeat` steps across grass has 
+ * flooded. Only the rows around the frontier are looked at.
+ * 
+ * Parameters:
+ *     map - map of the tiles
+ *     repeat - number of times to flood
+ * Returns:
+ *     nothing
+ */
+void create_flood(struct map *map, int repeat) {
+    int iteration = 0;
+    while (iteration < repeat && map->frontier_first <= map->frontier_last) {
+        int first = map->frontier_first > 0 ? map->frontier_first - 1 : 0;
+        int last = map->frontier_last < map->rows - 1 ? 
+                   map->frontier_last + 1 : map->rows - 1;
+
+        // Finds every tile to flood before changing any of them
+        int row = first;
+        while (row <= last) {
+            spread_flood(map, row);
+            row++;
+        }
+
+        // The old frontier has no grass left next to it, so it is replaced 
+        // by the tiles that just flooded.
+        map->frontier_first = map->rows;
+        map->frontier_last = -1;
+        row = first;
+        while (row <= last) {
+            uint64_t *frontier = bit_word(map, map->frontier, row, 0);
+            uint64_t *flooded = bit_word(map, map->flooded, row, 0);
+            int word = 0;
+            while (word < map->words) {
+                frontier[word] = 0;
+                flood_bits(map, row, word, flooded[word]);
+                word++;
+            }
+            mark_dirty(frontier, map->words * sizeof *frontier);
+            row++;
+        }
+        iteration++;
+    }
+}
+
+/**
+ * Removes a section of the path from the map, turning it back into grass. 
+ * Any enemies on it are lost. 
+ * 
+ * Parameters:
+ *     map - map of the tiles
+ *     path - the path
+ *     first - first position along the path to remove
+ *     last - last position along the path to remove
+ * Returns:
+ *     nothing
+ */
+void delete_path(struct map *map, struct path *path, int first, int last) {
+    STATS_ADD(tiles, last >= first ? last - first + 1 : 0);
+    int i = first;
+    while (i <= last) {
+        path->total_enemies -= *path_enemies(path, i);
+        *path_enemies(path, i) = 0;
+        mark_enemies(path, i, 1);
+        struct coord_data current = path->tiles[i];
+        int index = tile_index(map, current.row, current.col);
+        set_land(map, current.row, current.col, GRASS);
+        set_tile_entity(map, index, EMPTY);
+        map->path_index[index] = NOT_PATH;
+        mark_dirty(&map->path_index[index], sizeof *map->path_index);
+        add_wet_neighbours(map, current.row, current.col);
+        i++;
+    }
+}
+
+/**
+ * Marks the tiles, enemy counts and damage of a run of positions along the
+ * path as changed for the game's history, after they have been moved there.
+ * 
+ * Parameters:
+ *     map - map of the tiles
+ *     path - the path
+ *     position - the first position in the run
+ *     count - number of positions in the run
+ * Returns:
+ *     nothing
+ */
+void mark_moved(struct map *map, struct path *path, int position, 
+                int count) {
+    mark_dirty(&path->tiles[position], count * sizeof *path->tiles);
+    mark_dirty(&map->damage[path->base + position], 
+               count * sizeof *map->damage);
+    mark_enemies(path, position, count);
+}
+
+/**
+ * Creates a new path with the teleporters. When the path reaches the start
+ * teleporter, the path skips straight to the end teleporter. Whichever side
+ * of the removed section is shorter moves to close the gap, so only the
+ * removed tiles and the shorter side are touched.
+ * 
+ * Parameters:
+ *     map - map of the tiles 
+ *     path - the path
+ *     start_tele - position along the path where the teleporter starts
+ *     end_tele - position along the path where the teleporter ends
+ * Returns:
+ *     nothing
+ */
+void create_tele_path(struct map *map, struct path *path, 
+                      int start_tele, int end_tele) {
+    delete_path(map, path, start_tele + 1, end_tele - 1);
+
+    struct coord_data tele = path->tiles[start_tele];
+    set_land(map, tele.row, tele.col, TELEPORTER);
+    tele = path->tiles[end_tele];
+    set_land(map, tele.row, tele.col, TELEPORTER);
+
+    int removed = end_tele - start_tele - 1;
+    if (start_tele + 1 < path->length - end_tele + 1) {
+        // Moves the start of the path, its enemies and its damage, down in 
+        // front of the end teleporter. The path then begins `removed` places
+        // further into its plane and ring, so the rest of it keeps its place.
+        STATS_ADD(tiles, start_tele + 1);
+        int i = start_tele;
+        while (i >= 0) {
+            path->tiles[i + removed] = path->tiles[i];
+            *path_enemies(path, i + removed) = *path_enemies(path, i);
+            map->damage[path->base + i + removed] = 
+                map->damage[path->base + i];
+            struct coord_data current = path->tiles[i + removed];
+            int *index = &map->path_index[tile_index(map, current.row, 
+                                                     current.col)];
+            *index = path->base + i + removed;
+            mark_dirty(index, sizeof *index);
+            i--;
+        }
+        mark_moved(map, path, removed, start_tele + 1);
+        path->base += removed;
+        path->tiles += removed;
+        path->head = (path->head + removed) % path->capacity;
+    } else {
+        // Moves the rest of the path, its enemies and its damage, up behind
+        // the start teleporter.
+        STATS_ADD(tiles, path->length - end_tele + 1);
+        int i = end_tele;
+        while (i <= path->length) {
+            path->tiles[i - removed] = path->tiles[i];
+            *path_enemies(path, i - removed) = *path_enemies(path, i);
+            map->damage[path->base + i - removed] = 
+                map->damage[path->base + i];
+            struct coord_data current = path->tiles[i - removed];
+            int *index = &map->path_index[tile_index(map, current.row, 
+                                                     current.col)];
+            *index = path->base + i - removed;
+            mark_dirty(index, sizeof *index);
+            i++;
+        }
+        mark_moved(map, path, end_tele - removed, 
+                   path->length - end_tele + 1);
+    }
+    path->length -= removed;
+}
+
+/**
+ * Creates a teleporter on the path. Enemies travel from one teleporter 
+ * to the next. 
+ * 
+ * Parameters:
+ *     map - map of the tiles 
+ *     path - the path
+ *     tele_1 - coordinates of one teleporter
+ *     tele_2 - coordinates of the other teleporter
+ * Returns:
+ *     RESULT_OK - if the teleporters were created
+ *     RESULT_TELEPORT_BRANCHES or RESULT_NOT_ON_PATH - if not.
+ */
+int create_teleporter(struct map *map, struct path *path,
+                      struct coord_data tele_1, struct coord_data tele_2) {
+    // Cutting out part of the path would leave branches joining nothing.
+    if (path->n_branches > 0) {
+        return RESULT_TELEPORT_BRANCHES;
+    }
+    // determines where on the path the teleporters lie, leaving out the end
+    // tile.
+    int tele_path_1 = path_position(map, path, tele_1.row, tele_1.col);
+    int tele_path_2 = path_position(map, path, tele_2.row, tele_2.col);
+    if (tele_path_1 == path->length) {
+        tele_path_1 = NOT_PATH;
+    }
+    if (tele_path_2 == path->length || tele_path_2 == tele_path_1) {
+        tele_path_2 = NOT_PATH;
+    }
+    // If the teleporters aren't both on the path, then it is an error. 
+    if (tele_path_1 == NOT_PATH || tele_path_2 == NOT_PATH) {
+        return RESULT_NOT_ON_PATH;
+    }
+    // teleporter that appears earlier in the path is set as start tele.
+    else if (tele_path_1 < tele_path_2) {
+        create_tele_path(map, path, tele_path_1, tele_path_2);
+    } else {
+        create_tele_path(map, path, tele_path_2, tele_path_1);
+    }            
+    return RESULT_OK;
+}
+
+/**
+ * Finds the land that points from one tile of a path to the next.
+ * 
+ * Parameters:
+ *     tile - the tile to point from
+ *     next - the tile next to it to point at
+ * Returns:
+ *     land - the path land pointing at `next`
+ */
+int direction_land(struct coord_data tile, struct coord_data next) {
+    if (next.row < tile.row) {
+        return PATH_UP;
+    } else if (next.row > tile.row) {
+        return PATH_DOWN;
+    } else if (next.col < tile.col) {
+        return PATH_LEFT;
+    }
+    return PATH_RIGHT;
+}
+
+/**
+ * Adds up the damage a tile would take per attack from the towers in range
+ * of it.
+ * 
+ * Parameters:
+ *     map - map of the tiles
+ *     row - tile row
+ *     col - tile col
+ * Returns:
+ *     damage - total damage of the towers in range
+ */
+int tile_damage(struct map *map, int row, int col) {
+    int damage = 0;
+    int near_row = row - RANGE_FORTIFIED;
+    while (near_row <= row + RANGE_FORTIFIED) {
+        int near_col = col - RANGE_FORTIFIED;
+        while (near_col <= col + RANGE_FORTIFIED) {
+            if (test_point(map, near_row, near_col)) {
+                struct tower_data stats = tower_stats(
+                    tile_entity(map, tile_index(map, near_row, near_col)));
+                int distance = abs(near_row - row) > abs(near_col - col) ?
+                               abs(near_row - row) : abs(near_col - col);
+                if (distance <= stats.range) {
+                    damage += stats.power;
+                }
+            }
+            near_col++;
+        }
+        near_row++;
+    }
+    return damage;
+}
+
+/**
+ * Checks if enemies entering a segment of the path at a position can go on
+ * to reach a tile, through any of the branches they can take. `entered` 
+ * remembers the earliest position each segment has been searched from, so
+ * no segment is searched twice from further along.
+ * 
+ * Parameters:
+ *     path - the path
+ *     segment - the segment the enemies enter
+ *     position - where they enter it
+ *     target - the segment of the tile
+ *     target_position - the tile's position along its segment
+ *     entered - earliest position searched from in each segment, INT_MAX
+ *               for none
+ * Returns:
+ *     1 - if they can reach the tile
+ *     0 - if not.
+ */
+int reaches_tile(struct path *path, int segment, int position, int target, 
+                 int target_position, int *entered) {
+    if (segment == target && position <= target_position) {
+        return 1;
+    } else if (position >= entered[segment]) {
+        return 0;
+    }
+    entered[segment] = position;
+    int b = 0;
+    while (b < path->n_branches) {
+        struct branch *branch = &path->branches[b];
+        if (
+            branch->from == segment && branch->fork >= position &&
+            reaches_tile(path, b + 1, 0, target, target_position, entered)
+        ) {
+            return 1;
+        }
+        b++;
+    }
+    if (segment == 0) {
+        return 0;
+    }
+    struct branch *branch = &path->branches[segment - 1];
+    return reaches_tile(path, branch->into, branch->join, target, 
+                        target_position, entered);
+}
+
+/**
+ * Finds the shortest route over free grass (grass with no tower) to a tile
+ * next to `to`, by a breadth first search. The route starts on `from`, or 
+ * on a tile next to it when `from` is a path tile being forked from.
+ * 
+ * Parameters:
+ *     map - map of the tiles
+ *     from - where the route starts
+ *     fork - 1 if the route starts next to `from`, 0 if on it
+ *     to - the tile the route leads to
+ *     route - where to store the tiles of the route, in order
+ *     room - the most tiles `route` can hold
+ * Returns:
+ *     length - number of tiles in the route
+ *     0 - if there is no route, or not enough memory.
+ */
+int find_route(struct map *map, struct coord_data from, int fork, 
+               struct coord_data to, struct coord_data *route, int room) {
+    static const int steps[4][2] = {{-1, 0}, {0, 1}, {1, 0}, {0, -1}};
+    int n_tiles = map->rows * map->cols;
+    // Each tile reached holds the tile it was reached from, or itself for 
+    // the tiles the route can start on.
+    int *previous = malloc(n_tiles * sizeof *previous);
+    int *queue = malloc(n_tiles * sizeof *queue);
+    if (previous == NULL || queue == NULL) {
+        free(previous);
+        free(queue);
+        return 0;
+    }
+    int i = 0;
+    while (i < n_tiles) {
+        previous[i] = -1;
+        i++;
+    }
+    int n_queued = 0;
+    // Directions 0 to 3 step to the tiles next to `from`, and 4 stays on it.
+    int direction = fork ? 0 : 4;
+    int last = fork ? 3 : 4;
+    while (direction <= last) {
+        int row = from.row + (direction < 4 ? steps[direction][0] : 0);
+        int col = from.col + (direction < 4 ? steps[direction][1] : 0);
+        int index = tile_index(map, row, col);
+        if (
+            test_point(map, row, col) && test_free_grass(map, index) &&
+            previous[index] == -1
+        ) {
+            previous[index] = index;
+            queue[n_queued] = index;
+            n_queued++;
+        }
+        direction++;
+    }
+
+    int goal = -1;
+    int next = 0;
+    while (goal == -1 && next < n_queued) {
+        int index = queue[next];
+        int row = index / map->cols;
+        int col = index % map->cols;
+        STATS_ADD(tiles, 1);
+        if (abs(row - to.row) + abs(col - to.col) == 1) {
+            goal = index;
+        }
+        direction = 0;
+        while (goal == -1 && direction < 4) {
+            int near_row = row + steps[direction][0];
+            int near_col = col + steps[direction][1];
+            int near = tile_index(map, near_row, near_col);
+            if (
+                test_point(map, near_row, near_col) && 
+                test_free_grass(map, near) && previous[near] == -1
+            ) {
+                previous[near] = index;
+                queue[n_queued] = near;
+                n_queued++;
+            }
+            direction++;
+        }
+        next++;
+    }
+
+    // Follows the route back from the goal to find how long it is, then 
+    // again to store it.
+    int length = 0;
+    int index = goal;
+    while (index != -1) {
+        length++;
+        index = previous[index] == index ? -1 : previous[index];
+    }
+    if (length > room) {
+        length = 0;
+    }
+    i = length - 1;
+    index = goal;
+    while (i >= 0) {
+        route[i] = (struct coord_data){index / map->cols, index % map->cols};
+        index = previous[index];
+        i--;
+    }
+    free(previous);
+    free(queue);
+    return length;
+}
+
+/**
+ * Creates a branch of the path, along the shortest route over free grass 
+ * from `from` to a tile next to `to`. If `from` is grass, the branch is a 
+ * new spawn point starting there. If it is a path tile, half the enemies 
+ * leaving it turn into the branch instead. The branch joins the path at 
+ * `to`, which can be any path tile but the end. A branch that would lead 
+ * enemies back round to where it started is refused.
+ * 
+ * Parameters:
+ *     map - map of the tiles 
+ *     path - the path
+ *     from - where the branch starts
+ *     to - the path tile the branch joins
+ * Returns:
+ *     RESULT_OK - if the branch was created
+ *     RESULT_BAD_BRANCH, RESULT_TOO_MANY_BRANCHES, RESULT_BRANCH_LOOP or
+ *     RESULT_NO_ROUTE - if not.
+ */
+int create_branch(struct map *map, struct path *path, 
+                  struct coord_data from, struct coord_data to) {
+    int fork = 0;
+    int from_segment = tile_segment(map, path, from.row, from.col, &fork);
+    int join = 0;
+    int into = tile_segment(map, path, to.row, to.col, &join);
+    int spawn = from_segment == NO_SEGMENT;
+    if (
+        (spawn ? !test_point(map, from.row, from.col) || 
+                 !test_free_grass(map, tile_index(map, from.row, from.col)) :
+                 from_segment == 0 && fork == path->length) ||
+        into == NO_SEGMENT || (into == 0 && join == path->length)
+    ) {
+        return RESULT_BAD_BRANCH;
+    } else if (path->n_branches == MAX_BRANCHES) {
+        return RESULT_TOO_MANY_BRANCHES;
+    }
+    int entered[MAX_BRANCHES + 1];
+    int i = 0;
+    while (i <= MAX_BRANCHES) {
+        entered[i] = INT_MAX;
+        i++;
+    }
+    if (
+        !spawn && reaches_tile(path, into, join, from_segment, fork, entered)
+    ) {
+        return RESULT_BRANCH_LOOP;
+    }
+
+    // Each branch is stored after the last, with a slot for its exit.
+    int first = 0;
+    if (path->n_branches > 0) {
+        struct branch *last = &path->branches[path->n_branches - 1];
+        first = last->first + last->length + 1;
+    }
+    struct coord_data *tiles = &path->branch_tiles[first];
+    int length = find_route(map, from, !spawn, to, tiles, 
+                            path->branch_capacity - first - 1);
+    if (length == 0) {
+        return RESULT_NO_ROUTE;
+    }
+    mark_dirty(tiles, length * sizeof *tiles);
+    path->branches[path->n_branches] = (struct branch){
+        first, length, 0, spawn ? NO_SEGMENT : from_segment, fork, into, join
+    };
+    path->n_branches++;
+    i = 0;
+    while (i < length) {
+        struct coord_data tile = tiles[i];
+        int slot = path->capacity + first + i;
+        set_land(map, tile.row, tile.col, i == 0 && spawn ? PATH_START :
+                 direction_land(tile, i + 1 < length ? tiles[i + 1] : to));
+        int index = tile_index(map, tile.row, tile.col);
+        map->path_index[index] = slot;
+        map->damage[slot] = tile_damage(map, tile.row, tile.col);
+        mark_dirty(&map->path_index[index], sizeof *map->path_index);
+        i++;
+    }
+    memset(&path->branch_enemies[first], 0, 
+           (length + 1) * sizeof *path->branch_enemies);
+    mark_dirty(&path->branch_enemies[first], 
+               (length + 1) * sizeof *path->branch_enemies);
+    mark_dirty(&map->damage[path->capacity + first], 
+               length * sizeof *map->damage);
+    return RESULT_OK;
+}
+
+/**
+ * Carries out a single command on the game, without printing anything. 
+ * What happened is stored in `event` for the caller to report as it likes.
+ * Commands that only print something, like `o` and `s`, leave the game as
+ * it is; `show_command` carries those out.
+ * 
+ * Parameters:
+ *     game - the game to play
+ *     command - the command to carry out
+ *     event - where to store what happened, or NULL
+ * Returns:
+ *     CONTINUE - if there are lives left
+ *     STOP - if the game has run out of lives
+ */
+int apply_command(struct game *game, struct command *command, 
+                  struct event *event) {
+    struct map *map = &game->map;
+    struct path *path = &game->path;
+    int *lives = &game->lives;
+    int *money = &game->money;
+    int *args = command->args;
+    struct coord_data first = {args[0], args[1]};
+    struct coord_data second = {args[2], args[3]};
+    struct event ignored;
+    if (event == NULL) {
+        event = &ignored;
+    }
+    *event = (struct event){command->type, RESULT_OK, 0};
+    // Adds enemies to the starting square.
+    if (command->type == ENEMIES) {
+        event->result = add_enemies(path, args[0]);
+    }
+    // Creates a Tower and adds it to the map. 
+    else if (command->type == TOWER) {
+        event->result = create_tower(map, money, first);
+    }
+    // Moves the enemies down the path.
+    else if (command->type == MOVE) {
+        if (args[0] > 0) {
+            game->ticks += args[0];
+        }
+        event->count = move_enemies(path, lives, args[0]);
+        // This checks if the game is out of lives. 
+        return *lives <= OUT_OF_LIVES ? STOP : CONTINUE;
+    }
+    // Upgrades the tower. 
+    else if (command->type == UPGRADE) {
+        event->result = upgrade_tower(map, money, first);
+    }
+    // The towers deal damage and reduce the enemies in range.
+    else if (command->type == ATTACK) {
+        event->count = attack_total(map, path, money, args[0]);
+        game->kills += event->count;
+    }
+    // creates a pattern of water tiles on the map, which needs a spacing to
+    // divide by
+    else if (command->type == RAIN) {
+        if (first.row == 0 || first.col == 0) {
+            event->result = RESULT_NO_SPACING;
+        } else {
+            create_rain(map, first, second);
+        }
+    }
+    // Changes tiles adjacent to water into water tiles.
+    else if (command->type == FLOOD) {
+        create_flood(map, args[0]);
+    }
+    else if (command->type == TELEPORT) {
+        event->result = create_teleporter(map, path, first, second);
+    }
+    // Adds a branch that joins the path.
+    else if (command->type == BRANCH) {
+        event->result = create_branch(map, path, first, second);
+    }
+    // Tower suggestions are made by `show_command`, and need at least one 
+    // turn to look ahead.
+    else if (command->type == OPTIMIZE && args[0] <= 0) {
+        event->result = RESULT_NO_HORIZON;
+    }
+    // The game keeps no history of its own, so `apply_history` carries out
+    // undo and redo for games that do.
+    else if (command->type == UNDO) {
+        event->result = RESULT_NO_UNDO;
+    }
+    else if (command->type == REDO) {
+        event->result = RESULT_NO_REDO;
+    }
+    return CONTINUE;
+}
+
+/**
+ * Finds the message for a command's result.
+ * 
+ * Parameters:
+ *     result - the result
+ * Returns:
+ *     message - what went wrong, or NULL for RESULT_OK
+ */
+const char *result_message(int result) {
+    if (result == RESULT_LAKE_OUT_OF_BOUNDS) {
+        return "Error: Lake out of bounds, ignoring...";
+    } else if (result == RESULT_TOWER_REFUSED) {
+        return "Error: Tower creation unsuccessful. Make sure you have at "
+               "least $200 and that the tower is placed on a grass block "
+               "with no entity.";
+    } else if (result == RESULT_NO_FUNDS) {
+        return "Error: Insufficient Funds.";
+    } else if (result == RESULT_UPGRADE_OUT_OF_BOUNDS) {
+        return "Error: Upgrade target is out-of-bounds.";
+    } else if (result == RESULT_NO_TOWER) {
+        return "Error: Upgrade target contains no tower entity.";
+    } else if (result == RESULT_FULLY_UPGRADED) {
+        return "Error: Tower cannot be upgraded further.";
+    } else if (result == RESULT_TELEPORT_BRANCHES) {
+        return "Error: Teleporters can't be created on a path with branches.";
+    } else if (result == RESULT_NOT_ON_PATH) {
+        return "Error: Teleporters can only be created on path tiles.";
+    } else if (result == RESULT_BAD_BRANCH) {
+        return "Error: A branch must start on free grass or a path tile, "
+               "and join a path tile before the end.";
+    } else if (result == RESULT_TOO_MANY_BRANCHES) {
+        return "Error: The path can't have any more branches.";
+    } else if (result == RESULT_BRANCH_LOOP) {
+        return "Error: A branch can't lead enemies back to where it starts.";
+    } else if (result == RESULT_NO_ROUTE) {
+        return "Error: There is no route over free grass for that branch.";
+    } else if (result == RESULT_NOT_SERVED) {
+        return "Error: Tower suggestions and stats aren't available from a "
+               "server.";
+    } else if (result == RESULT_NO_UNDO) {
+        return "Error: There is nothing to undo.";
+    } else if (result == RESULT_NO_REDO) {
+        return "Error: There is nothing to redo.";
+    } else if (result == RESULT_BAD_SETUP) {
+        return "Error: The start and end points and the path must be on the "
+               "map.";
+    } else if (result == RESULT_NO_SPACING) {
+        return "Error: Rain must have a row and column spacing other than 0.";
+    } else if (result == RESULT_NO_HORIZON) {
+        return "Error: Towers can only be suggested over at least 1 turn.";
+    } else if (result == RESULT_TOO_MANY_ENEMIES) {
+        return "Error: The start of the path can't hold that many more "
+               "enemies.";
+    }
+    return NULL;
+}
+
+/**
+ * Prints the message for a result, unless it is RESULT_OK or the map is 
+ * quiet.
+ * 
+ * Parameters:
+ *     map - map of the tiles
+ *     result - the result
+ * Returns:
+ *     nothing
+ */
+void print_result(struct map *map, int result) {
+    if (result != RESULT_OK) {
+        print_message(map, "%s\n", result_message(result));
+    }
+}
+
+/**
+ * Writes the message for what happened when a command was carried out.
+ * 
+ * Parameters:
+ *     event - what happened
+ *     text - where to write the message, which ends in a newline
+ *     size - size of `text`, at least `MESSAGE_SIZE`
+ * Returns:
+ *     length - length of the message, or 0 if there isn't one
+ */
+int event_text(struct event *event, char *text, size_t size) {
+    text[0] = '\0';
+    if (event->type == MOVE) {
+        return snprintf(text, size, "%d enemies reached the end!\n", 
+                        (int)event->count);
+    } else if (event->type == ATTACK) {
+        return snprintf(text, size, "%d enemies destroyed!\n", 
+                        (int)event->count);
+    } else if (event->result != RESULT_OK) {
+        return snprintf(text, size, "%s\n", result_message(event->result));
+    } else if (event->type == TOWER) {
+        return snprintf(text, size, "Tower successfully created!\n");
+    } else if (event->type == UPGRADE) {
+        return snprintf(text, size, "Upgrade Successful!\n");
+    } else if (event->type == BRANCH) {
+        return snprintf(text, size, "Branch successfully created!\n");
+    }
+    return 0;
+}
+
+/**
+ * Prints what happened when a command was carried out, unless the map is 
+ * quiet.
+ * 
+ * Parameters:
+ *     map - map of the tiles
+ *     event - what happened
+ * Returns:
+ *     nothing
+ */
+void print_event(struct map *map, struct event *event) {
+    char text[MESSAGE_SIZE];
+    if (event_text(event, text, sizeof text) > 0) {
+        print_message(map, "%s", text);
+    }
+}
+
+/**
+ * Carries out a command and prints what happened, along with the commands 
+ * that only print something: tower suggestions and the stats.
+ * 
+ * Parameters:
+ *     game - the game to play
+ *     command - the command to carry out
+ * Returns:
+ *     CONTINUE - if there are lives left
+ *     STOP - if the game has run out of lives
+ */
+int show_command(struct game *game, struct command *command) {
+    struct event event;
+    int condition = apply_command(game, command, &event);
+    // Suggests where to build or upgrade towers.
+    if (command->type == OPTIMIZE && event.result == RESULT_OK) {
+        optimize_towers(game, command->args[0]);
+    }
+    // Prints the counters for the commands so far.
+    else if (command->type == STATS && !game->map.quiet) {
+        print_stats();
+    }
+    print_event(&game->map, &event);
+    return condition;
+}
+
+/**
+ * Carries out a command typed into the game. In a build with DEFENCE_STATS,
+ * it is counted and timed as well.
+ * 
+ * Parameters:
+ *     game - the game to play
+ *     command - the command to carry out
+ * Returns:
+ *     CONTINUE - if there are lives left
+ *     STOP - if the game has run out of lives
+ */
+int run_command(struct game *game, struct command *command) {
+#ifdef DEFENCE_STATS
+    stat_counts = (struct stat_counts){0, 0, 0};
+    long long start = clock_ns();
+    int condition = show_command(game, command);
+    count_stats(command, clock_ns() - start);
+    return condition;
+#else
+    return show_command(game, command);
+#endif
+}
+
+#ifdef DEFENCE_STATS
+/**
+ * Adds a command that has just been carried out to the stats for its type,
+ * along with the `stat_counts` it left.
+ * 
+ * Parameters:
+ *     command - the command, or DRAW for drawing the map
+ *     elapsed - how long it took, in nanoseconds
+ * Returns:
+ *     nothing
+ */
+void count_stats(struct command *command, long long elapsed) {
+    struct command_stats *stats = &command_stats[(unsigned char)command->type];
+    stats->calls++;
+    if (
+        (command->type == MOVE || command->type == ATTACK || 
+         command->type == FLOOD) && command->args[0] > 0
+    ) {
+        stats->repeats += command->args[0];
+    }
+    stats->tiles += stat_counts.tiles;
+    stats->moved += stat_counts.moved;
+    stats->destroyed += stat_counts.destroyed;
+    stats->total_ns += elapsed;
+    if (elapsed > stats->max_ns) {
+        stats->max_ns = elapsed;
+    }
+    int bucket = 63 - __builtin_clzll((unsigned long long)elapsed | 1);
+    stats->latency[bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1]++;
+}
+#endif
+
+/**
+ * Draws the map, timing it as a DRAW in a build with DEFENCE_STATS.
+ * 
+ * Parameters:
+ *     game - the game to draw
+ *     frame - the frame to draw it into, or NULL if it isn't drawn
+ * Returns:
+ *     nothing
+ */
+void draw_game(struct game *game, struct frame *frame) {
+#ifdef DEFENCE_STATS
+    stat_counts = (struct stat_counts){0, 0, 0};
+    long long start = clock_ns();
+#endif
+    print_map(&game->map, &game->path, game->lives, game->money, frame);
+#ifdef DEFENCE_STATS
+    if (frame != NULL) {
+        struct command draw = {DRAW, {0, 0, 0, 0}};
+        count_stats(&draw, clock_ns() - start);
+    }
+#endif
+}
+
+/**
+ * Names the function that carries out a type of command, for the stats.
+ * 
+ * Parameters:
+ *     type - the type of command
+ * Returns:
+ *     name - the function's name
+ *     NULL - if the type isn't a command
+ */
+const char *command_name(char type) {
+    if (type == ENEMIES) {
+        return "add_enemies";
+    } else if (type == TOWER) {
+        return "create_tower";
+    } else if (type == MOVE) {
+        return "move_enemies";
+    } else if (type == UPGRADE) {
+        return "upgrade_tower";
+    } else if (type == ATTACK) {
+        return "attack_total";
+    } else if (type == RAIN) {
+        return "create_rain";
+    } else if (type == FLOOD) {
+        return "create_flood";
+    } else if (type == TELEPORT) {
+        return "create_teleporter";
+    } else if (type == BRANCH) {
+        return "create_branch";
+    } else if (type == OPTIMIZE) {
+        return "optimize_towers";
+    } else if (type == DRAW) {
+        return "print_map";
+    }
+    return NULL;
+}
+
+/**
+ * Prints the counters for every type of command that has been carried out, 
+ * then how long each one took, in powers of two of nanoseconds.
+ * 
+ * Parameters:
+ *     nothing
+ * Returns:
+ *     nothing
+ */
+void print_stats(void) {
+#ifdef DEFENCE_STATS
+    const char *types = "etmuarfcbop";
+    print_text("%-18s %9s %9s %9s %11s %11s %11s %9s\n", "Command", 
+               "Calls", "Repeats", "Tiles", "Moved", "Destroyed", 
+               "Total ms", "Max us");
+    int i = 0;
+    while (types[i] != '\0') {
+        struct command_stats *stats = &command_stats[(unsigned char)types[i]];
+        if (stats->calls > 0) {
+            print_text("%-18s %9lld %9lld %9lld %11lld %11lld %11.3f "
+                       "%9.1f\n", command_name(types[i]), stats->calls, 
+                       stats->repeats, stats->tiles, stats->moved, 
+                       stats->destroyed, stats->total_ns / 1e6, 
+                       stats->max_ns / 1e3);
+        }
+        i++;
+    }
+    i = 0;
+    while (types[i] != '\0') {
+        struct command_stats *stats = &command_stats[(unsigned char)types[i]];
+        if (stats->calls > 0) {
+            print_text("%s latency (ns):", command_name(types[i]));
+            int bucket = 0;
+            while (bucket < STATS_BUCKETS) {
+                if (stats->latency[bucket] > 0) {
+                    print_text(" %lld+: %lld", 1LL << bucket, 
+                               stats->latency[bucket]);
+                }
+                bucket++;
+            }
+            print_text("\n");
+        }
+        i++;
+    }
+#else
+    print_text("Error: This build has no stats. Build it with "
+               "-DDEFENCE_STATS to count commands.\n");
+#endif
+}
+
+/**
+ * Writes the state the game finished in.
+ * 
+ * Parameters:
+ *     game - the finished game
+ *     text - where to write it
+ *     size - size of `text`, at least `MESSAGE_SIZE`
+ * Returns:
+ *     length - length of the text
+ */
+int summary_text(struct game *game, char *text, size_t size) {
+    return snprintf(text, size, "\nLives: %d Money: $%d Enemies: %lld\n", 
+                    game->lives, game->money, game->path.total_enemies);
+}
+
+/**
+ * Prints the state the game finished in, for headless games which don't 
+ * print the map.
+ * 
+ * Parameters:
+ *     game - the finished game
+ * Returns:
+ *     nothing
+ */
+void print_summary(struct game *game) {
+    char text[MESSAGE_SIZE];
+    summary_text(game, text, sizeof text);
+    fputs(text, stdout);
+}
+
+/**
+ * Prints Game Over and ends the program 
+ * 
+ * Parameters:
+ *     none.
+ * Returns:
+ *     0 - return nothing to end main.
+ */
+int game_over(void) {
+#ifdef DEFENCE_STATS
+    printf("\n");
+    print_stats();
+#endif
+    printf("\nGame Over!\n");
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////  GAME STATE  ////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Writes a block of bytes to a file.
+ * 
+ * Parameters:
+ *     file - the file to write to
+ *     data - the bytes to write
+ *     size - number of bytes
+ * Returns:
+ *     1 - if it was all written
+ *     0 - if not.
+ */
+int write_block(FILE *file, const void *data, size_t size) {
+    return size == 0 || fwrite(data, size, 1, file) == 1;
+}
+
+/**
+ * Reads a block of bytes from a file.
+ * 
+ * Parameters:
+ *     file - the file to read from
+ *     data - where to store the bytes
+ *     size - number of bytes
+ * Returns:
+ *     1 - if it was all read
+ *     0 - if not.
+ */
+int read_block(FILE *file, void *data, size_t size) {
+    return size == 0 || fread(data, size, 1, file) == 1;
+}
+
+/**
+ * Finds where the next plane of a game goes, and moves past it. Planes are
+ * kept 8-byte aligned.
+ * 
+ * Parameters:
+ *     base - start of the game's memory, or NULL to only count bytes
+ *     *offset - bytes used so far
+ *     size - bytes in the plane
+ * Returns:
+ *     plane - where the plane starts, or NULL if `base` is NULL
+ */
+void *place_plane(char *base, size_t *offset, size_t size) {
+    void *plane = base == NULL ? NULL : base + *offset;
+    *offset += (size + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+    return plane;
+}
+
+/**
+ * Lays out the planes of a game one after another, after the game itself.
+ * The map size and path capacity must already be set.
+ * 
+ * Parameters:
+ *     game - the game to lay out
+ *     base - the game's memory, or NULL to only count bytes
+ * Returns:
+ *     size - number of bytes the whole game takes
+ */
+size_t layout_game(struct game *game, char *base) {
+    struct map *map = &game->map;
+    struct path *path = &game->path;
+    size_t n_tiles = (size_t)map->rows * map->cols;
+    size_t n_words = (size_t)map->rows * map->words;
+    size_t offset = 0;
+    place_plane(base, &offset, sizeof *game);
+    map->grass = place_plane(base, &offset, n_words * sizeof *map->grass);
+    map->water = place_plane(base, &offset, n_words * sizeof *map->water);
+    map->basic = place_plane(base, &offset, n_words * sizeof *map->basic);
+    map->power = place_plane(base, &offset, n_words * sizeof *map->power);
+    map->frontier = place_plane(base, &offset, 
+                                n_words * sizeof *map->frontier);
+    map->flooded = place_plane(base, &offset, 
+                               n_words * sizeof *map->flooded);
+    map->path_index = place_plane(base, &offset, 
+                                  n_tiles * sizeof *map->path_index);
+    map->damage = place_plane(base, &offset, 
+                              (size_t)(path->capacity + path->branch_capacity)
+                              * sizeof *map->damage);
+    path->tiles = place_plane(base, &offset, 
+                              path->capacity * sizeof *path->tiles);
+    path->enemies = place_plane(base, &offset, 
+                                path->capacity * sizeof *path->enemies);
+    path->branch_tiles = place_plane(base, &offset, path->branch_capacity *
+                                     sizeof *path->branch_tiles);
+    path->branch_enemies = place_plane(base, &offset, path->branch_capacity *
+                                       sizeof *path->branch_enemies);
+    map->tile = place_plane(base, &offset, n_tiles * sizeof *map->tile);
+    return offset;
+}
+
+/**
+ * Points a game's planes at its own memory, with the path's tiles starting
+ * `base` places into their plane. Needed after the game has been copied,
+ * since the copy's planes still point into the original.
+ * 
+ * Parameters:
+ *     game - the game to fix up
+ * Returns:
+ *     nothing
+ */
+void bind_game(struct game *game) {
+    layout_game(game, (char *)game);
+    game->path.tiles += game->path.base;
+}
+
+/**
+ * Allocates a game in one block of memory, with an empty path and no lives
+ * or money. The map still has to be initialised.
+ * 
+ * Parameters:
+ *     rows - number of map rows
+ *     cols - number of map columns
+ * Returns:
+ *     game - the new game
+ *     NULL - if there is not enough memory
+ */
+struct game *allocate_game(int rows, int cols) {
+    struct game shape;
+    shape.map.rows = rows;
+    shape.map.cols = cols;
+    shape.map.words = (cols + WORD_BITS - 1) / WORD_BITS;
+    // The path can visit at most every tile once, plus the end tile.
+    shape.path.capacity = rows * cols + 1;
+    // Branches are only laid on grass, so they fit in a slot per tile, plus
+    // an exit slot each.
+    shape.path.branch_capacity = rows * cols + MAX_BRANCHES;
+    size_t size = layout_game(&shape, NULL);
+
+    struct game *game = calloc(1, size);
+    if (game == NULL) {
+        return NULL;
+    }
+    game->size = size;
+    game->map.rows = rows;
+    game->map.cols = cols;
+    game->map.words = shape.map.words;
+    game->path.capacity = shape.path.capacity;
+    game->path.branch_capacity = shape.path.branch_capacity;
+    bind_game(game);
+    return game;
+}
+
+/**
+ * Frees a game, along with all of its planes.
+ * 
+ * Parameters:
+ *     game - the game to free
+ * Returns:
+ *     nothing
+ */
+void free_game(struct game *game) {
+    free(game);
+}
+
+/**
+ * Copies the whole state of one game over another of the same size, which 
+ * is how snapshots are taken and restored. Whether the copy is quiet stays 
+ * as it was.
+ * 
+ * Parameters:
+ *     copy - the game to copy over
+ *     game - the game to copy
+ * Returns:
+ *     nothing
+ */
+void copy_game(struct game *copy, struct game *game) {
+    int quiet = copy->map.quiet;
+    memcpy(copy, game, game->size);
+    copy->map.quiet = quiet;
+    bind_game(copy);
+}
+
+/**
+ * Copies just what drawing the map needs from one game over another of the
+ * same size: the game's own struct, the tiles, where the path runs and the 
+ * enemies on it. On a large map this is a fraction of `copy_game`, but the
+ * copy is only good for drawing.
+ * 
+ * Parameters:
+ *     copy - the game to copy over
+ *     game - the game to copy
+ * Returns:
+ *     nothing
+ */
+void snapshot_game(struct game *copy, struct game *game) {
+    struct map *map = &game->map;
+    struct path *path = &game->path;
+    size_t n_tiles = (size_t)map->rows * map->cols;
+    int quiet = copy->map.quiet;
+    memcpy(copy, game, sizeof *game);
+    copy->map.quiet = quiet;
+    bind_game(copy);
+    memcpy(copy->map.tile, map->tile, n_tiles * sizeof *map->tile);
+    memcpy(copy->map.path_index, map->path_index, 
+           n_tiles * sizeof *map->path_index);
+    memcpy(copy->path.enemies, path->enemies, 
+           path->capacity * sizeof *path->enemies);
+    memcpy(copy->path.branch_enemies, path->branch_enemies, 
+           path->branch_capacity * sizeof *path->branch_enemies);
+}
+
+/**
+ * Makes a new snapshot of a game.
+ * 
+ * Parameters:
+ *     game - the game to copy
+ * Returns:
+ *     copy - a separate game in the same state
+ *     NULL - if there is not enough memory
+ */
+struct game *clone_game(struct game *game) {
+    struct game *copy = malloc(game->size);
+    if (copy == NULL) {
+        return NULL;
+    }
+    copy->map.quiet = game->map.quiet;
+    copy_game(copy, game);
+    return copy;
+}
+
+/**
+ * Writes the whole state of a game to a file, as one image.
+ * 
+ * Parameters:
+ *     file - the file to write to
+ *     game - the game to write
+ * Returns:
+ *     1 - if it was all written
+ *     0 - if not.
+ */
+int write_game(FILE *file, struct game *game) {
+    return write_block(file, game, game->size);
+}
+
+/**
+ * Finds the length of a segment of the path.
+ * 
+ * Parameters:
+ *     path - the path
+ *     segment - 0 for the main path, or `b + 1` for branch `b`
+ * Returns:
+ *     length - number of tiles in the segment, not counting its exit
+ */
+int segment_length(struct path *path, int segment) {
+    return segment == 0 ? path->length : path->branches[segment - 1].length;
+}
+
+/**
+ * Checks that the branches of a path read from a game image stay inside 
+ * their planes, and fork from and join segments that exist.
+ * 
+ * Parameters:
+ *     path - the path to check
+ * Returns:
+ *     1 - if the branches are sound
+ *     0 - if not.
+ */
+int test_branches(struct path *path) {
+    if (path->n_branches < 0 || path->n_branches > MAX_BRANCHES) {
+        return 0;
+    }
+    int b = 0;
+    while (b < path->n_branches) {
+        struct branch *branch = &path->branches[b];
+        if (
+            branch->first < 0 || branch->length < 1 ||
+            branch->length >= path->branch_capacity - branch->first ||
+            branch->head < 0 || branch->head > branch->length ||
+            branch->from < NO_SEGMENT || branch->from > path->n_branches ||
+            (branch->from != NO_SEGMENT && 
+             (branch->fork < 0 || 
+              branch->fork >= segment_length(path, branch->from))) ||
+            branch->into < 0 || branch->into > path->n_branches ||
+            branch->join < 0 || 
+            branch->join >= segment_length(path, branch->into)
+        ) {
+            return 0;
+        }
+        b++;
+    }
+    return 1;
+}
+
+/**
+ * Checks that a path tile read from a game image is on the map, that the 
+ * map points back to it from its slot, and that the slot's damage is what
+ * the towers around it deal.
+ * 
+ * Parameters:
+ *     map - map of the tiles
+ *     tile - coordinates of the path tile
+ *     slot - where the tile is stored in the path's planes
+ * Returns:
+ *     1 - if the tile is sound
+ *     0 - if not.
+ */
+int test_path_tile(struct map *map, struct coord_data tile, int slot) {
+    return test_point(map, tile.row, tile.col) &&
+           map->path_index[tile_index(map, tile.row, tile.col)] == slot &&
+           map->damage[slot] == tile_damage(map, tile.row, tile.col);
+}
+
+/**
+ * Checks that the planes of a game image agree with each other, so nothing 
+ * played on it can reach outside them. Every tile must hold a known land 
+ * and entity, with the bitboards set to match and nothing set past the 
+ * last column. Every path and branch tile must be on the map and point 
+ * back to its own slot, and no other tile may point anywhere.
+ * 
+ * Parameters:
+ *     game - the game to check, with its planes bound
+ * Returns:
+ *     1 - if the planes are sound
+ *     0 - if not.
+ */
+int test_planes(struct game *game) {
+    struct map *map = &game->map;
+    struct path *path = &game->path;
+    int row = 0;
+    while (row < map->rows) {
+        int word = 0;
+        while (word < map->words) {
+            // Works out what each bitboard's word should be from the tiles.
+            uint64_t grass = 0;
+            uint64_t water = 0;
+            uint64_t basic = 0;
+            uint64_t power = 0;
+            int col = word * WORD_BITS;
+            while (col < map->cols && col < (word + 1) * WORD_BITS) {
+                int index = tile_index(map, row, col);
+                int land = tile_land(map, index);
+                int entity = tile_entity(map, index);
+                if (land > TELEPORTER || entity > FORTIFIED_TOWER) {
+                    return 0;
+                }
+                uint64_t bit = (uint64_t)1 << (col % WORD_BITS);
+                grass |= land == GRASS ? bit : 0;
+                water |= land == WATER ? bit : 0;
+                basic |= entity == BASIC_TOWER ? bit : 0;
+                power |= entity == POWER_TOWER ? bit : 0;
+                col++;
+            }
+            size_t index = (size_t)row * map->words + word;
+            if (
+                map->grass[index] != grass || map->water[index] != water ||
+                map->basic[index] != basic || map->power[index] != power ||
+                (map->frontier[index] & ~water) != 0
+            ) {
+                return 0;
+            }
+            word++;
+        }
+        row++;
+    }
+
+    // Each slot points to a different tile, so if as many tiles point 
+    // somewhere as there are slots, they all point to one of them.
+    long long n_marked = 0;
+    size_t i = 0;
+    while (i < (size_t)map->rows * map->cols) {
+        n_marked += map->path_index[i] != NOT_PATH;
+        i++;
+    }
+    long long n_slots = 0;
+    int position = 0;
+    while (position <= path->length) {
+        if (
+            !test_path_tile(map, path->tiles[position], 
+                            path->base + position)
+        ) {
+            return 0;
+        }
+        n_slots++;
+        position++;
+    }
+    int b = 0;
+    while (b < path->n_branches) {
+        struct branch *branch = &path->branches[b];
+        position = 0;
+        while (position < branch->length) {
+            int slot = branch->first + position;
+            if (
+                !test_path_tile(map, path->branch_tiles[slot], 
+                                path->capacity + slot)
+            ) {
+                return 0;
+            }
+            n_slots++;
+            position++;
+        }
+        b++;
+    }
+    return n_marked == n_slots;
+}
+
+/**
+ * Reads a game image written by `write_game` over a game of the same size.
+ * 
+ * Parameters:
+ *     file - the file to read from
+ *     game - the game to read into
+ * Returns:
+ *     1 - if the image was read
+ *     0 - if it is cut short, is a different size of game or its planes 
+ *         don't agree.
+ */
+int read_game(FILE *file, struct game *game) {
+    struct game shape = *game;
+    if (!read_block(file, game, shape.size)) {
+        return 0;
+    }
+    game->map.quiet = shape.map.quiet;
+    if (
+        game->size != shape.size ||
+        game->map.rows != shape.map.rows || 
+        game->map.cols != shape.map.cols ||
+        game->path.capacity != shape.path.capacity ||
+        game->path.length < 0 || game->path.base < 0 ||
+        game->path.length >= shape.path.capacity - game->path.base ||
+        game->path.head < 0 || game->path.head >= shape.path.capacity ||
+        game->path.branch_capacity != shape.path.branch_capacity ||
+        !test_branches(&game->path)
+    ) {
+        // Keeps the game's own layout, though its state is lost.
+        memcpy(game, &shape, sizeof shape);
+        return 0;
+    }
+    bind_game(game);
+    if (!test_planes(game)) {
+        memcpy(game, &shape, sizeof shape);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Saves a game to a file, which `load_game` can pick up again.
+ * 
+ * Parameters:
+ *     game - the game to save
+ *     name - file name to save to
+ * Returns:
+ *     1 - if the game was saved
+ *     0 - if not.
+ */
+int save_game(struct game *game, const char *name) {
+    FILE *file = fopen(name, "wb");
+    if (file == NULL) {
+        return 0;
+    }
+    struct save_header header = {
+        .magic = SAVE_MAGIC,
+        .version = SAVE_VERSION,
+        .rows = game->map.rows,
+        .cols = game->map.cols,
+        .size = game->size
+    };
+    int saved = 
+        write_block(file, &header, sizeof header) && write_game(file, game);
+    if (fclose(file) != 0) {
+        saved = 0;
+    }
+    return saved;
+}
+
+/**
+ * Loads a game saved by `save_game`.
+ * 
+ * Parameters:
+ *     name - file name to load from
+ * Returns:
+ *     game - the saved game
+ *     NULL - if the file isn't a save from this version, or there is not
+ *            enough memory
+ */
+struct game *load_game(const char *name) {
+    FILE *file = fopen(name, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+    struct save_header header;
+    struct game *game = NULL;
+    if (
+        read_block(file, &header, sizeof header) &&
+        memcmp(header.magic, SAVE_MAGIC, sizeof header.magic) == 0 &&
+        header.version == SAVE_VERSION &&
+        header.rows > 0 && header.cols > 0 &&
+        header.rows <= (INT_MAX - 1) / header.cols
+    ) {
+        game = allocate_game(header.rows, header.cols);
+    }
+    if (
+        game != NULL && 
+        ((int64_t)game->size != header.size || !read_game(file, game))
+    ) {
+        free_game(game);
+        game = NULL;
+    }
+    fclose(file);
+    return game;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////  HISTORY  /////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Carves some memory out of a history's blocks, starting a new block when 
+ * the last one is full.
+ * 
+ * Parameters:
+ *     history - the history
+ *     size - number of bytes, at most a chunk
+ * Returns:
+ *     memory - the memory, 8-byte aligned
+ *     NULL - if there is not enough memory
+ */
+void *history_memory(struct history *history, size_t size) {
+    struct history_block *block = history->blocks;
+    size = (size + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+    if (block == NULL || block->used + size > HISTORY_BLOCK) {
+        block = malloc(HISTORY_BLOCK);
+        if (block == NULL) {
+            return NULL;
+        }
+        block->next = history->blocks;
+        block->used = sizeof *block;
+        history->blocks = block;
+    }
+    void *memory = (char *)block + block->used;
+    block->used += size;
+    return memory;
+}
+
+/**
+ * Catches the writes to a game with a history made on this thread, which 
+ * has to happen before the game is changed. Only one history is watched on
+ * a thread at a time.
+ * 
+ * Parameters:
+ *     history - the game's history
+ * Returns:
+ *     nothing
+ */
+void watch_history(struct history *history) {
+    watched_history = history;
+}
+
+/**
+ * Marks the chunks holding part of a game as changed, if the game's history
+ * is watched on this thread, so that they are compared at the next commit.
+ * Anything that changes a game's planes calls this for what it wrote; a 
+ * write to any other memory is ignored.
+ * 
+ * Parameters:
+ *     start - the part that was written
+ *     length - number of bytes written
+ * Returns:
+ *     nothing
+ */
+void mark_dirty(const void *start, size_t length) {
+    struct history *history = watched_history;
+    if (history == NULL || length == 0) {
+        return;
+    }
+    uintptr_t offset = (uintptr_t)start - (uintptr_t)history->game;
+    if (offset >= history->size) {
+        return;
+    }
+    size_t first = offset / HISTORY_CHUNK;
+    size_t last = (offset + length - 1) / HISTORY_CHUNK;
+    memset(history->dirty + first, 1, last - first + 1);
+}
+
+/**
+ * Checks whether part of a game's block may have changed since the current
+ * version: if it takes in any of the game's own struct, or a chunk marked 
+ * as changed.
+ * 
+ * Parameters:
+ *     history - the game's history
+ *     start - where the part starts in the block
+ *     end - where it ends
+ * Returns:
+ *     1 - if it may have changed
+ *     0 - if not.
+ */
+int range_dirty(struct history *history, size_t start, size_t end) {
+    if (start < sizeof(struct game)) {
+        return 1;
+    }
+    size_t first = start / HISTORY_CHUNK;
+    size_t last = (end + HISTORY_CHUNK - 1) / HISTORY_CHUNK;
+    return memchr(history->dirty + first, 1, last - first) != NULL;
+}
+
+/**
+ * Stores the part of a game's block under one node of a version's tree, 
+ * sharing every chunk and node that matches the node it is replacing. Only
+ * the parts that may have changed are compared.
+ * 
+ * Parameters:
+ *     history - the game's history
+ *     node - the node in the current version, or NULL if there isn't one
+ *     offset - where in the block the node starts
+ *     span - bytes covered by each of the node's slots
+ * Returns:
+ *     node - the node for the new version, which is `node` if nothing 
+ *            under it changed
+ *     NULL - if there is not enough memory
+ */
+void **store_chunks(struct history *history, void **node, size_t offset, 
+                    size_t span) {
+    void *slots[HISTORY_FANOUT];
+    int changed = node == NULL;
+    int i = 0;
+    while (i < HISTORY_FANOUT) {
+        size_t start = offset + i * span;
+        size_t end = start + span < history->size ? 
+                     start + span : history->size;
+        void *old = node == NULL ? NULL : node[i];
+        // Parts that haven't been touched are shared as they are.
+        int touched = start < history->size &&
+                      (old == NULL || range_dirty(history, start, end));
+        slots[i] = start < history->size ? old : NULL;
+        if (touched && span == HISTORY_CHUNK) {
+            char *chunk = (char *)history->game + start;
+            if (old == NULL || memcmp(old, chunk, end - start) != 0) {
+                slots[i] = history_memory(history, end - start);
+                if (slots[i] == NULL) {
+                    return NULL;
+                }
+                memcpy(slots[i], chunk, end - start);
+            }
+        } else if (touched) {
+            slots[i] = store_chunks(history, old, start, 
+                                    span / HISTORY_FANOUT);
+            if (slots[i] == NULL) {
+                return NULL;
+            }
+        }
+        if (slots[i] != old) {
+            changed = 1;
+        }
+        i++;
+    }
+    if (!changed) {
+        return node;
+    }
+    void **copy = history_memory(history, sizeof slots);
+    if (copy != NULL) {
+        memcpy(copy, slots, sizeof slots);
+    }
+    return copy;
+}
+
+/**
+ * Copies the chunks under one node of a version's tree back into a game's
+ * block, skipping any it already has: those shared with the node it is at,
+ * unless they may have changed since.
+ * 
+ * Parameters:
+ *     history - the game's history
+ *     from - the node the game is at
+ *     to - the node to go to
+ *     offset - where in the block the nodes start
+ *     span - bytes covered by each of the nodes' slots
+ * Returns:
+ *     nothing
+ */
+void load_chunks(struct history *history, void **from, void **to, 
+                 size_t offset, size_t span) {
+    int i = 0;
+    while (i < HISTORY_FANOUT && offset + i * span < history->size) {
+        size_t start = offset + i * span;
+        size_t end = start + span < history->size ? 
+                     start + span : history->size;
+        int differs = from[i] != to[i] || range_dirty(history, start, end);
+        if (differs && span == HISTORY_CHUNK) {
+            memcpy((char *)history->game + start, to[i], end - start);
+        } else if (differs) {
+            load_chunks(history, from[i], to[i], start, 
+                        span / HISTORY_FANOUT);
+        }
+        i++;
+    }
+}
+
+/**
+ * Starts the history of a game, with its state as the first version.
+ * 
+ * Parameters:
+ *     game - the game
+ * Returns:
+ *     history - the new history
+ *     NULL - if there is not enough memory
+ */
+struct history *allocate_history(struct game *game) {
+    struct history *history = calloc(1, sizeof *history);
+    if (history == NULL) {
+        return NULL;
+    }
+    history->game = game;
+    history->size = game->size;
+    history->span = HISTORY_CHUNK;
+    while (history->span * HISTORY_FANOUT < history->size) {
+        history->span *= HISTORY_FANOUT;
+    }
+    history->capacity = 16;
+    history->versions = malloc(history->capacity * sizeof *history->versions);
+    history->dirty = calloc((history->size + HISTORY_CHUNK - 1) / 
+                            HISTORY_CHUNK, 1);
+    void **root = NULL;
+    if (history->versions != NULL && history->dirty != NULL) {
+        root = store_chunks(history, NULL, 0, history->span);
+    }
+    if (root == NULL) {
+        free_history(history);
+        return NULL;
+    }
+    history->versions[0] = (struct version){root, NO_VERSION, NO_VERSION};
+    history->n_versions = 1;
+    history->current = 0;
+    return history;
+}
+
+/**
+ * Frees a history, along with every version in it.
+ * 
+ * Parameters:
+ *     history - the history to free
+ * Returns:
+ *     nothing
+ */
+void free_history(struct history *history) {
+    if (watched_history == history) {
+        watched_history = NULL;
+    }
+    while (history->blocks != NULL) {
+        struct history_block *next = history->blocks->next;
+        free(history->blocks);
+        history->blocks = next;
+    }
+    free(history->versions);
+    free(history->dirty);
+    free(history);
+}
+
+/**
+ * Keeps the game's state as a new version after the current one, unless 
+ * nothing has changed since. A new version becomes the one redo goes to.
+ * 
+ * Parameters:
+ *     history - the game's history
+ * Returns:
+ *     version - the version the game is now at
+ *     NO_VERSION - if there is not enough memory to keep it
+ */
+int commit_version(struct history *history) {
+    struct version *current = &history->versions[history->current];
+    void **root = store_chunks(history, current->root, 0, history->span);
+    size_t n_chunks = (history->size + HISTORY_CHUNK - 1) / HISTORY_CHUNK;
+    if (root == current->root) {
+        memset(history->dirty, 0, n_chunks);
+        return history->current;
+    }
+    if (root != NULL && history->n_versions == history->capacity) {
+        int capacity = 2 * history->capacity;
+        struct version *versions = realloc(history->versions, 
+                                           capacity * sizeof *versions);
+        if (versions == NULL) {
+            root = NULL;
+        } else {
+            history->versions = versions;
+            history->capacity = capacity;
+        }
+    }
+    // The changed chunks stay marked, so they are compared again next time.
+    if (root == NULL) {
+        return NO_VERSION;
+    }
+    int version = history->n_versions;
+    history->versions[version] = (struct version){
+        root, history->current, NO_VERSION
+    };
+    history->versions[history->current].redo = version;
+    history->n_versions++;
+    history->current = version;
+    memset(history->dirty, 0, n_chunks);
+    return version;
+}
+
+/**
+ * Puts a game back to any version in its history, only copying the chunks
+ * that differ from the version it is at or have been touched since. 
+ * Carrying on from there starts a new branch. Whether the game is quiet 
+ * stays as it was.
+ * 
+ * Parameters:
+ *     history - the game's history
+ *     version - the version to go to
+ * Returns:
+ *     nothing
+ */
+void checkout_version(struct history *history, int version) {
+    struct game *game = history->game;
+    int quiet = game->map.quiet;
+    watch_history(history);
+    load_chunks(history, history->versions[history->current].root, 
+                history->versions[version].root, 0, history->span);
+    game->map.quiet = quiet;
+    bind_game(game);
+    history->current = version;
+    memset(history->dirty, 0, (history->size + HISTORY_CHUNK - 1) / 
+           HISTORY_CHUNK);
+}
+
+/**
+ * Undoes or redoes the last change to a game.
+ * 
+ * Parameters:
+ *     history - the game's history, or NULL if it doesn't keep one
+ *     type - UNDO or REDO
+ * Returns:
+ *     RESULT_OK - if the game went back or forward a version
+ *     RESULT_NO_UNDO or RESULT_NO_REDO - if there is no such version
+ */
+int rewind_version(struct history *history, char type) {
+    int result = type == UNDO ? RESULT_NO_UNDO : RESULT_NO_REDO;
+    if (history == NULL) {
+        return result;
+    }
+    struct version *current = &history->versions[history->current];
+    int version = type == UNDO ? current->parent : current->redo;
+    if (version == NO_VERSION) {
+        return result;
+    }
+    if (type == UNDO) {
+        history->versions[version].redo = history->current;
+    }
+    checkout_version(history, version);
+    return RESULT_OK;
+}
+
+/**
+ * Carries out a command on a game that keeps a history, without printing 
+ * anything. Undo and redo go to another version, and any other command 
+ * that changes the game leaves a new one.
+ * 
+ * Parameters:
+ *     history - the game's history
+ *     command - the command to carry out
+ *     event - where to store what happened
+ * Returns:
+ *     CONTINUE - if there are lives left
+ *     STOP - if the game has run out of lives
+ */
+int apply_history(struct history *history, struct command *command, 
+                  struct event *event) {
+    if (command->type == UNDO || command->type == REDO) {
+        *event = (struct event){
+            command->type, rewind_version(history, command->type), 0
+        };
+        return CONTINUE;
+    }
+    watch_history(history);
+    int condition = apply_command(history->game, command, event);
+    commit_version(history);
+    return condition;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////  REPLAY LOGS  ///////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Creates a replay log and writes the setup of the game to it.
+ * 
+ * Parameters:
+ *     name - file name of the log
+ *     header - the setup of the game
+ *     route - the path directions, `header->route_length` of them
+ * Returns:
+ *     recorder - the recorder to log commands with
+ *     NULL - if the log can't be created
+ */
+struct recorder *open_recorder(const char *name, struct log_header *header,
+                               char *route) {
+    struct recorder *recorder = malloc(sizeof *recorder);
+    if (recorder == NULL) {
+        return NULL;
+    }
+    recorder->file = fopen(name, "wb");
+    if (recorder->file == NULL) {
+        free(recorder);
+        return NULL;
+    }
+    recorder->commands = 0;
+    recorder->index = NULL;
+    recorder->n_checkpoints = 0;
+    recorder->capacity = 0;
+    write_block(recorder->file, header, sizeof *header);
+    write_block(recorder->file, route, header->route_length);
+    return recorder;
+}
+
+/**
+ * Writes a checkpoint of the game to the log, and adds it to the index. 
+ * 
+ * Parameters:
+ *     recorder - the log being written
+ *     game - the game being played
+ *     type - UNDO or REDO if the game has just gone to another version, 
+ *            which a replay has to restore, or 0
+ * Returns:
+ *     nothing
+ */
+void record_checkpoint(struct recorder *recorder, struct game *game, 
+                       char type) {
+    if (recorder->n_checkpoints == recorder->capacity) {
+        int capacity = recorder->capacity == 0 ? 16 : 2 * recorder->capacity;
+        struct log_checkpoint *index = realloc(recorder->index, 
+                                               capacity * sizeof *index);
+        // Without room in the index, seeking just starts further back.
+        if (index == NULL) {
+            return;
+        }
+        recorder->index = index;
+        recorder->capacity = capacity;
+    }
+    struct log_checkpoint *checkpoint = 
+        &recorder->index[recorder->n_checkpoints];
+    checkpoint->command = recorder->commands;
+    checkpoint->offset = ftello(recorder->file);
+    recorder->n_checkpoints++;
+
+    // The size of the game goes in the record so a replay can skip it.
+    uint64_t size = game->size;
+    struct log_record record = {
+        CHECKPOINT, {(int32_t)(uint32_t)size, (int32_t)(size >> 32), type, 0}
+    };
+    write_block(recorder->file, &record, sizeof record);
+    write_game(recorder->file, game);
+}
+
+/**
+ * Writes a command to the log, with a checkpoint of the game before it every
+ * `LOG_CHECKPOINT_INTERVAL` commands.
+ * 
+ * Parameters:
+ *     recorder - the log being written
+ *     game - the game being played
+ *     command - the command about to be carried out
+ * Returns:
+ *     nothing
+ */
+void record_command(struct recorder *recorder, struct game *game, 
+                    struct command *command) {
+    if (recorder->commands % LOG_CHECKPOINT_INTERVAL == 0) {
+        record_checkpoint(recorder, game, 0);
+    }
+    struct log_record record;
+    record.type = command->type;
+    int i = 0;
+    while (i < MAX_ARGS) {
+        record.args[i] = command->args[i];
+        i++;
+    }
+    write_block(recorder->file, &record, sizeof record);
+    recorder->commands++;
+}
+
+/**
+ * Finishes a replay log by writing the checkpoint index and footer, then 
+ * closes it.
+ * 
+ * Parameters:
+ *     recorder - the log being written
+ * Returns:
+ *     1 - if the whole log was written
+ *     0 - if not.
+ */
+int close_recorder(struct recorder *recorder) {
+    struct log_footer footer = {
+        .index_offset = ftello(recorder->file),
+        .commands = recorder->commands,
+        .checkpoints = recorder->n_checkpoints,
+        .magic = LOG_MAGIC
+    };
+    write_block(recorder->file, recorder->index, 
+                recorder->n_checkpoints * sizeof *recorder->index);
+    write_block(recorder->file, &footer, sizeof footer);
+    int written = !ferror(recorder->file);
+    if (fclose(recorder->file) != 0) {
+        written = 0;
+    }
+    free(recorder->index);
+    free(recorder);
+    return written;
+}
+
+/**
+ * Opens a replay log, reading its setup and checkpoint index.
+ * 
+ * Parameters:
+ *     name - file name of the log
+ * Returns:
+ *     replay - the opened log, ready for `start_replay`
+ *     NULL - if the log can't be read or isn't a finished replay log
+ */
+struct replay *open_replay(const char *name) {
+    struct replay *replay = calloc(1, sizeof *replay);
+    if (replay == NULL) {
+        return NULL;
+    }
+    replay->file = fopen(name, "rb");
+    if (replay->file == NULL) {
+        free(replay);
+        return NULL;
+    }
+    setvbuf(replay->file, NULL, _IOFBF, INPUT_BLOCK_SIZE);
+
+    struct log_header *header = &replay->header;
+    struct log_footer *footer = &replay->footer;
+    int valid = 
+        read_block(replay->file, header, sizeof *header) &&
+        memcmp(header->magic, LOG_MAGIC, sizeof header->magic) == 0 &&
+        header->version == LOG_VERSION &&
+        header->rows > 0 && header->cols > 0 &&
+        header->rows <= (INT_MAX - 1) / header->cols &&
+        header->route_length >= 0 && 
+        header->route_length <= header->rows * header->cols;
+    // The setup is checked here too, so a log whose start, end or path 
+    // leaves the map isn't taken for a replay at all.
+    if (valid) {
+        replay->route = malloc(header->route_length + 1);
+        valid = 
+            replay->route != NULL &&
+            read_block(replay->file, replay->route, header->route_length) &&
+            test_setup(header, replay->route) &&
+            fseeko(replay->file, -(off_t)sizeof *footer, SEEK_END) == 0 &&
+            read_block(replay->file, footer, sizeof *footer) &&
+            memcmp(footer->magic, LOG_MAGIC, sizeof footer->magic) == 0 &&
+            footer->checkpoints >= 0;
+    }
+    if (valid) {
+        replay->index = malloc((footer->checkpoints + 1) * 
+                               sizeof *replay->index);
+        valid = 
+            replay->index != NULL &&
+            fseeko(replay->file, footer->index_offset, SEEK_SET) == 0 &&
+            read_block(replay->file, replay->index, 
+                       footer->checkpoints * sizeof *replay->index);
+    }
+    if (!valid) {
+        close_replay(replay);
+        return NULL;
+    }
+    return replay;
+}
+
+/**
+ * Closes a replay log.
+ * 
+ * Parameters:
+ *     replay - the log to close
+ * Returns:
+ *     nothing
+ */
+void close_replay(struct replay *replay) {
+    fclose(replay->file);
+    free(replay->route);
+    free(replay->index);
+    free(replay);
+}
+
+/**
+ * Sets up a game the way the log recorded it, ready to replay the first 
+ * command.
+ * 
+ * Parameters:
+ *     replay - the log to replay
+ *     game - a new game, the size given in the log
+ * Returns:
+ *     1 - if the setup was read
+ *     0 - if not.
+ */
+int start_replay(struct replay *replay, struct game *game) {
+    struct log_header *header = &replay->header;
+    if (
+        fseeko(replay->file, sizeof *header, SEEK_SET) != 0 ||
+        !read_block(replay->file, replay->route, header->route_length)
+    ) {
+        return 0;
+    }
+    int result = apply_setup(game, header, replay->route);
+    if (result == RESULT_BAD_SETUP) {
+        return 0;
+    }
+    replay->command = 0;
+    replay->offset = sizeof *header + header->route_length;
+    print_result(&game->map, result);
+    return 1;
+}
+
+/**
+ * Tests whether a setup stays on its map: the start and end points, and 
+ * every tile the path is laid over until it reaches the end. A setup from
+ * a log or a client can't be trusted to, and would otherwise be written 
+ * outside the game. 
+ * 
+ * Parameters:
+ *     header - the setup of the game
+ *     route - the `route_length` path directions
+ * Returns:
+ *     1 - if the setup stays on the map
+ *     0 - if not.
+ */
+int test_setup(struct log_header *header, char *route) {
+    struct map bounds = {.rows = header->rows, .cols = header->cols};
+    struct coord_data position = {header->start[0], header->start[1]};
+    struct coord_data end = {header->end[0], header->end[1]};
+    if (
+        !test_point(&bounds, position.row, position.col) ||
+        !test_point(&bounds, end.row, end.col)
+    ) {
+        return 0;
+    }
+    int i = 0;
+    while (i < header->route_length && test_path(position, end)) {
+        move_position(&position, route[i]);
+        if (!test_point(&bounds, position.row, position.col)) {
+            return 0;
+        }
+        i++;
+    }
+    return 1;
+}
+
+/**
+ * Sets up a new game from the setup in a log header and the path directions
+ * that follow it. A setup that doesn't stay on the map is refused before 
+ * anything is written.
+ * 
+ * Parameters:
+ *     game - a new game, the size given in the header
+ *     header - the setup of the game
+ *     route - the `route_length` path directions
+ * Returns:
+ *     result - the result of creating the lake
+ *     RESULT_BAD_SETUP - if the setup doesn't stay on the map
+ */
+int apply_setup(struct game *game, struct log_header *header, char *route) {
+    if (!test_setup(header, route)) {
+        return RESULT_BAD_SETUP;
+    }
+    struct map *map = &game->map;
+    struct path *path = &game->path;
+    initialise_map(map);
+    game->lives = header->lives;
+    game->money = header->money;
+    struct coord_data start = {header->start[0], header->start[1]};
+    struct coord_data end = {header->end[0], header->end[1]};
+    set_land(map, start.row, start.col, PATH_START);
+    set_land(map, end.row, end.col, PATH_END);
+    add_path_tile(map, path, start);
+    add_enemies(path, header->enemies);
+    struct coord_data lake = {header->lake[0], header->lake[1]};
+    int result = create_lake(map, lake, header->lake[2], header->lake[3]);
+
+    struct coord_data position = start;
+    int i = 0;
+    while (
+        i < header->route_length && 
+        step_path(map, path, &position, route[i], end)
+    ) {
+        i++;
+    }
+    return result;
+}
+
+/**
+ * Reads the next command from a replay log, skipping over checkpoints. A 
+ * checkpoint left by an undo or redo is where the game went, so the game 
+ * is restored from it instead.
+ * 
+ * Parameters:
+ *     replay - the log being replayed
+ *     game - the game being replayed
+ *     command - where to store the command
+ * Returns:
+ *     1 - if a command was read
+ *     0 - if there are no commands left
+ */
+int next_record(struct replay *replay, struct game *game, 
+                struct command *command) {
+    struct log_record record;
+    while (replay->offset < replay->footer.index_offset) {
+        if (!read_block(replay->file, &record, sizeof record)) {
+            return 0;
+        }
+        replay->offset += sizeof record;
+        if (record.type != CHECKPOINT) {
+            command->type = record.type;
+            int i = 0;
+            while (i < MAX_ARGS) {
+                command->args[i] = record.args[i];
+                i++;
+            }
+            replay->command++;
+            return 1;
+        }
+        off_t size = (off_t)((uint32_t)record.args[0] | 
+                             (uint64_t)(uint32_t)record.args[1] << 32);
+        int passed = record.args[2] != 0 ? read_game(replay->file, game) :
+                     fseeko(replay->file, size, SEEK_CUR) == 0;
+        if (!passed) {
+            return 0;
+        }
+        replay->offset += size;
+    }
+    return 0;
+}
+
+/**
+ * Moves a replay to just before the given command. The game is restored 
+ * from the last checkpoint before it, and the commands in between are 
+ * carried out quietly.
+ * 
+ * Parameters:
+ *     replay - a started replay
+ *     game - the game being replayed
+ *     target - number of commands to have carried out
+ * Returns:
+ *     CONTINUE - if the game is at the target
+ *     STOP - if the game ran out of lives before it
+ *     EOF - if the log has no such command or can't be read
+ */
+int seek_replay(struct replay *replay, struct game *game, long long target) {
+    if (target < 0 || target > replay->footer.commands) {
+        return EOF;
+    }
+    // Finds the last checkpoint at or before the target
+    int low = 0;
+    int high = replay->footer.checkpoints;
+    while (low < high) {
+        int middle = low + (high - low) / 2;
+        if (replay->index[middle].command <= target) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    if (low > 0 && replay->index[low - 1].command >= replay->command) {
+        struct log_checkpoint *checkpoint = &replay->index[low - 1];
+        struct log_record record;
+        if (
+            fseeko(replay->file, checkpoint->offset, SEEK_SET) != 0 ||
+            !read_block(replay->file, &record, sizeof record) ||
+            !read_game(replay->file, game)
+        ) {
+            return EOF;
+        }
+        replay->command = checkpoint->command;
+        replay->offset = ftello(replay->file);
+    }
+
+    int quiet = game->map.quiet;
+    game->map.quiet = 1;
+    int game_condition = CONTINUE;
+    struct command command;
+    while (
+        game_condition == CONTINUE && replay->command < target &&
+        next_record(replay, game, &command)
+    ) {
+        game_condition = apply_command(game, &command, NULL);
+    }
+    game->map.quiet = quiet;
+    if (game_condition == CONTINUE && replay->command < target) {
+        return EOF;
+    }
+    return game_condition;
+}
+
+/**
+ * Replays a log at full speed, without prompts or maps. The output is the
+ * same as the game played headless.
+ * 
+ * Parameters:
+ *     options - the command line options, naming the log
+ * Returns:
+ *     0 - if the log was replayed
+ *     1 - if not.
+ */
+int run_replay(struct options *options) {
+    struct replay *replay = open_replay(options->replay);
+    if (replay == NULL) {
+        fprintf(stderr, "Error: %s is not a replay log.\n", options->replay);
+        return 1;
+    }
+    struct game *game = allocate_game(replay->header.rows, 
+                                      replay->header.cols);
+    if (game == NULL) {
+        fprintf(stderr, "Error: Not enough memory for a %dx%d map.\n", 
+                replay->header.rows, replay->header.cols);
+        close_replay(replay);
+        return 1;
+    }
+    setvbuf(stdout, NULL, _IOFBF, HEADLESS_BUFFER_SIZE);
+
+    // When seeking, only the commands from the target on are shown.
+    game->map.quiet = options->seek > 0;
+    int game_condition = CONTINUE;
+    if (!start_replay(replay, game)) {
+        game_condition = EOF;
+    } else if (options->seek > 0) {
+        game_condition = seek_replay(replay, game, options->seek);
+    }
+    game->map.quiet = 0;
+    if (game_condition == EOF) {
+        fprintf(stderr, "Error: Could not replay %s.\n", options->replay);
+        free_game(game);
+        close_replay(replay);
+        return 1;
+    }
+
+    struct command command;
+    while (
+        game_condition == CONTINUE && next_record(replay, game, &command)
+    ) {
+        game_condition = show_command(game, &command);
+        if (game_condition == STOP) {
+            printf("Oh no, you ran out of lives!");
+        }
+    }
+    if (options->save != NULL && !save_game(game, options->save)) {
+        fprintf(stderr, "Error: Could not save the game to %s.\n",
+                options->save);
+    }
+    print_summary(game);
+    free_game(game);
+    close_replay(replay);
+    return game_over();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////  BATCH RUNNER  ///////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Plays a game from its text input, the same as typed into a headless game,
+ * until the input ends or the lives run out.
+ * 
+ * Parameters:
+ *     game - a new game to play
+ *     options - the command line options, which must be headless
+ *     input - the input to read the game from
+ * Returns:
+ *     1 - if the game was played
+ *     0 - if there is not enough memory
+ */
+int play_input(struct game *game, struct options *options, 
+               struct input *input) {
+    char *route = malloc((size_t)game->map.rows * game->map.cols + 1);
+    if (route == NULL) {
+        return 0;
+    }
+    struct log_header header;
+    scan_setup(game, options, input, NULL, route, &header);
+    free(route);
+    struct history *history = NULL;
+    if (options->undo) {
+        history = allocate_history(game);
+        if (history == NULL) {
+            return 0;
+        }
+    }
+
+    int game_condition = CONTINUE;
+    struct command command;
+    struct event event;
+    int scanned;
+    while (
+        game_condition == CONTINUE && 
+        (scanned = scan_command(input, &command)) != EOF
+    ) {
+        if (scanned && history != NULL) {
+            game_condition = apply_history(history, &command, &event);
+        } else if (scanned) {
+            game_condition = apply_command(game, &command, &event);
+        }
+    }
+    if (history != NULL) {
+        free_history(history);
+    }
+    return 1;
+}
+
+/**
+ * Plays a game from a replay log.
+ * 
+ * Parameters:
+ *     replay - the opened log
+ * Returns:
+ *     game - the finished game
+ *     NULL - if the log can't be replayed
+ */
+struct game *play_replay(struct replay *replay) {
+    struct game *game = allocate_game(replay->header.rows, 
+                                      replay->header.cols);
+    if (game == NULL) {
+        return NULL;
+    }
+    game->map.quiet = 1;
+    if (!start_replay(replay, game)) {
+        free_game(game);
+        return NULL;
+    }
+    int game_condition = CONTINUE;
+    struct command command;
+    while (
+        game_condition == CONTINUE && next_record(replay, game, &command)
+    ) {
+        game_condition = apply_command(game, &command, NULL);
+    }
+    return game;
+}
+
+/**
+ * Plays one scenario of a batch, quietly, and stores how it ended. A 
+ * scenario is either a replay log or the text input of a game.
+ * 
+ * Parameters:
+ *     name - file name of the scenario
+ *     options - the command line options, giving the size of text games
+ *     result - where to store how the game ended
+ * Returns:
+ *     nothing
+ */
+void run_scenario(const char *name, struct options *options, 
+                  struct batch_result *result) {
+    result->played = 0;
+    struct game *game = NULL;
+    struct replay *replay = open_replay(name);
+    if (replay != NULL) {
+        game = play_replay(replay);
+        close_replay(replay);
+    } else {
+        int fd = open(name, O_RDONLY);
+        struct input *input = fd < 0 ? NULL : open_input(fd);
+        if (input != NULL) {
+            game = allocate_game(options->rows, options->cols);
+        }
+        if (game != NULL) {
+            game->map.quiet = 1;
+            if (!play_input(game, options, input)) {
+                free_game(game);
+                game = NULL;
+            }
+        }
+        if (input != NULL) {
+            close_input(input);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    if (game == NULL) {
+        return;
+    }
+    result->played = 1;
+    result->lives = game->lives;
+    result->money = game->money;
+    result->kills = game->kills;
+    result->ticks = game->ticks;
+    result->enemies = game->path.total_enemies;
+    free_game(game);
+}
+
+/**
+ * Takes the next scenario for a worker. Workers start with an even share of
+ * the scenarios, and take them from the back of their own share. Once that 
+ * is empty they steal from the front of another worker's share, so the
+ * workers with quick games help out the ones with slow games.
+ * 
+ * Parameters:
+ *     batch - the batch being run
+ *     id - which worker is asking
+ * Returns:
+ *     job - index of the scenario to play
+ *     EOF - if there are none left
+ */
+int take_job(struct batch *batch, int id) {
+    struct share *own = &batch->shares[id];
+    pthread_mutex_lock(&own->lock);
+    int job = EOF;
+    if (own->front < own->back) {
+        own->back--;
+        job = own->back;
+    }
+    pthread_mutex_unlock(&own->lock);
+
+    int i = 1;
+    while (job == EOF && i < batch->n_workers) {
+        struct share *victim = &batch->shares[(id + i) % batch->n_workers];
+        pthread_mutex_lock(&victim->lock);
+        if (victim->front < victim->back) {
+            job = victim->front;
+            victim->front++;
+        }
+        pthread_mutex_unlock(&victim->lock);
+        i++;
+    }
+    return job;
+}
+
+/**
+ * Plays scenarios until there are none left in the batch.
+ * 
+ * Parameters:
+ *     data - the worker
+ * Returns:
+ *     NULL
+ */
+void *run_worker(void *data) {
+    struct worker *worker = data;
+    struct batch *batch = worker->batch;
+    int job = take_job(batch, worker->id);
+    while (job != EOF) {
+        run_scenario(batch->names[job], batch->options, 
+                     &batch->results[job]);
+        job = take_job(batch, worker->id);
+    }
+    return NULL;
+}
+
+/**
+ * Orders file names alphabetically, for `qsort`.
+ * 
+ * Parameters:
+ *     first - pointer to the first name
+ *     second - pointer to the second name
+ * Returns:
+ *     order - negative, zero or positive, as for `strcmp`
+ */
+int compare_names(const void *first, const void *second) {
+    return strcmp(*(char *const *)first, *(char *const *)second);
+}
+
+/**
+ * Lists the scenario files in a directory, in alphabetical order. Hidden 
+ * files and anything that isn't a regular file are left out.
+ * 
+ * Parameters:
+ *     directory - the directory to list
+ *     *n_names - where to store the number of files
+ * Returns:
+ *     names - the path of each file, to be freed by `free_names`
+ *     NULL - if the directory can't be read
+ */
+char **list_scenarios(const char *directory, int *n_names) {
+    DIR *dir = opendir(directory);
+    if (dir == NULL) {
+        return NULL;
+    }
+    char **names = NULL;
+    int capacity = 0;
+    *n_names = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        size_t length = strlen(directory) + strlen(entry->d_name) + 2;
+        char *name = malloc(length);
+        struct stat info;
+        if (name != NULL) {
+            snprintf(name, length, "%s/%s", directory, entry->d_name);
+        }
+        if (name == NULL || stat(name, &info) != 0 || !S_ISREG(info.st_mode)) {
+            free(name);
+            continue;
+        }
+        if (*n_names == capacity) {
+            capacity = capacity == 0 ? 64 : 2 * capacity;
+            char **more = realloc(names, capacity * sizeof *names);
+            if (more == NULL) {
+                free(name);
+                break;
+            }
+            names = more;
+        }
+        names[*n_names] = name;
+        (*n_names)++;
+    }
+    closedir(dir);
+    if (names == NULL) {
+        names = malloc(sizeof *names);
+    }
+    if (names != NULL) {
+        qsort(names, *n_names, sizeof *names, compare_names);
+    }
+    return names;
+}
+
+/**
+ * Frees a list of scenario names.
+ * 
+ * Parameters:
+ *     names - the names
+ *     n_names - number of names
+ * Returns:
+ *     nothing
+ */
+void free_names(char **names, int n_names) {
+    int i = 0;
+    while (i < n_names) {
+        free(names[i]);
+        i++;
+    }
+    free(names);
+}
+
+/**
+ * Prints how each scenario ended, then the totals and averages over all of
+ * the games that were played.
+ * 
+ * Parameters:
+ *     batch - the finished batch
+ * Returns:
+ *     nothing
+ */
+void print_batch_report(struct batch *batch) {
+    long long lives = 0;
+    long long money = 0;
+    long long kills = 0;
+    long long ticks = 0;
+    long long enemies = 0;
+    int played = 0;
+    int i = 0;
+    while (i < batch->n_jobs) {
+        struct batch_result *result = &batch->results[i];
+        if (result->played) {
+            printf("%s: Lives: %d Money: $%d Kills: %lld Ticks: %lld "
+                   "Enemies: %lld\n", batch->names[i], result->lives, 
+                   result->money, result->kills, result->ticks, 
+                   result->enemies);
+            lives += result->lives;
+            money += result->money;
+            kills += result->kills;
+            ticks += result->ticks;
+            enemies += result->enemies;
+            played++;
+        } else {
+            printf("%s: Error: Could not be played.\n", batch->names[i]);
+        }
+        i++;
+    }
+    printf("\nGames: %d Failed: %d\n", played, batch->n_jobs - played);
+    printf("Total Lives: %lld Money: $%lld Kills: %lld Ticks: %lld "
+           "Enemies: %lld\n", lives, money, kills, ticks, enemies);
+    if (played > 0) {
+        printf("Average Lives: %.2f Money: $%.2f Kills: %.2f Ticks: %.2f "
+               "Enemies: %.2f\n", (double)lives / played, 
+               (double)money / played, (double)kills / played, 
+               (double)ticks / played, (double)enemies / played);
+    }
+}
+
+/**
+ * Plays every scenario in a directory across a pool of threads, then 
+ * prints one report for all of them.
+ * 
+ * Parameters:
+ *     options - the command line options, naming the directory
+ * Returns:
+ *     0 - if the batch was run
+ *     1 - if not.
+ */
+int run_batch(struct options *options) {
+    struct batch batch;
+    batch.options = options;
+    batch.names = list_scenarios(options->batch, &batch.n_jobs);
+    if (batch.names == NULL) {
+        fprintf(stderr, "Error: Could not read the scenarios in %s.\n", 
+                options->batch);
+        return 1;
+    }
+    batch.n_workers = options->threads;
+    if (batch.n_workers > batch.n_jobs) {
+        batch.n_workers = batch.n_jobs > 0 ? batch.n_jobs : 1;
+    }
+    batch.results = calloc(batch.n_jobs + 1, sizeof *batch.results);
+    batch.shares = malloc(batch.n_workers * sizeof *batch.shares);
+    struct worker *workers = malloc(batch.n_workers * sizeof *workers);
+    if (batch.results == NULL || batch.shares == NULL || workers == NULL) {
+        fprintf(stderr, "Error: Not enough memory for %d scenarios.\n", 
+                batch.n_jobs);
+        free(batch.results);
+        free(batch.shares);
+        free(workers);
+        free_names(batch.names, batch.n_jobs);
+        return 1;
+    }
+    // Text scenarios are played without prompts or maps.
+    options->headless = 1;
+
+    int id = 0;
+    while (id < batch.n_workers) {
+        struct share *share = &batch.shares[id];
+        pthread_mutex_init(&share->lock, NULL);
+        share->front = (int)((long long)batch.n_jobs * id / batch.n_workers);
+        share->back = (int)((long long)batch.n_jobs * (id + 1) / 
+                            batch.n_workers);
+        id++;
+    }
+    // The main thread is worker 0.
+    id = 0;
+    while (id < batch.n_workers) {
+        workers[id].batch = &batch;
+        workers[id].id = id;
+        if (
+            id > 0 && 
+            pthread_create(&workers[id].thread, NULL, run_worker, 
+                           &workers[id]) != 0
+        ) {
+            // Its share gets stolen by the others.
+            workers[id].id = EOF;
+        }
+        id++;
+    }
+    run_worker(&workers[0]);
+    id = 1;
+    while (id < batch.n_workers) {
+        if (workers[id].id != EOF) {
+            pthread_join(workers[id].thread, NULL);
+        }
+        id++;
+    }
+
+    print_batch_report(&batch);
+    id = 0;
+    while (id < batch.n_workers) {
+        pthread_mutex_destroy(&batch.shares[id].lock);
+        id++;
+    }
+    free(batch.results);
+    free(batch.shares);
+    free(workers);
+    free_names(batch.names, batch.n_jobs);
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////  LANES  //////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Sets up `LANES` copies of a game to be played side by side. The map and
+ * path are shared with the game rather than copied, so the game must not
+ * change while the lanes are in use.
+ * 
+ * Parameters:
+ *     game - the game every lane starts as
+ * Returns:
+ *     lanes - the new lanes
+ *     NULL - if there is not enough memory
+ */
+struct lanes *allocate_lanes(struct game *game) {
+    struct map *map = &game->map;
+    struct path *path = &game->path;
+    struct lanes *lanes = malloc(sizeof *lanes);
+    if (lanes == NULL) {
+        return NULL;
+    }
+    lanes->game = game;
+    lanes->enemies = malloc((size_t)path->capacity * LANES *
+                            sizeof *lanes->enemies);
+    lanes->damage = calloc((size_t)(path->length + 1) * LANES,
+                           sizeof *lanes->damage);
+    lanes->damaged = malloc((path->length + 1) * sizeof *lanes->damaged);
+    lanes->is_damaged = calloc(path->length + 1, sizeof *lanes->is_damaged);
+    lanes->changed = malloc(path->capacity * sizeof *lanes->changed);
+    lanes->is_changed = calloc(path->capacity, sizeof *lanes->is_changed);
+    if (
+        lanes->enemies == NULL || lanes->damage == NULL ||
+        lanes->damaged == NULL || lanes->is_damaged == NULL ||
+        lanes->changed == NULL || lanes->is_changed == NULL
+    ) {
+        free_lanes(lanes);
+        return NULL;
+    }
+
+    // Every lane starts with the game's enemies.
+    int slot = 0;
+    while (slot < path->capacity) {
+        int lane = 0;
+        while (lane < LANES) {
+            lanes->enemies[slot * LANES + lane] = path->enemies[slot];
+            lane++;
+        }
+        slot++;
+    }
+    lanes->n_changed = 0;
+
+    // The positions the map's towers reach are always on the list.
+    lanes->n_damaged = 0;
+    int i = 0;
+    while (i < path->length) {
+        if (map->damage[path->base + i] > 0) {
+            lanes->damaged[lanes->n_damaged] = i;
+            lanes->is_damaged[i] = 1;
+            lanes->n_damaged++;
+        }
+        i++;
+    }
+    lanes->n_shared = lanes->n_damaged;
+    reset_lanes(lanes);
+    return lanes;
+}
+
+/**
+ * Frees lanes, leaving the game they were copied from.
+ * 
+ * Parameters:
+ *     lanes - the lanes to free
+ * Returns:
+ *     nothing
+ */
+void free_lanes(struct lanes *lanes) {
+    free(lanes->enemies);
+    free(lanes->damage);
+    free(lanes->damaged);
+    free(lanes->is_damaged);
+    free(lanes->changed);
+    free(lanes->is_changed);
+    free(lanes);
+}
+
+/**
+ * Puts every lane back to the state of the game, undoing any towers,
+ * enemies, moves and attacks since the last reset. Only the enemy counts
+ * that changed and the positions on the damaged list are put back.
+ * 
+ * Parameters:
+ *     lanes - the lanes to reset
+ * Returns:
+ *     nothing
+ */
+void reset_lanes(struct lanes *lanes) {
+    struct game *game = lanes->game;
+    struct map *map = &game->map;
+    struct path *path = &game->path;
+    while (lanes->n_changed > 0) {
+        lanes->n_changed--;
+        int slot = lanes->changed[lanes->n_changed];
+        int lane = 0;
+        while (lane < LANES) {
+            lanes->enemies[slot * LANES + lane] = path->enemies[slot];
+            lane++;
+        }
+        lanes->is_changed[slot] = 0;
+    }
+
+    // The positions the map's towers reach go back to the map's damage, and
+    // the ones only the lanes' own towers reached come off the list.
+    int i = 0;
+    while (i < lanes->n_damaged) {
+        int position = lanes->damaged[i];
+        int damage = 0;
+        if (i < lanes->n_shared) {
+            damage = map->damage[path->base + position];
+        } else {
+            lanes->is_damaged[position] = 0;
+        }
+        int lane = 0;
+        while (lane < LANES) {
+            lanes->damage[position * LANES + lane] = damage;
+            lane++;
+        }
+        i++;
+    }
+    lanes->n_damaged = lanes->n_shared;
+
+    lanes->head = path->head;
+    int lane = 0;
+    while (lane < LANES) {
+        lanes->kills[lane] = 0;
+        lanes->total_enemies[lane] = path->total_enemies;
+        lanes->money[lane] = game->money;
+        lanes->lives[lane] = game->lives;
+        lanes->over[lane] = game->lives <= OUT_OF_LIVES;
+        lane++;
+    }
+}
+
+/**
+ * Finds the enemy counts of every lane at a position along the path, and
+ * marks them as changed so the next reset puts them back.
+ * 
+ * Parameters:
+ *     lanes - the lanes
+ *     position - position along the path, from 0 (start) to length (end)
+ * Returns:
+ *     enemies - pointer to the `LANES` counts at that position
+ */
+int *lane_enemies(struct lanes *lanes, int position) {
+    int capacity = lanes->game->path.capacity;
+    int slot = lanes->head + position;
+    if (slot >= capacity) {
+        slot -= capacity;
+    }
+    if (!lanes->is_changed[slot]) {
+        lanes->is_changed[slot] = 1;
+        lanes->changed[lanes->n_changed] = slot;
+        lanes->n_changed++;
+    }
+    return &lanes->enemies[slot * LANES];
+}
+
+/**
+ * Changes the tower on a tile in one lane only, from whatever the map has
+ * there to `entity`, by adding the difference in damage to the path
+ * positions in range. Like `change_tower`, it doesn't check the land or take
+ * any money.
+ * 
+ * Parameters:
+ *     lanes - the lanes
+ *     lane - the lane to change
+ *     row - tile row
+ *     col - tile col
+ *     entity - the new entity on the tile
+ * Returns:
+ *     nothing
+ */
+void lanes_change_tower(struct lanes *lanes, int lane, int row, int col,
+                        int entity) {
+    struct map *map = &lanes->game->map;
+    struct path *path = &lanes->game->path;
+    struct tower_data old = 
+        tower_stats(tile_entity(map, tile_index(map, row, col)));
+    struct tower_data new = tower_stats(entity);
+    int range = old.range > new.range ? old.range : new.range;
+    int near_row = row - range;
+    while (near_row <= row + range) {
+        int near_col = col - range;
+        while (near_col <= col + range) {
+            int distance = abs(near_row - row) > abs(near_col - col) ?
+                           abs(near_row - row) : abs(near_col - col);
+            int change = (distance <= new.range ? new.power : 0) -
+                         (distance <= old.range ? old.power : 0);
+            int position = path_position(map, path, near_row, near_col);
+            if (
+                change != 0 && position != NOT_PATH &&
+                position < path->length
+            ) {
+                if (!lanes->is_damaged[position]) {
+                    lanes->damaged[lanes->n_damaged] = position;
+                    lanes->is_damaged[position] = 1;
+                    lanes->n_damaged++;
+                }
+                lanes->damage[position * LANES + lane] += change;
+            }
+            near_col++;
+        }
+        near_row++;
+    }
+}
+
+/**
+ * Attacks `repeat` times in every lane at once, like `attack_total`. Each 
+ * damaged position's counts are capped at the damage of the lane's towers,
+ * `LANES` at a time. Lanes that are over still take the damage, but it 
+ * doesn't count towards their kills or money.
+ * 
+ * Parameters:
+ *     lanes - the lanes
+ *     repeat - number of attacks
+ * Returns:
+ *     nothing
+ */
+void lanes_attack(struct lanes *lanes, int repeat) {
+    long long destroyed[LANES] = {0};
+    if (repeat <= 0) {
+        return;
+    }
+    // Damage that would overflow an int is more than any count of enemies.
+    int limit = INT_MAX / repeat;
+    int i = 0;
+    while (i < lanes->n_damaged) {
+        int position = lanes->damaged[i];
+        int *enemies = lane_enemies(lanes, position);
+        int *damage = &lanes->damage[position * LANES];
+        // Works out every lane's losses before changing any of them, so
+        // the compiler can do all of the lanes at once.
+        int taken[LANES];
+        int lane = 0;
+        while (lane < LANES) {
+            int total_damage = damage[lane] > limit ? 
+                               INT_MAX : repeat * damage[lane];
+            taken[lane] = total_damage < enemies[lane] ? 
+                          total_damage : enemies[lane];
+            lane++;
+        }
+        lane = 0;
+        while (lane < LANES) {
+            enemies[lane] -= taken[lane];
+            destroyed[lane] += taken[lane];
+            lane++;
+        }
+        i++;
+    }
+
+    int lane = 0;
+    while (lane < LANES) {
+        lanes->total_enemies[lane] -= destroyed[lane];
+        if (!lanes->over[lane]) {
+            lanes->kills[lane] += destroyed[lane];
+            lanes->money[lane] = clamp_int(lanes->money[lane] + 
+                                           destroyed[lane] * MONEY_EARNED);
+        }
+        lane++;
+    }
+}
+
+/**
+ * Moves the enemies of every lane `repeat` tiles at once, like
+ * `move_enemies`, taking the lives of each lane's enemies that reach the
+ * end. A lane is over once it runs out of lives.
+ * 
+ * Parameters:
+ *     lanes - the lanes
+ *     repeat - number of tiles to move
+ * Returns:
+ *     nothing
+ */
+void lanes_move(struct lanes *lanes, int repeat) {
+    struct path *path = &lanes->game->path;
+    if (repeat <= 0) {
+        return;
+    }
+    // Enemies this close to the end tile will reach it.
+    long long lives_lost[LANES] = {0};
+    int i = path->length - repeat < 0 ? 0 : path->length - repeat;
+    while (i < path->length) {
+        int *enemies = lane_enemies(lanes, i);
+        int lane = 0;
+        while (lane < LANES) {
+            lives_lost[lane] += enemies[lane];
+            lane++;
+        }
+        i++;
+    }
+
+    // Moves every enemy forward, then empties the positions they left
+    // behind and the end tile.
+    lanes->head = (int)((lanes->head - (long long)repeat % path->capacity +
+                         path->capacity) % path->capacity);
+    int cleared = repeat < path->length + 1 ? repeat : path->length + 1;
+    i = 0;
+    while (i <= cleared) {
+        int *enemies = lane_enemies(lanes, i < cleared ? i : path->length);
+        memset(enemies, 0, LANES * sizeof *enemies);
+        i++;
+    }
+
+    int lane = 0;
+    while (lane < LANES) {
+        lanes->total_enemies[lane] -= lives_lost[lane];
+        if (!lanes->over[lane]) {
+            lanes->lives[lane] = clamp_int(lanes->lives[lane] - 
+                                           lives_lost[lane]);
+            lanes->over[lane] = lanes->lives[lane] <= OUT_OF_LIVES;
+        }
+        lane++;
+    }
+}
+
+/**
+ * Checks if any lane can still change, which is while it has lives left and
+ * enemies on the path.
+ * 
+ * Parameters:
+ *     lanes - the lanes
+ * Returns:
+ *     1 - if some lane is still running
+ *     0 - if not.
+ */
+int lanes_running(struct lanes *lanes) {
+    int running = 0;
+    int lane = 0;
+    while (lane < LANES) {
+        running |= !lanes->over[lane] && lanes->total_enemies[lane] > 0;
+        lane++;
+    }
+    return running;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+///////////////////////////////  OPTIMIZER  ////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Checks if a tower of the given type at a tile would reach the path.
+ * 
+ * Parameters:
+ *     map - map of the tiles
+ *     row - tile row
+ *     col - tile col
+ *     entity - the tower type
+ * Returns:
+ *     1 - if some path tile is in range
+ *     0 - if not.
+ */
+int reaches_path(struct map *map, int row, int col, int entity) {
+    int range = tower_stats(entity).range;
+    int near_row = row - range;
+    while (near_row <= row + range) {
+        int near_col = col - range;
+        while (near_col <= col + range) {
+            if (
+                test_point(map, near_row, near_col) &&
+                map->path_index[tile_index(map, near_row, near_col)] != 
+                NOT_PATH
+            ) {
+                return 1;
+            }
+            near_col++;
+        }
+        near_row++;
+    }
+    return 0;
+}
+
+/**
+ * Lists every tower that could be built or upgraded with the money there is,
+ * leaving out any that wouldn't reach the path.
+ * 
+ * Parameters:
+ *     game - the game to optimize
+ *     *n_placements - where to store the number of placements
+ * Returns:
+ *     placements - the placements, not yet tried
+ *     NULL - if there is not enough memory
+ */
+struct placement *list_placements(struct game *game, int *n_placements) {
+    struct map *map = &game->map;
+    *n_placements = 0;
+    int capacity = 64;
+    struct placement *placements = malloc(capacity * sizeof *placements);
+    int row = 0;
+    while (placements != NULL && row < map->rows) {
+        int col = 0;
+        while (placements != NULL && col < map->cols) {
+            int index = tile_index(map, row, col);
+            int entity = tile_entity(map, index);
+            int upgrade = EMPTY;
+            if (test_free_grass(map, index)) {
+                upgrade = BASIC_TOWER;
+            } else if (entity == BASIC_TOWER || entity == POWER_TOWER) {
+                upgrade = entity + 1;
+            }
+            int cost = tower_stats(upgrade).cost;
+            if (
+                upgrade != EMPTY && game->money >= cost &&
+                reaches_path(map, row, col, upgrade)
+            ) {
+                if (*n_placements == capacity) {
+                    capacity *= 2;
+                    struct placement *more = 
+                        realloc(placements, capacity * sizeof *placements);
+                    if (more == NULL) {
+                        free(placements);
+                    }
+                    placements = more;
+                }
+                if (placements != NULL) {
+                    struct placement *placement = &placements[*n_placements];
+                    placement->row = row;
+                    placement->col = col;
+                    placement->entity = upgrade;
+                    placement->cost = cost;
+                    (*n_placements)++;
+                }
+            }
+            col++;
+        }
+        row++;
+    }
+    return placements;
+}
+
+/**
+ * Tries up to `LANES` towers side by side for `horizon` turns, each the same
+ * as the commands `a 1` then `m 1`, and stores the enemies each one destroys
+ * and the lives left. The lanes are reset afterwards.
+ * 
+ * Parameters:
+ *     lanes - the lanes to try them on
+ *     placements - the towers to try, where an EMPTY entity tries nothing
+ *     n_placements - number of towers, at most `LANES`
+ *     horizon - number of turns
+ * Returns:
+ *     nothing
+ */
+void try_placements(struct lanes *lanes, struct placement *placements, 
+                    int n_placements, int horizon) {
+    int lane = 0;
+    while (lane < n_placements) {
+        struct placement *placement = &placements[lane];
+        if (placement->entity != EMPTY) {
+            lanes_change_tower(lanes, lane, placement->row, placement->col,
+                               placement->entity);
+            lanes->money[lane] -= placement->cost;
+        }
+        lane++;
+    }
+
+    int turn = 0;
+    while (turn < horizon && lanes_running(lanes)) {
+        lanes_attack(lanes, 1);
+        lanes_move(lanes, 1);
+        turn++;
+    }
+
+    lane = 0;
+    while (lane < n_placements) {
+        placements[lane].kills = lanes->kills[lane];
+        placements[lane].lives = lanes->lives[lane];
+        lane++;
+    }
+    reset_lanes(lanes);
+}
+
+/**
+ * Tries placements until there are none left. Each thread takes the next
+ * `OPTIMIZE_CHUNK` untried placements at a time, and tries them `LANES` at a
+ * time.
+ * 
+ * Parameters:
+ *     data - the optimizer worker
+ * Returns:
+ *     NULL
+ */
+void *run_optimizer(void *data) {
+    struct optimizer_worker *worker = data;
+    struct optimizer *optimizer = worker->optimizer;
+    int first = __atomic_fetch_add(&optimizer->next, OPTIMIZE_CHUNK, 
+                                   __ATOMIC_RELAXED);
+    while (first < optimizer->n_placements) {
+        int last = first + OPTIMIZE_CHUNK < optimizer->n_placements ? 
+                   first + OPTIMIZE_CHUNK : optimizer->n_placements;
+        int i = first;
+        while (i < last) {
+            int n = last - i < LANES ? last - i : LANES;
+            try_placements(worker->lanes, &optimizer->placements[i], n, 
+                           optimizer->horizon);
+            i += n;
+        }
+        first = __atomic_fetch_add(&optimizer->next, OPTIMIZE_CHUNK, 
+                                   __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+/**
+ * Orders placements from best to worst, for `qsort`: most kills first, then
+ * most lives left, then cheapest, then by position.
+ * 
+ * Parameters:
+ *     first - the first placement
+ *     second - the second placement
+ * Returns:
+ *     order - negative if `first` is better, positive if `second` is
+ */
+int compare_placements(const void *first, const void *second) {
+    const struct placement *a = first;
+    const struct placement *b = second;
+    if (a->kills != b->kills) {
+        return a->kills > b->kills ? -1 : 1;
+    } else if (a->lives != b->lives) {
+        return a->lives > b->lives ? -1 : 1;
+    } else if (a->cost != b->cost) {
+        return a->cost < b->cost ? -1 : 1;
+    } else if (a->row != b->row) {
+        return a->row < b->row ? -1 : 1;
+    }
+    return (a->col > b->col) - (a->col < b->col);
+}
+
+/**
+ * Finds the best places to build or upgrade a tower. Every tower that could 
+ * be afforded is tried for `horizon` turns of attacking then moving, spread 
+ * across a thread per core, each with its own lanes of the game. The best are 
+ * printed, with the enemies each destroys and the lives it saves compared
+ * to doing nothing.
+ * 
+ * Parameters:
+ *     game - the game to optimize
+ *     horizon - number of turns to look ahead
+ * Returns:
+ *     nothing
+ */
+void optimize_towers(struct game *game, int horizon) {
+    struct map *map = &game->map;
+    // Nobody would see the results.
+    if (map->quiet) {
+        return;
+    }
+    // The lanes only model enemies moving along the main path.
+    if (game->path.n_branches > 0) {
+        print_message(map, "Error: Towers can't be suggested for a path "
+                      "with branches.\n");
+        return;
+    }
+    struct optimizer optimizer;
+    optimizer.game = game;
+    optimizer.horizon = horizon;
+    optimizer.next = 0;
+    optimizer.placements = list_placements(game, &optimizer.n_placements);
+    if (optimizer.placements == NULL) {
+        print_message(map, "Error: Not enough memory to optimize.\n");
+        return;
+    }
+    if (optimizer.n_placements == 0) {
+        print_message(map, "No tower can be built or upgraded in range of "
+                      "the path.\n");
+        free(optimizer.placements);
+        return;
+    }
+
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int n_workers = threads > 0 ? threads : 1;
+    if (n_workers > optimizer.n_placements / OPTIMIZE_CHUNK + 1) {
+        n_workers = optimizer.n_placements / OPTIMIZE_CHUNK + 1;
+    }
+    struct optimizer_worker *workers = calloc(n_workers, sizeof *workers);
+    int started = 0;
+    while (workers != NULL && started < n_workers) {
+        struct optimizer_worker *worker = &workers[started];
+        worker->optimizer = &optimizer;
+        worker->lanes = allocate_lanes(game);
+        if (worker->lanes == NULL) {
+            break;
+        }
+        // The calling thread is worker 0.
+        if (
+            started > 0 && 
+            pthread_create(&worker->thread, NULL, run_optimizer, worker) != 0
+        ) {
+            free_lanes(worker->lanes);
+            break;
+        }
+        started++;
+    }
+    if (started == 0) {
+        print_message(map, "Error: Not enough memory to optimize.\n");
+        free(workers);
+        free(optimizer.placements);
+        return;
+    }
+
+    // Doing nothing is what each placement is measured against.
+    struct placement nothing = {.entity = EMPTY};
+    try_placements(workers[0].lanes, &nothing, 1, horizon);
+    run_optimizer(&workers[0]);
+    int i = 0;
+    while (i < started) {
+        if (i > 0) {
+            pthread_join(workers[i].thread, NULL);
+        }
+        free_lanes(workers[i].lanes);
+        i++;
+    }
+    free(workers);
+
+    qsort(optimizer.placements, optimizer.n_placements, 
+          sizeof *optimizer.placements, compare_placements);
+    print_message(map, "Best towers over %d turns (doing nothing destroys "
+                  "%lld enemies and leaves %d lives):\n", horizon, 
+                  nothing.kills, nothing.lives);
+    i = 0;
+    while (i < optimizer.n_placements && i < OPTIMIZE_RESULTS) {
+        struct placement *placement = &optimizer.placements[i];
+        print_message(map, "%d. %s at (%d, %d) for $%d: %lld enemies "
+                      "destroyed, %d lives saved\n", i + 1, 
+                      placement->entity == BASIC_TOWER ? "Tower" : "Upgrade",
+                      placement->row, placement->col, placement->cost, 
+                      placement->kills, placement->lives - nothing.lives);
+        i++;
+    }
+    free(optimizer.placements);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+///////////////////////////////  BENCHMARK  ////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Steps a random number generator (splitmix64). The same seed always gives
+ * the same numbers on every machine, so a benchmark seed always generates
+ * the same scenario.
+ * 
+ * Parameters:
+ *     state - the generator's state
+ * Returns:
+ *     number - the next random number
+ */
+uint64_t next_random(uint64_t *state) {
+    *state += 0x9E3779B97F4A7C15ULL;
+    uint64_t number = *state;
+    number = (number ^ (number >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    number = (number ^ (number >> 27)) * 0x94D049BB133111EBULL;
+    return number ^ (number >> 31);
+}
+
+/**
+ * Picks a random number from 0 up to, but not including, `n`.
+ * 
+ * Parameters:
+ *     state - the generator's state
+ *     n - how many numbers to pick from
+ * Returns:
+ *     number - the random number
+ */
+int random_below(uint64_t *state, int n) {
+    return (int)(next_random(state) % (uint64_t)n);
+}
+
+/**
+ * Generates the setup of a benchmark game: a path that winds back and forth
+ * across every other row from the top left corner, turning at random
+ * columns on alternate sides of the map, and a small lake somewhere. Lives
+ * and money are high enough that nothing runs out during the benchmark.
+ * 
+ * Parameters:
+ *     header - where to store the setup
+ *     route - where to store the path directions
+ *     rows - number of map rows, at least 2
+ *     cols - number of map columns, at least 2
+ *     state - the generator's state
+ * Returns:
+ *     nothing
+ */
+void generate_setup(struct log_header *header, char *route, int rows,
+                    int cols, uint64_t *state) {
+    int row = 0;
+    int col = 0;
+    int length = 0;
+    int heading = RIGHT;
+    while (1) {
+        // Runs to the far half of the map, then turns back on the next row
+        // but one, so the rows in between are left for towers.
+        int target = heading == RIGHT ?
+                     cols / 2 + random_below(state, cols - cols / 2) :
+                     random_below(state, cols / 2);
+        while (col != target) {
+            route[length] = heading;
+            length++;
+            col += heading == RIGHT ? 1 : -1;
+        }
+        if (row + 2 >= rows) {
+            break;
+        }
+        route[length] = DOWN;
+        route[length + 1] = DOWN;
+        length += 2;
+        row += 2;
+        heading = heading == RIGHT ? LEFT : RIGHT;
+    }
+
+    *header = (struct log_header){
+        .magic = LOG_MAGIC,
+        .version = LOG_VERSION,
+        .rows = rows,
+        .cols = cols,
+        .lives = INT_MAX / 2,
+        .money = INT_MAX / 2,
+        .start = {0, 0},
+        .end = {row, col},
+        .enemies = 0,
+        .lake = {random_below(state, rows), random_below(state, cols),
+                 1 + random_below(state, 4), 1 + random_below(state, 4)},
+        .route_length = length
+    };
+}
+
+/**
+ * Fills most of the grass next to the path with towers, upgrading some of
+ * them at random.
+ * 
+ * Parameters:
+ *     game - the benchmark game, already set up
+ *     state - the generator's state
+ * Returns:
+ *     towers - the number of towers built
+ */
+int generate_towers(struct game *game, uint64_t *state) {
+    struct map *map = &game->map;
+    int towers = 0;
+    int row = 0;
+    while (row < map->rows) {
+        int col = 0;
+        while (col < map->cols) {
+            int index = tile_index(map, row, col);
+            if (
+                test_free_grass(map, index) &&
+                reaches_path(map, row, col, BASIC_TOWER) &&
+                random_below(state, 4) != 0
+            ) {
+                struct command command = {TOWER, {row, col}};
+                apply_command(game, &command, NULL);
+                int upgrades = random_below(state, 3);
+                command.type = UPGRADE;
+                while (upgrades > 0) {
+                    apply_command(game, &command, NULL);
+                    upgrades--;
+                }
+                towers++;
+            }
+            col++;
+        }
+        row++;
+    }
+    return towers;
+}
+
+/**
+ * Puts `BENCH_ENEMIES` enemies on every tile of the path, so there is always
+ * something to move and attack.
+ * 
+ * Parameters:
+ *     game - the benchmark game
+ * Returns:
+ *     nothing
+ */
+void generate_enemies(struct game *game) {
+    struct path *path = &game->path;
+    int i = 0;
+    while (i < path->length) {
+        *path_enemies(path, i) += BENCH_ENEMIES;
+        path->total_enemies += BENCH_ENEMIES;
+        i++;
+    }
+}
+
+/**
+ * Generates a random command of one type for the benchmark. Rain falls on
+ * a random grid, and teleporters join two random tiles of the path.
+ * 
+ * Parameters:
+ *     game - the benchmark scenario
+ *     type - the type of command
+ *     state - the generator's state
+ *     command - where to store the command
+ * Returns:
+ *     nothing
+ */
+void generate_command(struct game *game, char type, uint64_t *state,
+                      struct command *command) {
+    struct path *path = &game->path;
+    *command = (struct command){type, {1, 0, 0, 0}};
+    if (type == RAIN) {
+        int *args = command->args;
+        args[0] = 2 + random_below(state, 5);
+        args[1] = 2 + random_below(state, 5);
+        args[2] = random_below(state, args[0]);
+        args[3] = random_below(state, args[1]);
+    } else if (type == TELEPORT) {
+        struct coord_data first =
+            path->tiles[random_below(state, path->length)];
+        struct coord_data second =
+            path->tiles[random_below(state, path->length)];
+        *command = (struct command){
+            type, {first.row, first.col, second.row, second.col}
+        };
+    }
+}
+
+/**
+ * Reads a clock that only ever goes forward.
+ * 
+ * Parameters:
+ *     nothing
+ * Returns:
+ *     time - the time in nanoseconds, from some fixed point
+ */
+long long clock_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/**
+ * Finds the most memory the program has used at once so far.
+ * 
+ * Parameters:
+ *     nothing
+ * Returns:
+ *     size - the high-water mark of the resident set, in kilobytes
+ */
+long max_rss_kb(void) {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+    return usage.ru_maxrss;
+}
+
+/**
+ * Times `BENCH_OPS` commands of one type on the benchmark scenario. Putting
+ * the scenario back every `restore` ops isn't timed.
+ * 
+ * Parameters:
+ *     game - the game to play them on
+ *     scenario - the scenario to start from
+ *     bench_case - what to time
+ *     commands - the `BENCH_OPS` commands to time
+ *     frame - the frame to draw the map into
+ * Returns:
+ *     time - total time taken by the commands, in nanoseconds
+ */
+long long time_bench_case(struct game *game, struct game *scenario,
+                          const struct bench_case *bench_case,
+                          struct command *commands, struct frame *frame) {
+    long long elapsed = 0;
+    int i = 0;
+    while (i < BENCH_OPS) {
+        copy_game(game, scenario);
+        int last = i + bench_case->restore < BENCH_OPS ?
+                   i + bench_case->restore : BENCH_OPS;
+        long long start = clock_ns();
+        while (i < last) {
+            if (bench_case->type == DRAW) {
+                print_map(&game->map, &game->path, game->lives, game->money,
+                          frame);
+            } else {
+                apply_command(game, &commands[i], NULL);
+            }
+            i++;
+        }
+        elapsed += clock_ns() - start;
+    }
+    return elapsed;
+}
+
+/**
+ * Times each command on a scenario generated from the seed: a long winding
+ * path through a field of towers, with enemies on every tile. Floods are
+ * timed after a heavy rain. Prints the
+ * nanoseconds each command takes and the memory high-water mark after it,
+ * as JSON, so runs of different versions can be compared.
+ * 
+ * Parameters:
+ *     options - the command line options, with the seed and map size
+ * Returns:
+ *     0 - if the benchmark ran
+ *     1 - if not.
+ */
+int run_bench(struct options *options) {
+    static const struct bench_case cases[] = {
+        {"move_enemies", MOVE, BENCH_OPS, 0},
+        {"attack_total", ATTACK, BENCH_OPS, 0},
+        {"create_flood", FLOOD, 1, 1},
+        {"create_rain", RAIN, 8, 0},
+        {"create_teleporter", TELEPORT, 1, 0},
+        {"print_map", DRAW, BENCH_OPS, 0}
+    };
+    int n_cases = sizeof cases / sizeof cases[0];
+    int rows = options->rows;
+    int cols = options->cols;
+    if (rows < 2 || cols < 2) {
+        fprintf(stderr, "Error: A benchmark needs at least a 2x2 map.\n");
+        return 1;
+    }
+    struct game *scenario = allocate_game(rows, cols);
+    struct game *wet = allocate_game(rows, cols);
+    struct game *game = allocate_game(rows, cols);
+    char *route = malloc((size_t)rows * cols + 1);
+    struct command *commands = malloc(BENCH_OPS * sizeof *commands);
+    struct frame *frame = allocate_frame(rows, cols);
+    int null_output = open("/dev/null", O_WRONLY);
+    int output = dup(STDOUT_FILENO);
+    if (
+        scenario == NULL || wet == NULL || game == NULL || route == NULL ||
+        commands == NULL || frame == NULL || null_output < 0 || output < 0
+    ) {
+        fprintf(stderr, "Error: Could not set up a benchmark on a %dx%d "
+                "map.\n", rows, cols);
+        if (scenario != NULL) {
+            free_game(scenario);
+        }
+        if (wet != NULL) {
+            free_game(wet);
+        }
+        if (game != NULL) {
+            free_game(game);
+        }
+        free(route);
+        free(commands);
+        if (frame != NULL) {
+            free_frame(frame);
+        }
+        if (null_output >= 0) {
+            close(null_output);
+        }
+        if (output >= 0) {
+            close(output);
+        }
+        return 1;
+    }
+
+    // Only the timings are printed.
+    scenario->map.quiet = 1;
+    wet->map.quiet = 1;
+    game->map.quiet = 1;
+    uint64_t state = options->seed;
+    struct log_header header;
+    generate_setup(&header, route, rows, cols, &state);
+    apply_setup(scenario, &header, route);
+    int towers = generate_towers(scenario, &state);
+    generate_enemies(scenario);
+    struct command rain;
+    generate_command(scenario, RAIN, &state, &rain);
+    copy_game(wet, scenario);
+    apply_command(wet, &rain, NULL);
+
+    printf("{\n  \"seed\": %lld,\n  \"rows\": %d,\n  \"cols\": %d,\n"
+           "  \"path_length\": %d,\n  \"towers\": %d,\n  \"ops\": %d,\n"
+           "  \"game_bytes\": %zu,\n  \"commands\": [\n", options->seed,
+           rows, cols, scenario->path.length, towers, BENCH_OPS,
+           scenario->size);
+    int i = 0;
+    while (i < n_cases) {
+        const struct bench_case *bench_case = &cases[i];
+        int op = 0;
+        while (op < BENCH_OPS) {
+            generate_command(scenario, bench_case->type, &state,
+                             &commands[op]);
+            op++;
+        }
+        // The maps are drawn to /dev/null, so only drawing them is timed.
+        fflush(stdout);
+        dup2(null_output, STDOUT_FILENO);
+        long long elapsed = time_bench_case(
+            game, bench_case->wet ? wet : scenario, bench_case, commands, 
+            frame);
+        fflush(stdout);
+        dup2(output, STDOUT_FILENO);
+        printf("    {\"name\": \"%s\", \"ns_per_op\": %.1f, "
+               "\"max_rss_kb\": %ld}%s\n", bench_case->name,
+               (double)elapsed / BENCH_OPS, max_rss_kb(),
+               i + 1 < n_cases ? "," : "");
+        i++;
+    }
+    printf("  ],\n  \"max_rss_kb\": %ld\n}\n", max_rss_kb());
+
+    free_game(scenario);
+    free_game(wet);
+    free_game(game);
+    free(route);
+    free(commands);
+    free_frame(frame);
+    close(null_output);
+    close(output);
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////  WAVES  //////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Reads the waves of enemies to spawn from a file of `tick count` pairs,
+ * in any order, and puts them in a timing wheel starting at a tick. Waves 
+ * due before that tick are left out.
+ * 
+ * Parameters:
+ *     name - file name to read from
+ *     start - the tick the game is at
+ * Returns:
+ *     waves - the waves waiting to spawn
+ *     NULL - if the file can't be read, or has a negative tick or a count
+ *            that isn't positive.
+ */
+struct waves *load_waves(const char *name, long long start) {
+    int fd = open(name, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct input *input = open_input(fd);
+    struct waves *waves = malloc(sizeof *waves);
+    if (input == NULL || waves == NULL) {
+        if (input != NULL) {
+            close_input(input);
+        }
+        free(waves);
+        close(fd);
+        return NULL;
+    }
+    waves->events = NULL;
+    waves->n_events = 0;
+    waves->pending = 0;
+    waves->now = start;
+    int level = 0;
+    while (level < WHEEL_LEVELS) {
+        int slot = 0;
+        while (slot < WHEEL_SLOTS) {
+            waves->slots[level][slot] = NO_EVENT;
+            slot++;
+        }
+        memset(waves->occupied[level], 0, sizeof waves->occupied[level]);
+        level++;
+    }
+
+    int capacity = 0;
+    int valid = 1;
+    int tick;
+    int count;
+    int scanned;
+    while (valid && (scanned = scan_number(input, &tick)) != EOF) {
+        valid = scanned == 1 && scan_number(input, &count) == 1 && 
+                tick >= 0 && count > 0;
+        if (valid && tick >= start) {
+            if (waves->n_events == capacity) {
+                capacity = capacity > 0 ? capacity * 2 : 1024;
+                struct wave_event *events = 
+                    realloc(waves->events, capacity * sizeof *events);
+                if (events == NULL) {
+                    valid = 0;
+                    break;
+                }
+                waves->events = events;
+            }
+            struct wave_event *event = &waves->events[waves->n_events];
+            event->tick = tick;
+            event->count = count;
+            schedule_wave(waves, waves->n_events);
+            waves->n_events++;
+            waves->pending++;
+        }
+    }
+    close_input(input);
+    close(fd);
+    if (!valid) {
+        free_waves(waves);
+        return NULL;
+    }
+    return waves;
+}
+
+/**
+ * Frees the waves, along with any still waiting to spawn.
+ * 
+ * Parameters:
+ *     waves - the waves to free
+ * Returns:
+ *     nothing
+ */
+void free_waves(struct waves *waves) {
+    free(waves->events);
+    free(waves);
+}
+
+/**
+ * Puts a wave in the wheel: in level 0 if it is due now, or else in the 
+ * level of the highest byte where its tick differs from `now`, in the slot
+ * for that byte.
+ * 
+ * Parameters:
+ *     waves - the waves
+ *     event - which wave, which mustn't be due before `now`
+ * Returns:
+ *     nothing
+ */
+void schedule_wave(struct waves *waves, int event) {
+    long long tick = waves->events[event].tick;
+    int level = 0;
+    if (tick != waves->now) {
+        unsigned long long differ = tick ^ waves->now;
+        level = (63 - __builtin_clzll(differ)) / WHEEL_BITS;
+    }
+    int slot = (int)(tick >> (level * WHEEL_BITS)) & (WHEEL_SLOTS - 1);
+    waves->events[event].next = waves->slots[level][slot];
+    waves->slots[level][slot] = event;
+    waves->occupied[level][slot / WORD_BITS] |= 1ULL << (slot % WORD_BITS);
+}
+
+/**
+ * Empties a slot of the wheel.
+ * 
+ * Parameters:
+ *     waves - the waves
+ *     level - level of the slot
+ *     slot - the slot
+ * Returns:
+ *     event - the first wave that was in the slot, chained to the rest
+ *     NO_EVENT - if it was empty.
+ */
+int take_slot(struct waves *waves, int level, int slot) {
+    int event = waves->slots[level][slot];
+    waves->slots[level][slot] = NO_EVENT;
+    waves->occupied[level][slot / WORD_BITS] &= ~(1ULL << (slot % WORD_BITS));
+    return event;
+}
+
+/**
+ * Finds the earliest tick any wave could be due, which is the first tick of
+ * the first slot with waves in it, looking up from level 0. Waiting until 
+ * then never misses a wave, and `advance_waves` to it moves the waves in 
+ * that slot closer.
+ * 
+ * Parameters:
+ *     waves - the waves
+ * Returns:
+ *     tick - the first tick that may have a wave due
+ *     LLONG_MAX - if there are no waves left.
+ */
+long long next_wave(struct waves *waves) {
+    if (waves->pending == 0) {
+        return LLONG_MAX;
+    }
+    int level = 0;
+    while (level < WHEEL_LEVELS) {
+        int shift = level * WHEEL_BITS;
+        int slot = (int)(waves->now >> shift) & (WHEEL_SLOTS - 1);
+        // Only the slots from `now` on can have waves, so the first word is
+        // masked below it.
+        int word = slot / WORD_BITS;
+        uint64_t bits = waves->occupied[level][word] & 
+                        (~0ULL << (slot % WORD_BITS));
+        while (bits == 0 && word + 1 < WHEEL_SLOTS / WORD_BITS) {
+            word++;
+            bits = waves->occupied[level][word];
+        }
+        if (bits != 0) {
+            long long first = word * WORD_BITS + __builtin_ctzll(bits);
+            long long above = 0;
+            if (level + 1 < WHEEL_LEVELS) {
+                above = waves->now >> (shift + WHEEL_BITS) << 
+                        (shift + WHEEL_BITS);
+            }
+            return above + (first << shift);
+        }
+        level++;
+    }
+    return LLONG_MAX;
+}
+
+/**
+ * Moves the wheel on to a tick. Only the waves in the slot the tick reaches
+ * at the highest level that changes can have got closer, so only they are 
+ * put back in the wheel, a level or more down.
+ * 
+ * Parameters:
+ *     waves - the waves
+ *     tick - the tick to move to, which mustn't be after `next_wave`
+ * Returns:
+ *     nothing
+ */
+void advance_waves(struct waves *waves, long long tick) {
+    if (tick == waves->now) {
+        return;
+    }
+    unsigned long long differ = tick ^ waves->now;
+    int level = (63 - __builtin_clzll(differ)) / WHEEL_BITS;
+    waves->now = tick;
+    int slot = (int)(tick >> (level * WHEEL_BITS)) & (WHEEL_SLOTS - 1);
+    int event = take_slot(waves, level, slot);
+    while (event != NO_EVENT) {
+        int next = waves->events[event].next;
+        schedule_wave(waves, event);
+        event = next;
+    }
+}
+
+/**
+ * Spawns the waves due at the game's tick at the start of the path, as `e`
+ * commands so they are recorded like any other.
+ * 
+ * Parameters:
+ *     game - the game to spawn them in
+ *     waves - the waves
+ *     recorder - the replay log to record the commands to, or NULL
+ * Returns:
+ *     nothing
+ */
+void spawn_waves(struct game *game, struct waves *waves, 
+                 struct recorder *recorder) {
+    advance_waves(waves, game->ticks);
+    int slot = (int)(game->ticks & (WHEEL_SLOTS - 1));
+    long long spawn = 0;
+    int event = take_slot(waves, 0, slot);
+    while (event != NO_EVENT) {
+        spawn += waves->events[event].count;
+        waves->pending--;
+        event = waves->events[event].next;
+    }
+    while (spawn > 0) {
+        struct command command = {
+            ENEMIES, {spawn < INT_MAX ? (int)spawn : INT_MAX, 0, 0, 0}
+        };
+        if (recorder != NULL) {
+            record_command(recorder, game, &command);
+        }
+        run_command(game, &command);
+        spawn -= command.args[0];
+    }
+}
+
+/**
+ * Undoes or redoes the last change to a game and prints whether it worked.
+ * One that worked goes in the replay log as a checkpoint of where the game 
+ * went, and one that didn't as the command itself.
+ * 
+ * Parameters:
+ *     game - the game to play
+ *     command - the UNDO or REDO
+ *     history - the game's history, or NULL if it doesn't keep one
+ *     recorder - the replay log, or NULL
+ * Returns:
+ *     nothing
+ */
+void rewind_game(struct game *game, struct command *command, 
+                 struct history *history, struct recorder *recorder) {
+    int result = rewind_version(history, command->type);
+    if (recorder != NULL && result == RESULT_OK) {
+        record_checkpoint(recorder, game, command->type);
+    } else if (recorder != NULL) {
+        record_command(recorder, game, command);
+    }
+    print_result(&game->map, result);
+}
+
+/**
+ * Carries out a command typed into the game, recording it to the replay log
+ * first if there is one, and keeping what it changed in the game's history.
+ * With waves, a move stops at each tick where a wave may be due to spawn 
+ * it, and is recorded as the shorter moves with the waves in between. It 
+ * still prints one message for the whole move, and stops early if the game
+ * runs out of lives.
+ * 
+ * Parameters:
+ *     game - the game to play
+ *     command - the command to carry out
+ *     waves - the waves waiting to spawn, or NULL
+ *     recorder - the replay log, or NULL
+ *     history - the game's history, or NULL
+ * Returns:
+ *     CONTINUE - if there are lives left
+ *     STOP - if the game has run out of lives
+ */
+int play_command(struct game *game, struct command *command, 
+                 struct waves *waves, struct recorder *recorder,
+                 struct history *history) {
+    if (command->type == UNDO || command->type == REDO) {
+        rewind_game(game, command, history, recorder);
+        return CONTINUE;
+    }
+    if (
+        waves == NULL || waves->pending == 0 || 
+        command->type != MOVE || command->args[0] <= 0
+    ) {
+        if (recorder != NULL) {
+            record_command(recorder, game, command);
+        }
+        if (history != NULL) {
+            watch_history(history);
+        }
+        int game_condition = run_command(game, command);
+        if (history != NULL) {
+            commit_version(history);
+        }
+        return game_condition;
+    }
+    long long target = game->ticks + command->args[0];
+    int lives = game->lives;
+    int quiet = game->map.quiet;
+    game->map.quiet = 1;
+    int game_condition = CONTINUE;
+    while (game_condition == CONTINUE && game->ticks < target) {
+        long long due = next_wave(waves);
+        struct command move = {
+            MOVE, {(int)((due < target ? due : target) - game->ticks), 0, 0, 0}
+        };
+        if (move.args[0] > 0) {
+            if (recorder != NULL) {
+                record_command(recorder, game, &move);
+            }
+            game_condition = run_command(game, &move);
+        }
+        if (game_condition == CONTINUE) {
+            spawn_waves(game, waves, recorder);
+        }
+    }
+    game->map.quiet = quiet;
+    struct event event = {MOVE, RESULT_OK, lives - game->lives};
+    print_event(&game->map, &event);
+    return game_condition;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+///////////////////////////////  AUTO MODE  ////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Reads commands for a game running by itself, queueing each one for the 
+ * next tick. Runs on its own thread until the input runs out or the game
+ * stops it.
+ * 
+ * Parameters:
+ *     data - the command queue
+ * Returns:
+ *     NULL
+ */
+void *read_commands(void *data) {
+    struct command_queue *queue = data;
+    struct command command;
+    int scanned;
+    while ((scanned = scan_command(queue->input, &command)) != EOF) {
+        if (!scanned) {
+            continue;
+        }
+        pthread_mutex_lock(&queue->lock);
+        while (queue->length == AUTO_QUEUE_SIZE && !queue->stopped) {
+            pthread_cond_wait(&queue->not_full, &queue->lock);
+        }
+        int stopped = queue->stopped;
+        if (!stopped) {
+            int tail = (queue->head + queue->length) % AUTO_QUEUE_SIZE;
+            queue->commands[tail] = command;
+            queue->length++;
+        }
+        pthread_mutex_unlock(&queue->lock);
+        if (stopped) {
+            return NULL;
+        }
+    }
+    pthread_mutex_lock(&queue->lock);
+    queue->ended = 1;
+    pthread_mutex_unlock(&queue->lock);
+    return NULL;
+}
+
+/**
+ * Takes the next queued command, if there is one.
+ * 
+ * Parameters:
+ *     queue - the command queue
+ *     command - where to store the command
+ *     ended - set to 1 if the input has run out and the queue is empty
+ * Returns:
+ *     1 - if a command was taken
+ *     0 - if the queue is empty.
+ */
+int take_command(struct command_queue *queue, struct command *command, 
+                 int *ended) {
+    pthread_mutex_lock(&queue->lock);
+    int taken = queue->length > 0;
+    if (taken) {
+        *command = queue->commands[queue->head];
+        queue->head = (queue->head + 1) % AUTO_QUEUE_SIZE;
+        queue->length--;
+        pthread_cond_signal(&queue->not_full);
+    }
+    *ended = !taken && queue->ended;
+    pthread_mutex_unlock(&queue->lock);
+    return taken;
+}
+
+/**
+ * Draws each copy of the game it is handed, until it is stopped. Runs on 
+ * its own thread.
+ * 
+ * Parameters:
+ *     data - the renderer
+ * Returns:
+ *     NULL
+ */
+void *run_renderer(void *data) {
+    struct renderer *renderer = data;
+    struct game *game = renderer->game;
+    pthread_mutex_lock(&renderer->lock);
+    while (1) {
+        while (!renderer->pending && !renderer->stopped) {
+            pthread_cond_wait(&renderer->ready, &renderer->lock);
+        }
+        if (!renderer->pending) {
+            break;
+        }
+        // The copy is only touched again once it has been drawn.
+        pthread_mutex_unlock(&renderer->lock);
+        print_map(&game->map, &game->path, game->lives, game->money, 
+                  renderer->frame);
+        fflush(stdout);
+        pthread_mutex_lock(&renderer->lock);
+        renderer->pending = 0;
+    }
+    pthread_mutex_unlock(&renderer->lock);
+    return NULL;
+}
+
+/**
+ * Hands the renderer a copy of the game to draw, unless it is still drawing
+ * the last one.
+ * 
+ * Parameters:
+ *     renderer - the renderer
+ *     game - the game to draw
+ * Returns:
+ *     1 - if the copy was handed over
+ *     0 - if the renderer is busy.
+ */
+int hand_frame(struct renderer *renderer, struct game *game) {
+    pthread_mutex_lock(&renderer->lock);
+    int handed = !renderer->pending;
+    if (handed) {
+        copy_game(renderer->game, game);
+        renderer->pending = 1;
+        pthread_cond_signal(&renderer->ready);
+    }
+    pthread_mutex_unlock(&renderer->lock);
+    return handed;
+}
+
+/**
+ * Sleeps until a time on the `clock_ns` clock. Sleeping until a fixed time,
+ * rather than for a length of time, means the time spent on each tick 
+ * doesn't add up into drift.
+ * 
+ * Parameters:
+ *     deadline - the time to wake up, in nanoseconds
+ * Returns:
+ *     nothing
+ */
+void wait_until(long long deadline) {
+    struct timespec wake = {
+        deadline / 1000000000LL, deadline % 1000000000LL
+    };
+    while (
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR
+    ) {
+    }
+}
+
+/**
+ * Runs a game by itself: every tick, the enemies are attacked once and then
+ * move one tile, `auto_rate` ticks a second. Commands typed meanwhile are 
+ * read on another thread and carried out at the start of the next tick. 
+ * Only their messages are printed, and the map is redrawn on a thread of its
+ * own at most `AUTO_FRAME_RATE` times a second. 
+ * 
+ * Ticks are due at fixed times from the start. A tick that is late runs 
+ * straight away, so a game that falls behind catches up, and how late the 
+ * latest tick was is printed at the end. The game ends when it runs out of
+ * lives, or when the input has run out and there are no enemies left, 
+ * or waves still to come.
+ * 
+ * Parameters:
+ *     game - the game to play, already set up
+ *     options - the command line options, with the tick rate
+ *     input - the input to read commands from
+ *     frame - the frame to draw the map into, or NULL if headless
+ *     waves - the waves waiting to spawn, or NULL
+ *     recorder - the replay log to record the commands to, or NULL
+ * Returns:
+ *     nothing
+ */
+void run_auto(struct game *game, struct options *options, 
+              struct input *input, struct frame *frame,
+              struct waves *waves, struct recorder *recorder) {
+    struct command_queue *queue = malloc(sizeof *queue);
+    struct renderer renderer;
+    pthread_t reader;
+    if (queue == NULL) {
+        fprintf(stderr, "Error: Not enough memory to run the game.\n");
+        return;
+    }
+    queue->input = input;
+    queue->head = 0;
+    queue->length = 0;
+    queue->ended = 0;
+    queue->stopped = 0;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
+    renderer.game = NULL;
+    renderer.frame = frame;
+    renderer.pending = 0;
+    renderer.stopped = 0;
+    pthread_mutex_init(&renderer.lock, NULL);
+    pthread_cond_init(&renderer.ready, NULL);
+    int rendering = 0;
+    if (frame != NULL) {
+        renderer.game = clone_game(game);
+        rendering = renderer.game != NULL && 
+                    pthread_create(&renderer.thread, NULL, run_renderer, 
+                                   &renderer) == 0;
+    }
+    if (
+        (frame != NULL && !rendering) || !open_stop(input) ||
+        pthread_create(&reader, NULL, read_commands, queue) != 0
+    ) {
+        fprintf(stderr, "Error: Could not start the game running.\n");
+        if (rendering) {
+            pthread_mutex_lock(&renderer.lock);
+            renderer.stopped = 1;
+            pthread_cond_signal(&renderer.ready);
+            pthread_mutex_unlock(&renderer.lock);
+            pthread_join(renderer.thread, NULL);
+        }
+        if (renderer.game != NULL) {
+            free_game(renderer.game);
+        }
+        free(queue);
+        return;
+    }
+
+    struct command ticks[] = {
+        {ATTACK, {1, 0, 0, 0}},
+        {MOVE, {1, 0, 0, 0}}
+    };
+    long long period = 1000000000LL / options->auto_rate;
+    long long due = clock_ns();
+    long long frame_due = due;
+    long long n_ticks = 0;
+    long long latest = 0;
+    int game_condition = CONTINUE;
+    while (game_condition == CONTINUE) {
+        long long now = clock_ns();
+        if (now < due) {
+            wait_until(due);
+            now = clock_ns();
+        }
+        if (now - due > latest) {
+            latest = now - due;
+        }
+
+        struct command command;
+        int ended = 0;
+        while (
+            game_condition == CONTINUE && 
+            take_command(queue, &command, &ended)
+        ) {
+            game_condition = play_command(game, &command, waves, recorder, 
+                                          NULL);
+        }
+        // Without any more input or waves, nothing can happen to an empty 
+        // path.
+        if (
+            game_condition == STOP || 
+            (ended && game->path.total_enemies == 0 && 
+             (waves == NULL || waves->pending == 0))
+        ) {
+            break;
+        }
+
+        // The tick's own attack and move print nothing.
+        int quiet = game->map.quiet;
+        game->map.quiet = 1;
+        int i = 0;
+        while (game_condition == CONTINUE && i < 2) {
+            game_condition = play_command(game, &ticks[i], waves, recorder, 
+                                          NULL);
+            i++;
+        }
+        game->map.quiet = quiet;
+        n_ticks++;
+        due += period;
+
+        if (rendering && now >= frame_due && hand_frame(&renderer, game)) {
+            frame_due = now + 1000000000LL / AUTO_FRAME_RATE;
+        }
+    }
+
+    pthread_mutex_lock(&queue->lock);
+    queue->stopped = 1;
+    pthread_cond_signal(&queue->not_full);
+    pthread_mutex_unlock(&queue->lock);
+    stop_input(input);
+    pthread_join(reader, NULL);
+    if (rendering) {
+        pthread_mutex_lock(&renderer.lock);
+        renderer.stopped = 1;
+        pthread_cond_signal(&renderer.ready);
+        pthread_mutex_unlock(&renderer.lock);
+        pthread_join(renderer.thread, NULL);
+        free_game(renderer.game);
+    }
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->not_full);
+    pthread_mutex_destroy(&renderer.lock);
+    pthread_cond_destroy(&renderer.ready);
+    free(queue);
+
+    draw_game(game, frame);
+    if (game_condition == STOP) {
+        printf("Oh no, you ran out of lives!");
+    }
+    printf("\nTicks: %lld Latest tick: %lld us late\n", n_ticks, 
+           latest / 1000);
+}
+
+/**
+ * Allocates a frame big enough to draw a map of the given size, as long as
+ * no tile has 1000 or more enemies on it.
+ * 
+ * Parameters:
+ *     rows - number of map rows
+ *     cols - number of map columns
+ * Returns:
+ *     frame - the new, empty frame
+ *     NULL - if there is not enough memory
+ */
+struct frame *allocate_frame(int rows, int cols) {
+    struct frame *frame = malloc(sizeof *frame);
+    if (frame == NULL) {
+        return NULL;
+    }
+    // Room for the lives and money line, then two lines per row of tiles
+    frame->capacity = 64 + (size_t)rows * 2 * ((size_t)cols * TILE_WIDTH + 1);
+    frame->length = 0;
+    frame->text = malloc(frame->capacity);
+    if (frame->text == NULL) {
+        free(frame);
+        return NULL;
+    }
+    return frame;
+}
+
+/**
+ * Frees a frame.
+ * 
+ * Parameters:
+ *     frame - the frame to free
+ * Returns:
+ *     nothing
+ */
+void free_frame(struct frame *frame) {
+    free(frame->text);
+    free(frame);
+}
+
+/**
+ * Makes room at the end of a frame, growing it if needed. 
+ * 
+ * Parameters:
+ *     frame - the frame to draw into
+ *     length - the number of characters about to be added
+ * Returns:
+ *     text - where to write the characters
+ *     NULL - if there is not enough memory, leaving the frame as it was
+ */
+char *reserve_frame(struct frame *frame, size_t length) {
+    if (frame->length + length > frame->capacity) {
+        size_t capacity = 2 * frame->capacity + length;
+        char *text = realloc(frame->text, capacity);
+        if (text == NULL) {
+            return NULL;
+        }
+        frame->text = text;
+        frame->capacity = capacity;
+    }
+    return &frame->text[frame->length];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+///////////////////////////////  PIPELINE  /////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Sets up an empty stage queue.
+ * 
+ * Parameters:
+ *     queue - the queue to set up
+ *     size - how many slots it has, a power of two
+ * Returns:
+ *     nothing
+ */
+void init_stage_queue(struct stage_queue *queue, size_t size) {
+    queue->head = 0;
+    queue->tail = 0;
+    queue->size = size;
+    queue->sleepers = 0;
+    queue->stopped = 0;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->changed, NULL);
+}
+
+/**
+ * Frees what a stage queue holds, once neither thread is using it.
+ * 
+ * Parameters:
+ *     queue - the queue
+ * Returns:
+ *     nothing
+ */
+void destroy_stage_queue(struct stage_queue *queue) {
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->changed);
+}
+
+/**
+ * Counts the items waiting in a stage queue. The other thread may change 
+ * it straight away, but only towards what this thread is waiting for.
+ * 
+ * Parameters:
+ *     queue - the queue
+ * Returns:
+ *     length - the number of items added and not yet taken
+ */
+size_t stage_length(struct stage_queue *queue) {
+    size_t head = __atomic_load_n(&queue->head, __ATOMIC_SEQ_CST);
+    size_t tail = __atomic_load_n(&queue->tail, __ATOMIC_SEQ_CST);
+    return tail - head;
+}
+
+/**
+ * Checks whether what a thread is waiting for in a stage queue is there.
+ * 
+ * Parameters:
+ *     queue - the queue
+ *     wait - what the thread is waiting for
+ * Returns:
+ *     1 - if it is there
+ *     0 - if not.
+ */
+int stage_ready(struct stage_queue *queue, int wait) {
+    size_t length = stage_length(queue);
+    if (wait == STAGE_TAKE) {
+        return length > 0;
+    } else if (wait == STAGE_ADD) {
+        return length < queue->size;
+    }
+    return length == 0;
+}
+
+/**
+ * Waits until what a thread needs from a stage queue is there, or the queue
+ * is stopped. The thread spins for a while first, since the other thread is
+ * usually about to catch up, then sleeps until it is woken.
+ * 
+ * Parameters:
+ *     queue - the queue
+ *     wait - what the thread is waiting for
+ * Returns:
+ *     nothing
+ */
+void wait_stage(struct stage_queue *queue, int wait) {
+    int spins = 0;
+    while (
+        !stage_ready(queue, wait) && 
+        !__atomic_load_n(&queue->stopped, __ATOMIC_SEQ_CST)
+    ) {
+        if (spins < STAGE_SPINS) {
+            spins++;
+            continue;
+        }
+        // Counting itself as a sleeper before looking again means the 
+        // other thread either sees it sleeping, or has already moved on.
+        pthread_mutex_lock(&queue->lock);
+        __atomic_fetch_add(&queue->sleepers, 1, __ATOMIC_SEQ_CST);
+        while (
+            !stage_ready(queue, wait) && 
+            !__atomic_load_n(&queue->stopped, __ATOMIC_SEQ_CST)
+        ) {
+            pthread_cond_wait(&queue->changed, &queue->lock);
+        }
+        __atomic_fetch_sub(&queue->sleepers, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&queue->lock);
+    }
+}
+
+/**
+ * Wakes the other thread of a stage queue if it is asleep.
+ * 
+ * Parameters:
+ *     queue - the queue
+ * Returns:
+ *     nothing
+ */
+void wake_stage(struct stage_queue *queue) {
+    if (__atomic_load_n(&queue->sleepers, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&queue->lock);
+        pthread_cond_broadcast(&queue->changed);
+        pthread_mutex_unlock(&queue->lock);
+    }
+}
+
+/**
+ * Waits for a free slot to add an item to.
+ * 
+ * Parameters:
+ *     queue - the queue
+ *     slot - where to store the slot to fill in
+ * Returns:
+ *     1 - if there is a slot
+ *     0 - if the queue has been stopped.
+ */
+int reserve_stage(struct stage_queue *queue, size_t *slot) {
+    wait_stage(queue, STAGE_ADD);
+    if (__atomic_load_n(&queue->stopped, __ATOMIC_SEQ_CST)) {
+        return 0;
+    }
+    *slot = queue->tail & (queue->size - 1);
+    return 1;
+}
+
+/**
+ * Hands the slot that has just been filled in to the other thread.
+ * 
+ * Parameters:
+ *     queue - the queue
+ * Returns:
+ *     nothing
+ */
+void publish_stage(struct stage_queue *queue) {
+    __atomic_store_n(&queue->tail, queue->tail + 1, __ATOMIC_SEQ_CST);
+    wake_stage(queue);
+}
+
+/**
+ * Waits for the next item to take.
+ * 
+ * Parameters:
+ *     queue - the queue
+ *     slot - where to store the slot holding it
+ * Returns:
+ *     1 - if there is an item
+ *     0 - if the queue has been stopped and emptied.
+ */
+int peek_stage(struct stage_queue *queue, size_t *slot) {
+    wait_stage(queue, STAGE_TAKE);
+    if (!stage_ready(queue, STAGE_TAKE)) {
+        return 0;
+    }
+    *slot = queue->head & (queue->size - 1);
+    return 1;
+}
+
+/**
+ * Hands the slot of the item that has just been taken back to the other 
+ * thread.
+ * 
+ * Parameters:
+ *     queue - the queue
+ * Returns:
+ *     nothing
+ */
+void release_stage(struct stage_queue *queue) {
+    __atomic_store_n(&queue->head, queue->head + 1, __ATOMIC_SEQ_CST);
+    wake_stage(queue);
+}
+
+/**
+ * Stops a stage queue: nothing more is added, and the other thread stops 
+ * waiting once it has taken what is left.
+ * 
+ * Parameters:
+ *     queue - the queue
+ * Returns:
+ *     nothing
+ */
+void stop_stage(struct stage_queue *queue) {
+    __atomic_store_n(&queue->stopped, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&queue->lock);
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * Parses the commands typed into a game, handing each one to the game 
+ * thread. Runs on its own thread until the input runs out or the game stops
+ * it.
+ * 
+ * Parameters:
+ *     data - the pipeline
+ * Returns:
+ *     NULL
+ */
+void *run_parser(void *data) {
+    struct pipeline *pipeline = data;
+    struct stage_queue *queue = &pipeline->commands;
+    struct command command;
+    int scanned;
+    while ((scanned = scan_command(pipeline->input, &command)) != EOF) {
+        size_t slot;
+        int reserved = reserve_stage(queue, &slot);
+        if (reserved) {
+            pipeline->parsed[slot] = (struct parsed_command){
+                command, scanned
+            };
+            publish_stage(queue);
+        }
+        if (!reserved) {
+            return NULL;
+        }
+    }
+    stop_stage(queue);
+    return NULL;
+}
+
+/**
+ * Prints what each command printed, then draws the game as it was after it
+ * and prompts for the next one. Runs on its own thread until the game stops
+ * it.
+ * 
+ * Parameters:
+ *     data - the pipeline
+ * Returns:
+ *     NULL
+ */
+void *run_drawer(void *data) {
+    struct pipeline *pipeline = data;
+    struct stage_queue *queue = &pipeline->frames;
+    size_t slot;
+    while (peek_stage(queue, &slot)) {
+        struct frame *messages = pipeline->messages[slot];
+        fwrite(messages->text, 1, messages->length, stdout);
+        // A terminal only shows the newest map, so an older one is skipped
+        // once a newer one is waiting, along with its prompt.
+        if (!pipeline->drop_stale || stage_length(queue) == 1) {
+            draw_game(pipeline->snapshots[slot], pipeline->frame);
+            if (pipeline->conditions[slot] == CONTINUE) {
+                print_prompt(pipeline->options, "Enter Command: ");
+            } else {
+                printf("Oh no, you ran out of lives!");
+            }
+        }
+        release_stage(queue);
+        // Everything printed so far is shown before waiting for more.
+        if (!stage_ready(queue, STAGE_TAKE)) {
+            fflush(stdout);
+        }
     }
+    return NULL;
 }
 
 /**
- * Checks if there is enough money for the upgrade, and completes the upgrade
+ * Frees a pipeline and whatever it has allocated so far.
  * 
  * Parameters:
- *     map - map of the tiles
- *     tower - cordinates of the end square
- *     *money - remaining money
- *     cost - cost of the upgrade
+ *     pipeline - the pipeline, with its threads stopped
  * Returns:
  *     nothing
  */
-void test_upgrade_tower(struct tile map[MAP_ROWS][MAP_COLUMNS],
-                        struct coord_data tower, int *money, int cost) {
-    // Ensures there is enough money for upgrade cost
-    if (*money >= cost) {
-        // Subtracks money from running total and updates the tower on the map. 
-        *money -= cost;
-        map[tower.row][tower.col].entity++;
-        printf("Upgrade Successful!\n");
-    } else {
-        printf("Error: Insufficient Funds.\n");
+void free_pipeline(struct pipeline *pipeline) {
+    int i = 0;
+    while (i < PIPELINE_FRAMES) {
+        if (pipeline->messages[i] != NULL) {
+            free_frame(pipeline->messages[i]);
+        }
+        if (pipeline->snapshots[i] != NULL) {
+            free_game(pipeline->snapshots[i]);
+        }
+        i++;
     }
+    destroy_stage_queue(&pipeline->commands);
+    destroy_stage_queue(&pipeline->frames);
+    free(pipeline);
 }
 
 /**
- * Creates a tower, after checking if its allowed. 
+ * Plays the commands typed into a game in three stages, each on its own 
+ * thread, so that neither reading the input nor drawing the map holds up 
+ * the game. The game thread carries out each command with its messages 
+ * going into a slot of `frames` instead of being printed, then takes a 
+ * snapshot of the game for the drawer. Everything is printed in the same 
+ * order as a game played one command at a time, but on a terminal the 
+ * drawer skips maps that are already out of date.
  * 
  * Parameters:
- *     map - map of the tiles
- *     *money - total amount of money
+ *     game - the game to play, already set up
+ *     options - the command line options
+ *     input - the input to read commands from
+ *     frame - the frame to draw the map into
+ *     waves - the waves waiting to spawn, or NULL
+ *     recorder - the replay log to record the commands to, or NULL
+ *     history - the game's history, or NULL if it doesn't keep one
  * Returns:
- *     nothing
+ *     1 - if the game was played
+ *     0 - if the threads couldn't be started, and nothing was read.
  */
-void upgrade_tower(struct tile map[MAP_ROWS][MAP_COLUMNS], int *money) {
-    // Takes in a set of coordinates
-    struct coord_data tower = scan_coords();
-    // Checks to ensure all conditions pass. 
-    if (!test_point(tower.row, tower.col)) {
-        printf("Error: Upgrade target is out-of-bounds.\n");
+int run_pipeline(struct game *game, struct options *options, 
+                 struct input *input, struct frame *frame,
+                 struct waves *waves, struct recorder *recorder,
+                 struct history *history) {
+    struct pipeline *pipeline = calloc(1, sizeof *pipeline);
+    if (pipeline == NULL) {
+        return 0;
     }
-    else if (
-        map[tower.row][tower.col].entity == ENEMY ||
-        map[tower.row][tower.col].entity == EMPTY
-    ) {
-        printf("Error: Upgrade target contains no tower entity.\n");
+    pipeline->options = options;
+    pipeline->input = input;
+    pipeline->frame = frame;
+    pipeline->drop_stale = isatty(STDOUT_FILENO);
+    init_stage_queue(&pipeline->commands, PIPELINE_COMMANDS);
+    init_stage_queue(&pipeline->frames, PIPELINE_FRAMES);
+    int allocated = 1;
+    int i = 0;
+    while (i < PIPELINE_FRAMES) {
+        // An empty map's frame is big enough for a few messages, and grows
+        // when there are more.
+        pipeline->messages[i] = allocate_frame(0, 0);
+        pipeline->snapshots[i] = clone_game(game);
+        if (pipeline->messages[i] == NULL || pipeline->snapshots[i] == NULL) {
+            allocated = 0;
+        }
+        i++;
     }
-    else if (map[tower.row][tower.col].entity == FORTIFIED_TOWER) {
-        printf("Error: Tower cannot be upgraded further.\n");
+    if (
+        !allocated || 
+        pthread_create(&pipeline->drawer, NULL, run_drawer, pipeline) != 0
+    ) {
+        free_pipeline(pipeline);
+        return 0;
     }
-    else if (map[tower.row][tower.col].entity == BASIC_TOWER) {
-        test_upgrade_tower(map, tower, money, COST_POWER);
+    if (
+        !open_stop(input) ||
+        pthread_create(&pipeline->parser, NULL, run_parser, pipeline) != 0
+    ) {
+        stop_stage(&pipeline->frames);
+        pthread_join(pipeline->drawer, NULL);
+        free_pipeline(pipeline);
+        return 0;
     }
-    else if (map[tower.row][tower.col].entity == POWER_TOWER) {
-        test_upgrade_tower(map, tower, money, COST_FORTIFIED);
+
+    int game_condition = CONTINUE;
+    size_t slot;
+    while (
+        game_condition == CONTINUE && 
+        peek_stage(&pipeline->commands, &slot)
+    ) {
+        struct parsed_command parsed = pipeline->parsed[slot];
+        release_stage(&pipeline->commands);
+        // Only this thread stops `frames`, so there is always a slot.
+        reserve_stage(&pipeline->frames, &slot);
+        pipeline->messages[slot]->length = 0;
+        message_sink = pipeline->messages[slot];
+        // The stats count the maps drawn so far, so the drawer catches up 
+        // before they are printed.
+        if (parsed.scanned && parsed.command.type == STATS) {
+            wait_stage(&pipeline->frames, STAGE_DRAIN);
+        }
+        // Commands with a malformed argument are skipped.
+        if (parsed.scanned) {
+            game_condition = play_command(game, &parsed.command, waves, 
+                                          recorder, history);
+        }
+        message_sink = NULL;
+        snapshot_game(pipeline->snapshots[slot], game);
+        pipeline->conditions[slot] = game_condition;
+        publish_stage(&pipeline->frames);
     }
+
+    stop_stage(&pipeline->commands);
+    stop_input(input);
+    pthread_join(pipeline->parser, NULL);
+    stop_stage(&pipeline->frames);
+    pthread_join(pipeline->drawer, NULL);
+    fflush(stdout);
+    free_pipeline(pipeline);
+    return 1;
 }
 
 /**
- * Checks the surrounding cells of a tile for a specific tower type that is in 
- * range, and calculates the damage that tile takes from that type.
+ * Plays the commands typed into a game one at a time, drawing the map after
+ * each, until the input runs out or the game runs out of lives.
  * 
  * Parameters:
- *     map - map of the tiles
- *     path - array of structs of the path
- *     tower - specifies the tower type to check
- *     range - the range of the tower it can reach
- *     power - the damage the tower can deal
+ *     game - the game to play, already set up
+ *     options - the command line options
+ *     input - the input to read commands from
+ *     frame - the frame to draw the map into, or NULL if headless
+ *     waves - the waves waiting to spawn, or NULL
+ *     recorder - the replay log to record the commands to, or NULL
+ *     history - the game's history, or NULL if it doesn't keep one
  * Returns:
- *     damage - total damage all the surrounding tower of that type did. 
+ *     nothing
  */
-int attack_tower_type(struct tile map[MAP_ROWS][MAP_COLUMNS],
-               struct coord_data path[MAP_ROWS * MAP_COLUMNS], 
-               int tower, int range, int power, int i) {
-    int damage = 0;
-    int row_count = 0;
-    // Start at the top corner of the towers range
-    int row = path[i].row - range;
-    // Uses formula to convert given range into  
-    int check_range = range * 2 + 1;
-    while (row_count < check_range) {
-        int col_count = 0;
-        int col = path[i].col - range;
-        while (col_count < check_range) {
-            if (test_point(row, col) && map[row][col].entity == tower) {
-                damage += power; 
-            }
-            col_count++;
-            col++;
+void run_commands(struct game *game, struct options *options, 
+                  struct input *input, struct frame *frame,
+                  struct waves *waves, struct recorder *recorder,
+                  struct history *history) {
+    int game_condition = CONTINUE;
+    struct command command;
+    int scanned;
+    while (
+        game_condition == CONTINUE && 
+        (scanned = scan_command(input, &command)) != EOF
+    ) {
+        // Commands with a malformed argument are skipped.
+        if (scanned) {
+            game_condition = play_command(game, &command, waves, recorder,
+                                          history);
+        }
+        draw_game(game, frame);
+        if (game_condition) {
+            print_prompt(options, "Enter Command: ");
+        } else {
+            printf("Oh no, you ran out of lives!"); 
         }
-        row_count++;
-        row++;
     }
-    return damage;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////  SERVER  //////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
 /**
- * Checks every path tile for surrounding towers that can deal damage and 
- * repeats the attacks, the number of times from the input.
+ * Scans in the setup of a server's game without setting it up, since the
+ * rest of it may not have arrived yet. It is read the same as `scan_setup`
+ * reads it, and the path stops in the same place.
  * 
  * Parameters:
- *     map - map of the tiles
- *     path_length - number of tiles that are path tiles
- *     path - array of structs of the path
- *     *money - amount of money remaining
+ *     input - the input to read
+ *     header - where to store the setup
+ *     route - where to store the path directions
+ *     rows - number of map rows
+ *     cols - number of map columns
  * Returns:
  *     nothing
  */
-void attack_total(struct tile map[MAP_ROWS][MAP_COLUMNS], int path_length,
-                  struct coord_data path[MAP_ROWS * MAP_COLUMNS], int *money) {
-    int total_destroyed = 0;
-    int repeat = scan_int();
-    int iteration = 0;
-    while (iteration < repeat) {
-        int i = 0;
-        // We loop through each tile along the path
-        while (i < path_length) {
-            // Determines if the tile is in range of the surrounding tiles
-            // and sums up the total damage taken from these towers
-            int total_damage = 0;
-            total_damage += attack_tower_type(map, path, BASIC_TOWER, 
-                                              RANGE_BASIC, POWER_BASIC, i);
-            total_damage += attack_tower_type(map, path, POWER_TOWER, 
-                                              RANGE_POWER, POWER_POWER, i);
-            total_damage += attack_tower_type(map, path, FORTIFIED_TOWER, 
-                                              RANGE_FORTIFIED, POWER_FORTIFIED, 
-                                              i);
-            
-            // Caps total damage to the amount of enemies at that tile
-            struct coord_data current = path[i];
-            if (total_damage >= map[current.row][current.col].n_enemies) {
-                total_damage = map[current.row][current.col].n_enemies;
-                map[current.row][current.col].entity = EMPTY;
-            }
+void scan_header(struct input *input, struct log_header *header, 
+                 char *route, int rows, int cols) {
+    int lives = scan_int(input);
+    int money = scan_int(input);
+    struct coord_data start = scan_coords(input);
+    struct coord_data end = scan_coords(input);
+    int spawn = scan_int(input);
+    struct coord_data lake = scan_coords(input);
+    int height = scan_int(input);
+    int width = scan_int(input);
 
-            // updates lives and money
-            map[current.row][current.col].n_enemies -= total_damage;
-            *money += total_damage * MONEY_EARNED;
-            total_destroyed += total_damage;
-            i++;
+    // The path ends at the end point, or once it fills the map.
+    struct coord_data position = start;
+    int length = 0;
+    int reach_end = CONTINUE;
+    while (reach_end == CONTINUE) {
+        int direction = scan_char(input);
+        if (direction == EOF) {
+            break;
+        }
+        route[length] = direction;
+        length++;
+        move_position(&position, direction);
+        if (length >= rows * cols) {
+            reach_end = STOP;
+        } else {
+            reach_end = test_path(position, end);
         }
-        iteration++;
     }
-    printf("%d enemies destroyed!\n", total_destroyed);
-}
 
-/**
- * Checks if an ordinate fits in the offset and spacing rules
- * 
- * Parameters:
- *     ordinate - ordinate to test
- *     offset - offset of the rain
- *     spacing - spacing of the rain
- * Returns:
- *     1 - if current position is not end point.
- *     0 - if it is.
- */
-int test_rain(int ordinate, int offset, int spacing) {
-    return (ordinate - offset) % spacing == 0;
+    *header = (struct log_header){
+        .magic = LOG_MAGIC,
+        .version = LOG_VERSION,
+        .rows = rows,
+        .cols = cols,
+        .lives = lives,
+        .money = money,
+        .start = {start.row, start.col},
+        .end = {end.row, end.col},
+        .enemies = spawn,
+        .lake = {lake.row, lake.col, height, width},
+        .route_length = length
+    };
 }
- 
+
 /**
- * Checks if tower exists on the tile and removes if true. 
+ * Adds text to what the thread is sending back to the session it is 
+ * serving.
  * 
  * Parameters:
- *     map - map of the tiles
+ *     thread - the server thread
+ *     text - the text to add
+ *     length - length of the text
  * Returns:
- *     nothing
+ *     1 - if the text was added
+ *     0 - if there is not enough memory
  */
-void delete_tower(struct tile map[MAP_ROWS][MAP_COLUMNS],
-                  int row, int col) {
-    if (
-        map[row][col].entity == BASIC_TOWER ||
-        map[row][col].entity == POWER_TOWER
-    ) {
-        map[row][col].entity = EMPTY;
+int append_text(struct server_thread *thread, const char *text, 
+                size_t length) {
+    if (thread->text_length + length > thread->text_size) {
+        size_t size = 2 * thread->text_size;
+        while (size < thread->text_length + length) {
+            size *= 2;
+        }
+        char *grown = realloc(thread->text, size);
+        if (grown == NULL) {
+            return 0;
+        }
+        thread->text = grown;
+        thread->text_size = size;
     }
+    memcpy(thread->text + thread->text_length, text, length);
+    thread->text_length += length;
+    return 1;
 }
 
 /**
- * Creates water tiles from grass tiles in a pattern
+ * Plays as much of what a session has sent as is complete: the setup, then
+ * one command at a time. Input is only read up to the last newline, so a 
+ * number cut off at the end of what has arrived is never taken for a whole
+ * one, and anything incomplete is left until the rest of it arrives. Once
+ * the client has finished sending, what is left is read as it is, like the
+ * end of a headless game's input. The thread's `text` gets the same output
+ * a headless game would print.
  * 
  * Parameters:
- *     map - map of the tiles
+ *     thread - the thread serving the session
+ *     session - the session
+ *     length - how many bytes of the thread's `buffer` the session has sent
+ *     used - where to store how many of them were used up
  * Returns:
- *     nothing
+ *     1 - if the input was played
+ *     0 - if there is not enough memory
  */
-void create_rain(struct tile map[MAP_ROWS][MAP_COLUMNS]) {
-    struct coord_data spacing;
-    spacing = scan_coords();
-    struct coord_data offset;
-    offset = scan_coords();
+int serve_input(struct server_thread *thread, struct session *session,
+                size_t length, size_t *used) {
+    struct options *options = thread->options;
+    char text[MESSAGE_SIZE];
+    size_t limit = length;
+    if (!session->ended) {
+        while (limit > 0 && thread->buffer[limit - 1] != '\n') {
+            limit--;
+        }
+    }
+    // Parse errors would be reported again each time part of a command is
+    // read, so they aren't reported at all.
+    struct input input = {-1, 1, thread->buffer, limit, 0, 0, 1, {-1, -1}};
+    *used = 0;
 
-    int row = 0;
-    while (row < MAP_ROWS) {
-        int col = 0;
-        while (col < MAP_COLUMNS) {
-            // Checks if tile fits in the offset and spacing
-            if (
-                test_rain(row, offset.row, spacing.row) &&
-                test_rain(col, offset.col, spacing.col) &&
-                map[row][col].land == GRASS
-            ) {
-                map[row][col].land = WATER;
-                delete_tower(map, row, col);
+    if (session->game == NULL) {
+        struct log_header header;
+        scan_header(&input, &header, thread->route, options->rows, 
+                    options->cols);
+        if (input.position >= limit && !session->ended) {
+            return 1;
+        }
+        // A setup that leaves the map ends the session before it gets a 
+        // game.
+        if (!test_setup(&header, thread->route)) {
+            int n_text = snprintf(text, sizeof text, "%s\n", 
+                                  result_message(RESULT_BAD_SETUP));
+            session->ended = 1;
+            *used = length;
+            return append_text(thread, text, n_text);
+        }
+        session->game = allocate_game(options->rows, options->cols);
+        if (session->game == NULL) {
+            return 0;
+        }
+        session->game->map.quiet = 1;
+        int result = apply_setup(session->game, &header, thread->route);
+        if (options->undo) {
+            session->history = allocate_history(session->game);
+            if (session->history == NULL) {
+                return 0;
             }
-            col++;
         }
-        row++;
+        if (result != RESULT_OK) {
+            int n_text = snprintf(text, sizeof text, "%s\n", 
+                                  result_message(result));
+            if (!append_text(thread, text, n_text)) {
+                return 0;
+            }
+        }
+        *used = input.position;
+    }
+
+    int game_condition = CONTINUE;
+    while (game_condition == CONTINUE) {
+        struct command command;
+        int scanned = scan_command(&input, &command);
+        if (
+            scanned == EOF || 
+            (input.position >= limit && !session->ended)
+        ) {
+            break;
+        }
+        if (scanned) {
+            struct event event;
+            // Tower suggestions take every core, and the stats belong to 
+            // the whole program, so a session can't have either.
+            if (command.type == OPTIMIZE || command.type == STATS) {
+                event = (struct event){command.type, RESULT_NOT_SERVED, 0};
+            } else if (session->history != NULL) {
+                game_condition = apply_history(session->history, &command,
+                                               &event);
+            } else {
+                game_condition = apply_command(session->game, &command, 
+                                               &event);
+            }
+            int n_text = event_text(&event, text, sizeof text);
+            if (!append_text(thread, text, n_text)) {
+                return 0;
+            }
+        }
+        *used = input.position;
+    }
+
+    if (game_condition == STOP) {
+        const char *lost = "Oh no, you ran out of lives!";
+        if (!append_text(thread, lost, strlen(lost))) {
+            return 0;
+        }
+        session->ended = 1;
     }
+    if (session->ended) {
+        *used = length;
+        const char *over = "\nGame Over!\n";
+        int n_text = summary_text(session->game, text, sizeof text);
+        if (
+            !append_text(thread, text, n_text) ||
+            !append_text(thread, over, strlen(over))
+        ) {
+            return 0;
+        }
+    }
+    return 1;
 }
 
 /**
- * Creates a copy of a 2d array. 
+ * Sends as much of some text as a session's socket will take without 
+ * waiting.
  * 
  * Parameters:
- *     original - original array to copy
- *     copy - blank array to copy into from original
+ *     session - the session to send to
+ *     text - the text to send
+ *     length - length of the text
  * Returns:
- *     nothing
+ *     sent - how many bytes were sent
+ *     EOF - if the client has gone
  */
-void copy_2d_array(struct tile original[MAP_ROWS][MAP_COLUMNS], 
-                   struct tile copy[MAP_ROWS][MAP_COLUMNS]) {
-    int row = 0;
-    while (row < MAP_ROWS) {
-        int col = 0;
-        while (col < MAP_COLUMNS) {
-            copy[row][col] = original[row][col];
-            col++;
+long long send_text(struct session *session, const char *text, 
+                    size_t length) {
+    size_t sent = 0;
+    while (sent < length) {
+        ssize_t n_sent = send(session->fd, text + sent, length - sent, 
+                              MSG_NOSIGNAL);
+        if (n_sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return EOF;
         }
-        row++;
+        sent += n_sent;
     }
+    return sent;
 }
 
 /**
- * Checks if the given tile is floodable.
- * If yes, then floods, and breaks un-fortified towers.
- * Otherwise does nothing.
+ * Closes a session and frees everything it holds.
  * 
  * Parameters:
- *     row - tile row
- *     col - tile col
- *     map - map of the tiles
+ *     thread - the thread serving the session
+ *     session - the session to close
  * Returns:
  *     nothing
  */
-void flood_tile(int row, int col, struct tile map[MAP_ROWS][MAP_COLUMNS]) {
-    if (test_point(row, col) && map[row][col].land == GRASS) {
-        map[row][col].land = WATER;
-        if (
-            map[row][col].entity == BASIC_TOWER || 
-            map[row][col].entity == POWER_TOWER
-        ) {
-            map[row][col].entity = EMPTY;
-        }
+void close_session(struct server_thread *thread, struct session *session) {
+    // Closing the socket also takes it out of the epoll instance.
+    close(session->fd);
+    if (session->prev != NULL) {
+        session->prev->next = session->next;
+    } else {
+        thread->sessions = session->next;
+    }
+    if (session->next != NULL) {
+        session->next->prev = session->prev;
+    }
+    if (session->history != NULL) {
+        free_history(session->history);
     }
+    if (session->game != NULL) {
+        free_game(session->game);
+    }
+    free(session->input);
+    free(session->output);
+    free(session);
 }
 
 /**
- * Converts the surrouding tiles into water land types. 
+ * Accepts a new session, to be served by this thread. Only one is taken at
+ * a time, so that a crowd of clients connecting at once is spread across 
+ * the threads.
  * 
  * Parameters:
- *     row - tile row
- *     col - tile col
- *     map - map of the tiles
- *     map_copy - copy of map
+ *     thread - the server thread
  * Returns:
  *     nothing
  */
-void flood_surrouning(struct tile map[MAP_ROWS][MAP_COLUMNS], 
-                      struct tile map_copy[MAP_ROWS][MAP_COLUMNS],
-                      int row, int col) {
-    if (map_copy[row][col].land == WATER) {
-        flood_tile(row - 1, col, map);
-        flood_tile(row + 1, col, map);
-        flood_tile(row, col - 1, map);
-        flood_tile(row, col + 1, map);
+void accept_session(struct server_thread *thread) {
+    int fd = accept(thread->listener, NULL, NULL);
+    if (fd < 0) {
+        // Another thread took it, or there are too many sessions open.
+        return;
     }
+    struct session *session = calloc(1, sizeof *session);
+    if (session == NULL || fcntl(fd, F_SETFL, O_NONBLOCK) != 0) {
+        free(session);
+        close(fd);
+        return;
+    }
+    session->fd = fd;
+    struct epoll_event event = {EPOLLIN, {.ptr = session}};
+    if (epoll_ctl(thread->epoll, EPOLL_CTL_ADD, fd, &event) != 0) {
+        close(fd);
+        free(session);
+        return;
+    }
+    session->next = thread->sessions;
+    if (thread->sessions != NULL) {
+        thread->sessions->prev = session;
+    }
+    thread->sessions = session;
 }
 
 /**
- * Creates a flood from the given input.
+ * After a session has been served, closes it if it is finished, or else 
+ * waits for what it is ready for next: to take the rest of its output, or
+ * to send more input.
  * 
  * Parameters:
- *     map - map of the tiles
+ *     thread - the thread serving the session
+ *     session - the session
  * Returns:
  *     nothing
  */
-void create_flood(struct tile map[MAP_ROWS][MAP_COLUMNS]) {
-    int repeat = scan_int();
-    int iteration = 0;
-    while (iteration < repeat) {
-        struct tile map_copy[MAP_ROWS][MAP_COLUMNS];
-        copy_2d_array(map, map_copy);
-        
-        // checks each tile for water and if true, floods surroundings.
-        int row = 0;
-        while (row < MAP_ROWS) {
-            int col = 0;
-            while (col < MAP_COLUMNS) {
-                flood_surrouning(map, map_copy, row, col);
-                col++;
-            }
-            row++;
+void watch_session(struct server_thread *thread, struct session *session) {
+    int writing = session->output != NULL;
+    if (!writing && session->ended) {
+        close_session(thread, session);
+        return;
+    }
+    if (writing != session->writing) {
+        struct epoll_event event = {
+            writing ? EPOLLOUT : EPOLLIN, {.ptr = session}
+        };
+        if (epoll_ctl(thread->epoll, EPOLL_CTL_MOD, session->fd, 
+                      &event) != 0) {
+            close_session(thread, session);
+            return;
         }
-        iteration++;
+        session->writing = writing;
     }
 }
 
 /**
- * Creates a copy of the given array.
+ * Sends the rest of a session's output, now that its socket is ready for it.
  * 
  * Parameters:
- *     length - length of the path
- *     original - original array to copy and then convert to 0s.
- *     copy - blank array to copy into from original
+ *     thread - the thread serving the session
+ *     session - the session
  * Returns:
  *     nothing
  */
-void copy_1d_array(int *length, struct coord_data original[MAP_ROWS * MAP_COLUMNS], 
-                   struct coord_data copy[MAP_ROWS * MAP_COLUMNS]) {
-    int i = 0;
-    while (i < *length + 1) {
-        copy[i] = original[i];
-        i++;
+void send_session(struct server_thread *thread, struct session *session) {
+    long long sent = send_text(session, 
+                               session->output + session->output_sent,
+                               session->output_length - session->output_sent);
+    if (sent == EOF) {
+        close_session(thread, session);
+        return;
+    }
+    session->output_sent += sent;
+    if (session->output_sent == session->output_length) {
+        free(session->output);
+        session->output = NULL;
     }
+    watch_session(thread, session);
 }
 
 /**
- * deletes the current given path from the path array,
- * and removes the path and enemies from the map.  
+ * Reads what a session has sent and plays it, then sends back what that 
+ * printed. Whatever isn't complete yet is kept in the session, and so is 
+ * whatever output its socket won't take yet, which is sent before any more
+ * input is read.
  * 
  * Parameters:
- *     length - length of the path
- *     original - original array to copy
- *     copy - blank array to copy into from original
+ *     thread - the thread serving the session
+ *     session - the session
  * Returns:
  *     nothing
  */
-void delete_path(struct tile map[MAP_ROWS][MAP_COLUMNS], int *path_length,
-                 struct coord_data path[MAP_ROWS * MAP_COLUMNS]) {
-    int i = 0;
-    while (i < *path_length) {
-        struct coord_data current = path[i];
-        map[current.row][current.col].land = GRASS;
-        map[current.row][current.col].entity = EMPTY;
-        map[current.row][current.col].n_enemies = 0; 
-        path[i].row = 0;
-        path[i].col = 0;
-        i++;
+void read_session(struct server_thread *thread, struct session *session) {
+    // What was left over last time goes in front of what has arrived.
+    size_t length = session->input_length;
+    if (length + INPUT_BLOCK_SIZE > thread->buffer_size) {
+        size_t size = 2 * thread->buffer_size;
+        while (size < length + INPUT_BLOCK_SIZE) {
+            size *= 2;
+        }
+        char *grown = realloc(thread->buffer, size);
+        if (grown == NULL) {
+            close_session(thread, session);
+            return;
+        }
+        thread->buffer = grown;
+        thread->buffer_size = size;
+    }
+    ssize_t n_read = recv(session->fd, thread->buffer + length, 
+                          INPUT_BLOCK_SIZE, 0);
+    if (n_read < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            close_session(thread, session);
+        }
+        return;
+    }
+    if (length > 0) {
+        memcpy(thread->buffer, session->input, length);
+    }
+    if (n_read == 0) {
+        session->ended = 1;
+    }
+    length += n_read;
+
+    thread->text_length = 0;
+    size_t used;
+    if (!serve_input(thread, session, length, &used)) {
+        close_session(thread, session);
+        return;
     }
+    size_t left = length - used;
+    if (left != session->input_length) {
+        char *kept = NULL;
+        if (left > 0) {
+            kept = malloc(left);
+            if (kept == NULL) {
+                close_session(thread, session);
+                return;
+            }
+            memcpy(kept, thread->buffer + used, left);
+        }
+        free(session->input);
+        session->input = kept;
+        session->input_length = left;
+    } else if (left > 0) {
+        memcpy(session->input, thread->buffer + used, left);
+    }
+
+    long long sent = send_text(session, thread->text, thread->text_length);
+    if (sent == EOF) {
+        close_session(thread, session);
+        return;
+    }
+    if (sent < (long long)thread->text_length) {
+        session->output_length = thread->text_length - sent;
+        session->output_sent = 0;
+        session->output = malloc(session->output_length);
+        if (session->output == NULL) {
+            close_session(thread, session);
+            return;
+        }
+        memcpy(session->output, thread->text + sent, session->output_length);
+    }
+    watch_session(thread, session);
 }
 
 /**
- * Creates a new path with the teleporters. When the path reaches the start
- * teleporter, the code skips the path until it reaches the end teleporter. 
+ * Serves sessions on one thread until the server stops, then closes them.
  * 
  * Parameters:
- *     *path_length - length of the created path
- *     start_tele - position along the path where the teleporter starts
- *     end_tele - position along the path where the teleporter ends
- *     path - struct array of the coordinates of the path route
- *     path_copy - copy of the array of the path
- *     map - map of the tiles 
- *     map_copy - copy of the map of the tiles 
- *     end - coordinates of the end tile
+ *     data - the server thread
  * Returns:
- *     nothing
+ *     NULL
  */
-void create_tele_path(int *path_length, int start_tele, int end_tele,
-                      struct coord_data path[MAP_ROWS * MAP_COLUMNS],
-                      struct coord_data path_copy[MAP_ROWS * MAP_COLUMNS],
-                      struct tile map[MAP_ROWS][MAP_COLUMNS],
-                      struct tile map_copy[MAP_ROWS][MAP_COLUMNS], 
-                      struct coord_data end) {
-    int new_path_count = 0;
-    int i = 0;
-    while (i < *path_length + 1) {
-        struct coord_data current = path_copy[i];
-
-        path[new_path_count] = current;
-        map[current.row][current.col] = map_copy[current.row][current.col];
-        if (i == start_tele) {
-            map[current.row][current.col].land = TELEPORTER;
-            i = end_tele;
-        } else {
-            if (i == end_tele) {
-                map[current.row][current.col].land = TELEPORTER;
+void *run_server_thread(void *data) {
+    struct server_thread *thread = data;
+    struct epoll_event events[SERVER_EVENTS];
+    int running = 1;
+    while (running) {
+        int n_events = epoll_wait(thread->epoll, events, SERVER_EVENTS, -1);
+        if (n_events < 0 && errno != EINTR) {
+            break;
+        }
+        int i = 0;
+        while (i < n_events) {
+            void *target = events[i].data.ptr;
+            if (target == &thread->listener) {
+                accept_session(thread);
+            } else if (target == &thread->wake) {
+                running = 0;
+            } else {
+                struct session *session = target;
+                if (session->writing) {
+                    send_session(thread, session);
+                } else {
+                    read_session(thread, session);
+                }
             }
             i++;
         }
-        new_path_count++;
     }
-    path[i] = end;
-    *path_length = new_path_count - 1;
+    while (thread->sessions != NULL) {
+        close_session(thread, thread->sessions);
+    }
+    return NULL;
 }
 
 /**
- * Creates a teleporter on the path. Enemies travel from one teleporter 
- * to the next. 
+ * Sets up a thread of the server, with its own epoll instance watching the
+ * listening socket and the wake pipe, and starts it.
  * 
  * Parameters:
- *     map - map of the tiles 
- *     *path_length - length of the created path
- *     path - struct array of the coordinates of the path route
- *     end - coordinates of the end tile
+ *     thread - the thread to start
+ *     options - the command line options
+ *     listener - the listening socket
+ *     wake - the read end of the wake pipe
  * Returns:
- *     nothing
+ *     1 - if the thread started
+ *     0 - if not.
  */
-void create_teleporter(struct tile map[MAP_ROWS][MAP_COLUMNS], int *path_length,
-                       struct coord_data path[MAP_ROWS * MAP_COLUMNS],
-                       struct coord_data end) {
-    struct coord_data tele_1;
-    tele_1 = scan_coords();
-    struct coord_data tele_2;
-    tele_2 = scan_coords();     
-    
-    int i = 0;
-    int tele_path_1 = EOF;
-    int tele_path_2 = EOF;
-    // mins one since we dont want to test the end tile
-    // determines where on the path the teleporters lie. 
-    while (i < *path_length) {
-        if (path[i].row == tele_1.row && path[i].col == tele_1.col) {
-            tele_path_1 = i;
-        }
-        else if (path[i].row == tele_2.row && path[i].col == tele_2.col) {
-            tele_path_2 = i;
-        }
-        i++;
+int start_server_thread(struct server_thread *thread, 
+                        struct options *options, int listener, int wake) {
+    thread->options = options;
+    thread->listener = listener;
+    thread->wake = wake;
+    thread->sessions = NULL;
+    thread->buffer_size = 2 * INPUT_BLOCK_SIZE;
+    thread->buffer = malloc(thread->buffer_size);
+    thread->text_length = 0;
+    thread->text_size = INPUT_BLOCK_SIZE;
+    thread->text = malloc(thread->text_size);
+    thread->route = malloc((size_t)options->rows * options->cols + 1);
+    thread->epoll = epoll_create1(EPOLL_CLOEXEC);
+    // Every thread waits on the listener, but EPOLLEXCLUSIVE only wakes one
+    // of them for each new client.
+    struct epoll_event accepting = {
+        EPOLLIN | EPOLLEXCLUSIVE, {.ptr = &thread->listener}
+    };
+    struct epoll_event stopping = {EPOLLIN, {.ptr = &thread->wake}};
+    if (
+        thread->buffer != NULL && thread->text != NULL && 
+        thread->route != NULL && thread->epoll >= 0 &&
+        epoll_ctl(thread->epoll, EPOLL_CTL_ADD, listener, &accepting) == 0 &&
+        epoll_ctl(thread->epoll, EPOLL_CTL_ADD, wake, &stopping) == 0 &&
+        pthread_create(&thread->thread, NULL, run_server_thread, 
+                       thread) == 0
+    ) {
+        return 1;
     }
-    // If above loop didn't find teleporters on the path, then print error. 
-    if (tele_path_1 == EOF || tele_path_2 == EOF) {
-        printf("Error: Teleporters can only be created on path tiles.\n");
-    } else {
-        struct coord_data path_copy[MAP_ROWS * MAP_COLUMNS];
-        copy_1d_array(path_length, path, path_copy);      
-        
-        struct tile map_copy[MAP_ROWS][MAP_COLUMNS];
-        copy_2d_array(map, map_copy);
-
-        delete_path(map, path_length, path);
-
-        // teleporter that appears earlier in the path is set as start tele.
-        if (tele_path_1 < tele_path_2) {
-            create_tele_path(path_length, tele_path_1, tele_path_2, path, 
-                             path_copy, map, map_copy, end);
-        } else {
-            create_tele_path(path_length, tele_path_2, tele_path_1, path, 
-                             path_copy, map, map_copy, end);
-        }            
+    free(thread->buffer);
+    free(thread->text);
+    free(thread->route);
+    if (thread->epoll >= 0) {
+        close(thread->epoll);
     }
+    return 0;
+}
 
+/**
+ * Waits for a server thread to close its sessions and finish, then frees 
+ * it.
+ * 
+ * Parameters:
+ *     thread - the thread to stop, which has been told to
+ * Returns:
+ *     nothing
+ */
+void stop_server_thread(struct server_thread *thread) {
+    pthread_join(thread->thread, NULL);
+    free(thread->buffer);
+    free(thread->text);
+    free(thread->route);
+    close(thread->epoll);
+}
 
+/**
+ * Opens a Unix domain socket listening at the given path, replacing any
+ * socket left there by a server that didn't stop cleanly.
+ * 
+ * Parameters:
+ *     name - path of the socket
+ * Returns:
+ *     listener - the listening socket, which doesn't block
+ *     EOF - if it couldn't be opened
+ */
+int open_listener(const char *name) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof address);
+    address.sun_family = AF_UNIX;
+    if (strlen(name) >= sizeof address.sun_path) {
+        return EOF;
+    }
+    strcpy(address.sun_path, name);
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                          0);
+    if (listener < 0) {
+        return EOF;
+    }
+    struct stat info;
+    if (lstat(name, &info) == 0 && S_ISSOCK(info.st_mode)) {
+        unlink(name);
+    }
+    if (
+        bind(listener, (struct sockaddr *)&address, sizeof address) != 0 ||
+        listen(listener, SOMAXCONN) != 0
+    ) {
+        close(listener);
+        return EOF;
+    }
+    return listener;
 }
 
 /**
- * Prints Game Over and ends the program 
+ * Serves games over a Unix domain socket until the program is interrupted 
+ * or terminated. Each client plays its own game, sending what it would type
+ * into a headless game and getting back what that would print. The sessions
+ * are shared among a pool of threads, each serving its own with epoll.
  * 
  * Parameters:
- *     none.
+ *     options - the command line options, naming the socket
  * Returns:
- *     0 - return nothing to end main.
+ *     0 - if the server ran
+ *     1 - if not.
  */
-int game_over(void) {
-    printf("\nGame Over!\n");
-    return 0;
+int run_server(struct options *options) {
+    // The signals that stop the server are waited for here, so they are 
+    // blocked before the threads start and inherit that.
+    sigset_t stopping;
+    sigemptyset(&stopping);
+    sigaddset(&stopping, SIGINT);
+    sigaddset(&stopping, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stopping, NULL);
+
+    // Every session needs a file descriptor, so take as many as allowed.
+    struct rlimit files;
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0) {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
+
+    int listener = open_listener(options->serve);
+    if (listener < 0) {
+        fprintf(stderr, "Error: Could not listen on %s.\n", options->serve);
+        return 1;
+    }
+    int wake[2];
+    struct server_thread *threads = 
+        malloc(options->threads * sizeof *threads);
+    if (threads == NULL || pipe(wake) != 0) {
+        fprintf(stderr, "Error: Could not start a server on %s.\n", 
+                options->serve);
+        free(threads);
+        close(listener);
+        unlink(options->serve);
+        return 1;
+    }
+    int n_threads = 0;
+    while (
+        n_threads < options->threads &&
+        start_server_thread(&threads[n_threads], options, listener, wake[0])
+    ) {
+        n_threads++;
+    }
+
+    int caught = 0;
+    if (n_threads > 0) {
+        printf("Serving %dx%d games on %s with %d threads.\n", options->rows,
+               options->cols, options->serve, n_threads);
+        fflush(stdout);
+        sigwait(&stopping, &caught);
+    } else {
+        fprintf(stderr, "Error: Could not start a server on %s.\n", 
+                options->serve);
+    }
+    // The wake pipe stays readable once written to, so it wakes every 
+    // thread.
+    if (write(wake[1], "", 1) != 1) {
+        fprintf(stderr, "Error: Could not stop the server threads.\n");
+    }
+    int i = 0;
+    while (i < n_threads) {
+        stop_server_thread(&threads[i]);
+        i++;
+    }
+    free(threads);
+    close(wake[0]);
+    close(wake[1]);
+    close(listener);
+    unlink(options->serve);
+    return n_threads > 0 ? 0 : 1;
 }
 
-////////////////////////////////////////////////////////////////////////////////
 /////////////////////////// PROVIDED FUNCTIONS  ///////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 // Written and provided by University of New South Wales (2023)
@@ -1006,13 +8573,36 @@ int game_over(void) {
  * Returns:
  *     Nothing.
  */
-void initialise_map(struct tile map[MAP_ROWS][MAP_COLUMNS]) {
-    for (int row = 0; row < MAP_ROWS; ++row) {
-        for (int col = 0; col < MAP_COLUMNS; ++col) {
-            map[row][col].land = GRASS;
-            map[row][col].entity = EMPTY;
-            map[row][col].n_enemies = 0;
+void initialise_map(struct map *map) {
+    size_t n_tiles = (size_t)map->rows * map->cols;
+    memset(map->tile, GRASS | EMPTY << LAND_BITS, n_tiles * sizeof *map->tile);
+    int i = 0;
+    while ((size_t)i < n_tiles) {
+        map->path_index[i] = NOT_PATH;
+        i++;
+    }
+    // There is a damage slot for every tile the path can visit and the end,
+    // then one for every tile and exit of its branches.
+    memset(map->damage, 0, 
+           (2 * n_tiles + 1 + MAX_BRANCHES) * sizeof *map->damage);
+
+    size_t n_words = (size_t)map->rows * map->words;
+    memset(map->water, 0, n_words * sizeof *map->water);
+    memset(map->basic, 0, n_words * sizeof *map->basic);
+    memset(map->power, 0, n_words * sizeof *map->power);
+    memset(map->frontier, 0, n_words * sizeof *map->frontier);
+    map->frontier_first = map->rows;
+    map->frontier_last = -1;
+    // Every column of every row starts as grass
+    memset(map->grass, 0, n_words * sizeof *map->grass);
+    int row = 0;
+    while (row < map->rows) {
+        int col = 0;
+        while (col < map->cols) {
+            set_bit(map, map->grass, row, col, 1);
+            col++;
         }
+        row++;
     }
 }
 
@@ -1021,73 +8611,135 @@ void initialise_map(struct tile map[MAP_ROWS][MAP_COLUMNS]) {
  * the `land_print` parameter;
  * 
  * Parameters:
- *     tile - The tile to print the land/entity from
+ *     map - The map holding the tile
+ *     path - The path holding the enemies
+ *     row - The row of the tile to print
+ *     col - The column of the tile to print
  *     land_print - Whether to print the land part of the tile or the entity
  *         part of the tile. If this value is 0, it prints the land, otherwise
  *         it prints the entity.
+ *     frame - The frame to print the tile into.
  * Returns:
- *     Nothing.
+ *     1 - if the tile was printed
+ *     0 - if there wasn't enough memory to.
  */
-void print_tile(struct tile tile, int land_print) {
+int print_tile(struct map *map, struct path *path, int row, int col, 
+               int land_print, struct frame *frame) {
+    int index = tile_index(map, row, col);
+    char *text = " ? ";
     if (land_print) {
-        if (tile.land == GRASS) {
-            printf(" . ");
-        } else if (tile.land == WATER) {
-            printf(" ~ ");
-        } else if (tile.land == PATH_START) {
-            printf(" S ");
-        } else if (tile.land == PATH_END) {
-            printf(" E ");
-        } else if (tile.land == PATH_UP) {
-            printf(" ^ ");
-        } else if (tile.land == PATH_RIGHT) {
-            printf(" > ");
-        } else if (tile.land == PATH_DOWN) {
-            printf(" v ");
-        } else if (tile.land == PATH_LEFT) {
-            printf(" < ");
-        } else if (tile.land == TELEPORTER) {
-            printf("( )");
-        } else {
-            printf(" ? ");
+        int land = tile_land(map, index);
+        if (land == GRASS) {
+            text = " . ";
+        } else if (land == WATER) {
+            text = " ~ ";
+        } else if (land == PATH_START) {
+            text = " S ";
+        } else if (land == PATH_END) {
+            text = " E ";
+        } else if (land == PATH_UP) {
+            text = " ^ ";
+        } else if (land == PATH_RIGHT) {
+            text = " > ";
+        } else if (land == PATH_DOWN) {
+            text = " v ";
+        } else if (land == PATH_LEFT) {
+            text = " < ";
+        } else if (land == TELEPORTER) {
+            text = "( )";
         }
     } else {
-        if (tile.entity == EMPTY) {
-            printf("   ");
-        } else if (tile.entity == ENEMY) {
-            printf("%03d", tile.n_enemies);
-        } else if (tile.entity == BASIC_TOWER) {
-            printf("[B]");
-        } else if (tile.entity == POWER_TOWER) {
-            printf("[P]");
-        } else if (tile.entity == FORTIFIED_TOWER) {
-            printf("[F]");
-        } else {
-            printf(" ? ");
+        int entity = tile_entity(map, index);
+        int n_enemies = 0;
+        int position = 0;
+        int segment = tile_segment(map, path, row, col, &position);
+        if (segment != NO_SEGMENT) {
+            n_enemies = *segment_enemies(path, segment, position);
+        }
+        if (n_enemies > 0) {
+            entity = ENEMY;
+        }
+        if (entity == EMPTY) {
+            text = "   ";
+        } else if (entity == ENEMY) {
+            // Writes the count with at least 3 digits, like "%03d"
+            char digits[16];
+            int n_digits = 0;
+            while (n_enemies > 0 || n_digits < TILE_WIDTH) {
+                digits[n_digits] = '0' + n_enemies % 10;
+                n_enemies /= 10;
+                n_digits++;
+            }
+            char *out = reserve_frame(frame, n_digits);
+            if (out == NULL) {
+                return 0;
+            }
+            int i = 0;
+            while (i < n_digits) {
+                out[i] = digits[n_digits - 1 - i];
+                i++;
+            }
+            frame->length += n_digits;
+            return 1;
+        } else if (entity == BASIC_TOWER) {
+            text = "[B]";
+        } else if (entity == POWER_TOWER) {
+            text = "[P]";
+        } else if (entity == FORTIFIED_TOWER) {
+            text = "[F]";
         }
     }
+    char *out = reserve_frame(frame, TILE_WIDTH);
+    if (out == NULL) {
+        return 0;
+    }
+    memcpy(out, text, TILE_WIDTH);
+    frame->length += TILE_WIDTH;
+    return 1;
 }
 
 
 /**
  * Prints all map tiles based on their value, with a header displaying lives
- * and money.
+ * and money. The whole map is drawn into a frame first and written out in 
+ * one go. If there isn't enough memory to draw all of it, none of it is 
+ * printed.
  * 
  * Parameters:
  *     map   - The map to print tiles from.
+ *     path  - The path with the enemies to print.
  *     lives - The number of lives to print with the map.
  *     money - The amount of money to print with the map.
+ *     frame - The frame to draw into, or NULL if the game is headless.
  * Returns:
  *     Nothing.
  */
-void print_map(struct tile map[MAP_ROWS][MAP_COLUMNS], int lives, int money) {
-    printf("\nLives: %d Money: $%d\n", lives, money);
-    for (int row = 0; row < MAP_ROWS * 2; ++row) {
-        for (int col = 0; col < MAP_COLUMNS; ++col) {
-            print_tile(map[row / 2][col], row % 2);
+void print_map(struct map *map, struct path *path, int lives, int money,
+               struct frame *frame) {
+    if (frame == NULL) {
+        return;
+    }
+    frame->length = 0;
+    char *header = reserve_frame(frame, 64);
+    if (header == NULL) {
+        return;
+    }
+    int header_length = snprintf(header, 64, "\nLives: %d Money: $%d\n", 
+                                 lives, money);
+    frame->length += header_length;
+    for (int row = 0; row < map->rows * 2; ++row) {
+        for (int col = 0; col < map->cols; ++col) {
+            if (!print_tile(map, path, row / 2, col, row % 2, frame)) {
+                return;
+            }
         }
-        printf("\n");
+        char *newline = reserve_frame(frame, 1);
+        if (newline == NULL) {
+            return;
+        }
+        *newline = '\n';
+        frame->length++;
     }
+    fwrite(frame->text, 1, frame->length, stdout);
 }
 
-